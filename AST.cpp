@@ -1,135 +1,155 @@
+#include <atomic>
+
 #include "AST.hpp"
 
 namespace AST {
         void to_sexp(std::ostream& os, const expr& e) {
                 ToSExp to_sexp(os);
-                std::visit(to_sexp, *e);
+                Traverse::run<Unit>(to_sexp, e);
         }
 
-        std::string genvar() {
-                static int counter = 0;
+        symbol genvar() {
+                static std::atomic<int> counter{0};
                 return "__ast_var_" + std::to_string(counter++);
         }
 
-        void AlphaConvert::push_env(const std::string& k, const std::string& v) {
+        void AlphaConvert::push_env(const symbol& k, const symbol& v) {
+                auto it = innermost.find(k);
+                shadowed.push_back((it == innermost.end()) ? std::nullopt : std::optional<size_t>{it->second});
+                innermost[k] = env.size();
                 env.emplace_back(k, v);
         }
         void AlphaConvert::pop_env() {
+                if (shadowed.back()) {
+                        innermost[env.back().first] = *shadowed.back();
+                } else {
+                        innermost.erase(env.back().first);
+                }
+                shadowed.pop_back();
                 env.pop_back();
         }
-        std::optional<std::string> AlphaConvert::find_env(const std::string& k) {
-                auto res = std::find_if(env.rbegin(), env.rend(), [&](const auto& p) { return p.first == k; });
-                return (res == env.rend()) ? std::nullopt : std::optional<std::string>{res->second};
+        std::optional<symbol> AlphaConvert::find_env(const symbol& k) {
+                auto res = innermost.find(k);
+                return (res == innermost.end()) ? std::nullopt : std::optional<symbol>{env[res->second].second};
         }
 
 
-        void AlphaConvert::operator()(const F64& e) { result = make_expr<F64>(e); }
-        void AlphaConvert::operator()(const Bool& e) { result = make_expr<Bool>(e); }
-        void AlphaConvert::operator()(const Prim& e)  {
+        Step<expr> AlphaConvert::operator()(const F64& e, const Results<expr>&) { return make_expr<F64>(e); }
+        Step<expr> AlphaConvert::operator()(const Bool& e, const Results<expr>&) { return make_expr<Bool>(e); }
+        Step<expr> AlphaConvert::operator()(const Prim& e, const Results<expr>& done)  {
+                if (done.size() < e.args.size()) return descend(e.args[done.size()]);
                 auto tmp = e;
-                for (auto& arg: tmp.args) {
-                        std::visit(*this, *arg);
-                        arg = result;
-                }
-                result = make_expr<Prim>(tmp);
+                tmp.args = exprs(done.begin(), done.end());
+                return make_expr<Prim>(tmp);
         }
-        void AlphaConvert::operator()(const Tuple& e) {
+        Step<expr> AlphaConvert::operator()(const Tuple& e, const Results<expr>& done) {
+                if (done.size() < e.fields.size()) return descend(e.fields[done.size()]);
                 auto tmp = e;
-                for (auto& field: tmp.fields) {
-                        std::visit(*this, *field);
-                        field = result;
-                }
-                result = make_expr<Tuple>(tmp);
+                tmp.fields = exprs(done.begin(), done.end());
+                return make_expr<Tuple>(tmp);
         }
-        void AlphaConvert::operator()(const Proj& e) {
+        Step<expr> AlphaConvert::operator()(const Proj& e, const Results<expr>& done) {
+                if (done.empty()) return descend(e.tuple);
                 auto tmp = e;
-                std::visit(*this, *tmp.tuple);
-                tmp.tuple = result;
-                result = make_expr<Proj>(tmp);
+                tmp.tuple = done[0];
+                return make_expr<Proj>(tmp);
 
         }
-        void AlphaConvert::operator()(const Var& e)   {
+        Step<expr> AlphaConvert::operator()(const Var& e, const Results<expr>&)   {
                 auto tmp = e;
                 tmp.name = find_env(e.name).value_or(e.name);
-                result = make_expr<Var>(tmp);
-        }
-        void AlphaConvert::operator()(const Let& e) {
+                return make_expr<Var>(tmp);
+        }
+        Step<expr> AlphaConvert::operator()(const Let& e, const Results<expr>& done) {
+                switch (done.size()) {
+                case 0:
+                        return descend(e.val);
+                case 1:
+                        push_env(e.var, genvar());
+                        return descend(e.body);
+                }
                 auto tmp = e;
-                std::visit(*this, *tmp.val);
-                tmp.val = result;
-                tmp.var = genvar();
-                push_env(e.var, tmp.var);
-                std::visit(*this, *tmp.body);
-                tmp.body = result;
-                result = make_expr<Let>(tmp);
+                tmp.val = done[0];
+                tmp.var = env.back().second;
+                tmp.body = done[1];
                 pop_env();
+                return make_expr<Let>(tmp);
         }
-        void AlphaConvert::operator()(const Lam& e) {
-                auto tmp = e;
-                for (auto& arg: tmp.args) {
-                        auto rep = genvar();
-                        push_env(arg, rep);
-                        arg = rep;
+        Step<expr> AlphaConvert::operator()(const Lam& e, const Results<expr>& done) {
+                if (done.empty()) {
+                        for (const auto& arg: e.args) push_env(arg, genvar());
+                        return descend(e.body);
                 }
-                std::visit(*this, *tmp.body);
-                tmp.body = result;
-                result = make_expr<Lam>(tmp);
-                env.erase(env.begin() + env.size() - tmp.args.size(), env.end());
-        }
-        void AlphaConvert::operator()(const App& e) {
                 auto tmp = e;
-                std::visit(*this, *tmp.fun);
-                tmp.fun = result;
-                for (auto& arg: tmp.args) {
-                        std::visit(*this, *arg);
-                        arg = result;
+                auto first = env.begin() + env.size() - tmp.args.size();
+                std::transform(first, env.end(), tmp.args.begin(), [](const auto& p) { return p.second; });
+                tmp.body = done[0];
+                for (auto ix = 0ul; ix < tmp.args.size(); ++ix) pop_env();
+                return make_expr<Lam>(tmp);
+        }
+        Step<expr> AlphaConvert::operator()(const App& e, const Results<expr>& done) {
+                if (done.empty()) return descend(e.fun);
+                if (done.size() <= e.args.size()) return descend(e.args[done.size() - 1]);
+                auto tmp = e;
+                tmp.fun = done[0];
+                tmp.args = exprs(done.begin() + 1, done.end());
+                return make_expr<App>(tmp);
+        }
+        Step<expr> AlphaConvert::operator()(const Cond& e, const Results<expr>& done) {
+                switch (done.size()) {
+                case 0: return descend(e.pred);
+                case 1: return descend(e.on_t);
+                case 2: return descend(e.on_f);
                 }
-                result = make_expr<App>(tmp);
-        }
-        void AlphaConvert::operator()(const Cond& e) {
                 auto tmp = e;
-                std::visit(*this, *tmp.pred);
-                tmp.pred = result;
-                std::visit(*this, *tmp.on_t);
-                tmp.on_t = result;
-                std::visit(*this, *tmp.on_f);
-                tmp.on_f = result;
-                result = make_expr<Cond>(tmp);
+                tmp.pred = done[0];
+                tmp.on_t = done[1];
+                tmp.on_f = done[2];
+                return make_expr<Cond>(tmp);
         }
 
         expr alpha_convert(const expr& e) {
                 auto alpha = AST::AlphaConvert();
-                std::visit(alpha, *e);
-                return alpha.result;
+                return Traverse::run<expr>(alpha, e);
         }
 
-        template<typename E, typename... Ts> expr make_expr(const Ts&... args) { return std::make_shared<Expr>(E(args...)); }
+        template<typename E, typename... Ts> expr make_expr(const Ts&... args) { return Memory::make_node<Expr>(E(args...)); }
         expr boolean(const bool b) { return make_expr<Bool>(b); }
         expr tuple(const std::vector<expr>& fs) { return make_expr<Tuple>(fs); }
         expr project(size_t i, const expr& f) { return make_expr<Proj>(i, f); }
         expr cond(const expr& p, const expr& t, const expr& f) { return make_expr<Cond>(p, t, f); }
         expr f64(double v) { return make_expr<F64>(v); }
-        expr var(const std::string& n) { return make_expr<Var>(n); }
+        expr var(const symbol& n) { return make_expr<Var>(n); }
         expr prim(const std::string& fun, const std::vector<expr>& args) { return make_expr<Prim>(fun, args); }
         expr add(const expr& l, const expr& r) { return make_expr<Prim>("+", std::vector<expr>{l, r}); }
         expr mul(const expr& l, const expr& r) { return make_expr<Prim>("*", std::vector<expr>{l, r}); }
         expr sub(const expr& l, const expr& r) { return make_expr<Prim>("-", std::vector<expr>{l, r}); }
-        expr lambda(const std::vector<std::string>& args, const expr& body) { return make_expr<Lam>(args, body); }
+        expr div(const expr& l, const expr& r) { return make_expr<Prim>("/", std::vector<expr>{l, r}); }
+        expr exp(const expr& x) { return make_expr<Prim>("exp", std::vector<expr>{x}); }
+        expr log(const expr& x) { return make_expr<Prim>("log", std::vector<expr>{x}); }
+        expr expm1(const expr& x) { return make_expr<Prim>("expm1", std::vector<expr>{x}); }
+        expr exprelr(const expr& x) { return make_expr<Prim>("exprelr", std::vector<expr>{x}); }
+        expr lt(const expr& l, const expr& r) { return make_expr<Prim>("<", std::vector<expr>{l, r}); }
+        expr gt(const expr& l, const expr& r) { return make_expr<Prim>(">", std::vector<expr>{l, r}); }
+        expr le(const expr& l, const expr& r) { return make_expr<Prim>("<=", std::vector<expr>{l, r}); }
+        expr ge(const expr& l, const expr& r) { return make_expr<Prim>(">=", std::vector<expr>{l, r}); }
+        expr lambda(const std::vector<symbol>& args, const expr& body, const std::vector<Types::type>& arg_types) { return make_expr<Lam>(args, body, arg_types); }
         expr apply(const expr& fun, const std::vector<expr>& args) { return make_expr<App>(fun, args); }
-        expr let(const std::string& var, const expr& bind, const expr& in, const Types::type& t) { return make_expr<Let>(var, bind, in, t); }
+        expr let(const symbol& var, const expr& bind, const expr& in, const Types::type& t) { return make_expr<Let>(var, bind, in, t); }
 
-        expr pi(const std::string& var, size_t field, const expr& tuple, const expr& in) { return let(var, project(field, tuple), in); }
-        expr defn(const std::string& name, const std::vector<std::string>& args, const expr& body, const expr& in) { return let(name, lambda(args, body), in); }
+        expr pi(const symbol& var, size_t field, const expr& tuple, const expr& in) { return let(var, project(field, tuple), in); }
+        expr defn(const symbol& name, const std::vector<symbol>& args, const expr& body, const expr& in) { return let(name, lambda(args, body), in); }
 
         expr operator"" _var(const char* v, size_t) { return var(v); }
         expr operator"" _f64(long double v) { return f64(v); }
         expr operator *(const expr& l, const expr& r) { return mul(l, r); }
         expr operator +(const expr& l, const expr& r) { return add(l, r); }
         expr operator -(const expr& l, const expr& r) { return sub(l, r); }
+        expr operator /(const expr& l, const expr& r) { return div(l, r); }
 
         expr typecheck(const expr& e) {
                 auto types = TypeCheck();
-                return std::visit(types, *e);
+                return Traverse::run<expr>(types, e);
         }
         void type_error(const std::string& m, const expr& ctx) {
                 std::stringstream ss;
@@ -137,7 +157,7 @@ namespace AST {
                 if (ctx) {
                         ss << "\n";
                         auto sexp = AST::ToSExp(ss, 2, "  |");
-                        std::visit(sexp, *ctx);
+                        Traverse::run<Unit>(sexp, ctx);
                 }
                 throw TypeError{ss.str()};
         }
@@ -12,6 +12,9 @@
 #include <exception>
 
 #include "Types.hpp"
+#include "Arena.hpp"
+#include "Symbol.hpp"
+#include "Traverse.hpp"
 
 using namespace std::string_literals;
 
@@ -38,6 +41,8 @@ namespace AST {
                               Let,
                               Cond>;
     using expr = std::shared_ptr<Expr>;
+    using exprs = Memory::SmallVector<expr, 4>;
+    using symbol = Symbols::Symbol;
 
     struct F64: Types::Typed {
         const double val;
@@ -56,41 +61,46 @@ namespace AST {
     };
 
     struct Tuple: Types::Typed {
-        std::vector<expr> fields;
+        exprs fields;
         Types::type type = nullptr;
-        Tuple(const std::vector<expr>& fs): fields{fs} {}
+        Tuple(const exprs& fs): fields{fs} {}
     };
 
     struct Var: Types::Typed {
-        std::string name;
+        symbol name;
         Types::type type = nullptr;
-        Var(const std::string& n): name{n} {}
+        Var(const symbol& n): name{n} {}
     };
 
     struct App: Types::Typed {
         expr fun;
-        std::vector<expr> args;
-        App(const expr& f, const std::vector<expr>& as): fun{f}, args{as} {}
+        exprs args;
+        App(const expr& f, const exprs& as): fun{f}, args{as} {}
     };
 
     struct Prim: Types::Typed {
         std::string op;
-        std::vector<expr> args;
-        Prim(const std::string& o, const std::vector<expr>& as): op{o}, args{as} {}
+        exprs args;
+        Prim(const std::string& o, const exprs& as): op{o}, args{as} {}
     };
 
+    // Primitives comparing two F64, yielding a Bool
+    inline bool comparison(const std::string& op) { return (op == "<") || (op == ">") || (op == "<=") || (op == ">="); }
+
     struct Lam: Types::Typed {
-        std::vector<std::string> args;
+        std::vector<symbol> args;
         expr body;
         Types::type type = nullptr;
-        Lam(const std::vector<std::string>& as, const expr& b): args{as}, body{b} {}
+        // optional annotations, nullptr or missing entries are inferred
+        std::vector<Types::type> arg_types;
+        Lam(const std::vector<symbol>& as, const expr& b, const std::vector<Types::type>& ts={}): args{as}, body{b}, arg_types{ts} {}
     };
 
     struct Let: Types::Typed {
-        std::string var;
+        symbol var;
         expr val;
         expr body;
-        Let(const std::string& n, const expr& v, const expr& b, const Types::type& t): Typed{t}, var{n}, val{v}, body{b}  {}
+        Let(const symbol& n, const expr& v, const expr& b, const Types::type& t): Typed{t}, var{n}, val{v}, body{b}  {}
     };
     
     struct Cond: Types::Typed {
@@ -101,6 +111,12 @@ namespace AST {
         Cond(const expr& p, const expr& t, const expr& f): pred{p}, on_t{t}, on_f{f} {}
     };
   
+    // Passes over expressions run on Traverse::run, see there
+    using Traverse::Unit;
+    using Traverse::descend;
+    template<typename R> using Step = Traverse::Step<expr, R>;
+    template<typename R> using Results = std::vector<R>;
+
     struct ToSExp {
         std::ostream& os;
         int indent;
@@ -108,94 +124,118 @@ namespace AST {
 
         ToSExp(std::ostream& os_, int i=0, const std::string& p=""): os{os_}, indent{i}, prefix{p} { os << prefix << std::string(indent, ' '); }
 
-        void operator()(const Prim& e)  {
-           os << "("
-               << e.op
-               << " ";
-            for (const auto& arg: e.args) {
-                std::visit(*this, *arg);
+        Step<Unit> operator()(const Prim& e, const Results<Unit>& done)  {
+            if (done.empty()) {
+                os << "("
+                   << e.op
+                   << " ";
+            } else {
                 os << " ";
             }
+            if (done.size() < e.args.size()) return descend(e.args[done.size()]);
             os << "): " << Types::show_type(e.type);
+            return Unit{};
         }
-        void operator()(const Bool& e){ os << (e.val ? "true" : "false")  << ": " << Types::show_type(e.type); }
-        void operator()(const F64& e) { os << e.val  << ": " << Types::show_type(e.type); }
-        void operator()(const Var& e) { os << e.name << ": " << Types::show_type(e.type); }
-        void operator()(const Lam& e) {
-            os << "(lambda (";
-            for (const auto& arg: e.args) os << arg << " ";
-            indent += 4;
-            os << "): " << Types::show_type(e.type) << '\n' << prefix << std::string(indent, ' ');
-            std::visit(*this, *e.body);
+        Step<Unit> operator()(const Bool& e, const Results<Unit>&) { os << (e.val ? "true" : "false")  << ": " << Types::show_type(e.type); return Unit{}; }
+        Step<Unit> operator()(const F64& e, const Results<Unit>&)  { os << e.val  << ": " << Types::show_type(e.type); return Unit{}; }
+        Step<Unit> operator()(const Var& e, const Results<Unit>&)  { os << e.name << ": " << Types::show_type(e.type); return Unit{}; }
+        Step<Unit> operator()(const Lam& e, const Results<Unit>& done) {
+            if (done.empty()) {
+                os << "(lambda (";
+                for (const auto& arg: e.args) os << arg << " ";
+                indent += 4;
+                os << "): " << Types::show_type(e.type) << '\n' << prefix << std::string(indent, ' ');
+                return descend(e.body);
+            }
             os << ")";
             indent -= 4;
+            return Unit{};
         }
-        void operator()(const Cond& e) {
-            os << "(if ";
-            std::visit(*this, *e.pred);
-            indent += 4;
-            os << "\n" << prefix << std::string(indent, ' ');
-            std::visit(*this, *e.on_t);
-            os << "\n" << prefix << std::string(indent, ' ');
-            std::visit(*this, *e.on_f);
+        Step<Unit> operator()(const Cond& e, const Results<Unit>& done) {
+            switch (done.size()) {
+            case 0:
+                os << "(if ";
+                return descend(e.pred);
+            case 1:
+                indent += 4;
+                os << "\n" << prefix << std::string(indent, ' ');
+                return descend(e.on_t);
+            case 2:
+                os << "\n" << prefix << std::string(indent, ' ');
+                return descend(e.on_f);
+            }
             os << ")";
             indent -= 4;
+            return Unit{};
         }
-        void operator()(const Tuple& e) {
-            os << "(";
-            for (const auto& field: e.fields) {
-                std::visit(*this, *field);
+        Step<Unit> operator()(const Tuple& e, const Results<Unit>& done) {
+            if (done.empty()) {
+                os << "(";
+            } else {
                 os << ", ";
             }
+            if (done.size() < e.fields.size()) return descend(e.fields[done.size()]);
             os << ")";
+            return Unit{};
         }
-        void operator()(const Proj& e) {
-            os << "(pi-" << e.field << " ";
-            std::visit(*this, *e.tuple);
+        Step<Unit> operator()(const Proj& e, const Results<Unit>& done) {
+            if (done.empty()) {
+                os << "(pi-" << e.field << " ";
+                return descend(e.tuple);
+            }
             os << ")";
+            return Unit{};
         }
-        void operator()(const App& e) {
-            os << "(";
-            std::visit(*this, *e.fun);
-            os << " ";
-            for (const auto& arg: e.args) {
-                std::visit(*this, *arg);
-                os << " ";
+        Step<Unit> operator()(const App& e, const Results<Unit>& done) {
+            if (done.empty()) {
+                os << "(";
+                return descend(e.fun);
             }
+            os << " ";
+            if (done.size() <= e.args.size()) return descend(e.args[done.size() - 1]);
             os << ")";
+            return Unit{};
         }
-        void operator()(const Let& e) {
-            os << "(let (" << e.var << " ";
-            std::visit(*this, *e.val);
-            os << ") ";
-            indent += 4;
-            os << "\n" << prefix << std::string(indent, ' ');
-            std::visit(*this, *e.body);
+        Step<Unit> operator()(const Let& e, const Results<Unit>& done) {
+            switch (done.size()) {
+            case 0:
+                os << "(let (" << e.var << " ";
+                return descend(e.val);
+            case 1:
+                os << ") ";
+                indent += 4;
+                os << "\n" << prefix << std::string(indent, ' ');
+                return descend(e.body);
+            }
             os << ")";
             indent -= 4;
+            return Unit{};
         }
     };
 
     void to_sexp(std::ostream& os, const expr& e);
 
-    std::string genvar();
+    symbol genvar();
 
     struct AlphaConvert {
-        expr result;
-        std::vector<std::pair<std::string, std::string>> env;
-        void push_env(const std::string&, const std::string&);
+        // renamings in scope, innermost last; the position of the innermost
+        // one per name, and of the one each renaming shadows, if any
+        std::vector<std::pair<symbol, symbol>> env;
+        std::unordered_map<symbol, size_t> innermost;
+        std::vector<std::optional<size_t>> shadowed;
+        void push_env(const symbol&, const symbol&);
         void pop_env();
-        std::optional<std::string> find_env(const std::string&);
-        void operator()(const F64& e);
-        void operator()(const Bool& e);
-        void operator()(const Prim& e);
-        void operator()(const Tuple& e);
-        void operator()(const Proj& e);
-        void operator()(const Var& e);
-        void operator()(const Let& e);
-        void operator()(const Lam& e);
-        void operator()(const App& e);
-        void operator()(const Cond& e);
+        std::optional<symbol> find_env(const symbol&);
+        Step<expr> operator()(const F64& e, const Results<expr>& done);
+        Step<expr> operator()(const Bool& e, const Results<expr>& done);
+        Step<expr> operator()(const Prim& e, const Results<expr>& done);
+        Step<expr> operator()(const Tuple& e, const Results<expr>& done);
+        Step<expr> operator()(const Proj& e, const Results<expr>& done);
+        Step<expr> operator()(const Var& e, const Results<expr>& done);
+        Step<expr> operator()(const Let& e, const Results<expr>& done);
+        Step<expr> operator()(const Lam& e, const Results<expr>& done);
+        Step<expr> operator()(const App& e, const Results<expr>& done);
+        Step<expr> operator()(const Cond& e, const Results<expr>& done);
     };
 
     expr alpha_convert(const expr& e);
@@ -206,23 +246,33 @@ namespace AST {
     expr project(size_t i, const expr& f);
     expr cond(const expr& p, const expr& t, const expr& f);
     expr f64(double v);
-    expr var(const std::string& n);
+    expr var(const symbol& n);
     expr prim(const std::string&, const std::vector<expr>&);
     expr add(const expr& l, const expr& r);
     expr mul(const expr& l, const expr& r);
     expr sub(const expr& l, const expr& r);
-    expr lambda(const std::vector<std::string>& args, const expr& body);
-    expr apply(const expr& fun, const std::vector<expr>&& args);
-    expr let(const std::string& var, const expr& bind, const expr& in, const Types::type& t=nullptr);
-
-    expr pi(const std::string& var, size_t field, const expr& tuple, const expr& in);
-    expr defn(const std::string& name, const std::vector<std::string>& args, const expr& body, const expr& in);
+    expr div(const expr& l, const expr& r);
+    expr exp(const expr& x);
+    expr log(const expr& x);
+    expr expm1(const expr& x);
+    expr exprelr(const expr& x);
+    expr lt(const expr& l, const expr& r);
+    expr gt(const expr& l, const expr& r);
+    expr le(const expr& l, const expr& r);
+    expr ge(const expr& l, const expr& r);
+    expr lambda(const std::vector<symbol>& args, const expr& body, const std::vector<Types::type>& arg_types={});
+    expr apply(const expr& fun, const std::vector<expr>& args);
+    expr let(const symbol& var, const expr& bind, const expr& in, const Types::type& t=nullptr);
+
+    expr pi(const symbol& var, size_t field, const expr& tuple, const expr& in);
+    expr defn(const symbol& name, const std::vector<symbol>& args, const expr& body, const expr& in);
 
     expr operator"" _var(const char* v, size_t);
     expr operator"" _f64(long double v);
     expr operator *(const expr& l, const expr& r);
     expr operator +(const expr& l, const expr& r);
     expr operator -(const expr& l, const expr& r);
+    expr operator /(const expr& l, const expr& r);
 
     void type_error(const std::string& m, const expr& ctx=nullptr);
 
@@ -230,46 +280,55 @@ namespace AST {
 
     using namespace Types;
     struct TypeCheck {
-        std::vector<std::unordered_map<std::string, type>> context;
-        std::unordered_map<std::string, type> type_vars;
+        // types of the names in scope, in one map for all scopes: binding a
+        // name saves the type it shadows, leaving a scope restores those
+        // saved since entering it
+        std::unordered_map<symbol, type> context;
+        std::vector<std::pair<symbol, type>> shadowed;
+        std::vector<size_t> scopes;
         size_t ty_var_counter;
 
-        TypeCheck(): context({{}}), ty_var_counter{0} {}
+        TypeCheck(): ty_var_counter{0} {}
 
-        type genvar_t() {
-            auto res = var_t("__ty_var_" + std::to_string(ty_var_counter++));
-            return res;
+        void bind(const symbol& name, const type& ty) {
+            auto it = context.find(name);
+            shadowed.emplace_back(name, (it == context.end()) ? nullptr : it->second);
+            context[name] = ty;
         }
-
-        type solve(const type& ty) {
-            type res;
-            for (res = ty; std::holds_alternative<TyVar>(*res);) {
-                auto ty_var = std::get<TyVar>(*res);
-                if (type_vars.find(ty_var.name) != type_vars.end()) {
-                    res = type_vars[ty_var.name];
+        void enter() { scopes.push_back(shadowed.size()); }
+        void leave() {
+            for (; shadowed.size() > scopes.back(); shadowed.pop_back()) {
+                const auto& [name, ty] = shadowed.back();
+                if (ty) {
+                    context[name] = ty;
                 } else {
-                    break;
+                    context.erase(name);
                 }
             }
-            return res;
+            scopes.pop_back();
+        }
+
+        type genvar_t() {
+            return var_t(ty_var_counter++);
+        }
+
+        type solve(const type& ty) {
+            return find(ty);
         }
 
         void unify(const type& lhs, const type& rhs, const expr& ctx=nullptr) {
             auto ty_lhs = solve(lhs);
             auto ty_rhs = solve(rhs);
+            if (ty_lhs == ty_rhs) { return; }
             if ((*ty_lhs) == (*ty_rhs)) { return; }
 
             if (std::holds_alternative<TyVar>(*ty_lhs)) {
-                auto& ty_var_lhs = std::get<TyVar>(*ty_lhs);
-                type_vars[ty_var_lhs.name] = ty_rhs;
-                ty_var_lhs.alias = ty_rhs;
+                link(ty_lhs, ty_rhs);
                 return;
             }
 
             if (std::holds_alternative<TyVar>(*ty_rhs)) {
-                auto& ty_var_rhs = std::get<TyVar>(*ty_rhs);
-                type_vars[ty_var_rhs.name] = ty_lhs;
-                ty_var_rhs.alias = ty_lhs;
+                link(ty_rhs, ty_lhs);
                 return;
             }
 
@@ -314,122 +373,156 @@ namespace AST {
             type_error("Cannot unify types "s + show_type(ty_lhs) + " and " + show_type(ty_rhs), ctx);
         }
 
-        expr operator()(const Var& e) {
+        Step<expr> operator()(const Var& e, const Results<expr>&) {
             auto tmp = e;
-            auto name = e.name;
-            type res = nullptr;
-            for (auto ctx = context.rbegin(); ctx != context.rend(); ++ctx) {
-                if (ctx->find(name) != ctx->end()) {
-                    res = (*ctx)[name];
-                    break;
-                }
-            }
+            auto it = context.find(e.name);
+            type res = (it == context.end()) ? nullptr : it->second;
+            // free names are bound in the innermost scope
             if (!res) {
-                auto ty = genvar_t();
-                context.back()[name] = ty;
-                res = ty;
+                res = genvar_t();
+                bind(e.name, res);
             }
             tmp.type = res;
             return make_expr<Var>(tmp);
         }
-        expr operator()(const F64& e) {
+        Step<expr> operator()(const F64& e, const Results<expr>&) {
             auto tmp = e;
-            tmp.type = f64_t();
+            tmp.type = f64_t(Kind::Unique);
             return make_expr<F64>(tmp);
         }
-        expr operator()(const Prim& e) {
-            auto tmp = e;
-            if ((e.op == "*") ||
-                (e.op == "-") ||
-                (e.op == "+")) {
-                if (e.args.size() != 2) { throw std::runtime_error("Arity error: "s + e.op); }
-                for (auto& arg: tmp.args) {
-                    arg = std::visit(*this, *arg);
-                    unify(get_type(arg), f64_t(), std::make_shared<Expr>(e));
+        Step<expr> operator()(const Prim& e, const Results<expr>& done) {
+            if (done.empty()) {
+                if ((e.op == "*") ||
+                    (e.op == "-") ||
+                    (e.op == "+") ||
+                    (e.op == "/") ||
+                    comparison(e.op)) {
+                    if (e.args.size() != 2) { throw std::runtime_error("Arity error: "s + e.op); }
+                } else if ((e.op == "exp") ||
+                           (e.op == "log") ||
+                           (e.op == "expm1") ||
+                           (e.op == "exprelr")) {
+                    if (e.args.size() != 1) { throw std::runtime_error("Arity error: "s + e.op); }
+                } else {
+                    throw std::runtime_error("Unknow prim op: "s + e.op);
                 }
-                tmp.type = f64_t();
-                return make_expr<Prim>(tmp);
+            } else {
+                unify(get_type(done.back()), f64_t(), Memory::make_node<Expr>(e));
             }
-            throw std::runtime_error("Unknow prim op: "s + e.op);
+            if (done.size() < e.args.size()) return descend(e.args[done.size()]);
+            auto tmp = e;
+            auto kind = Kind::Unique;
+            for (auto ix = 0ul; ix < done.size(); ++ix) {
+                tmp.args[ix] = done[ix];
+                kind = join(kind, kind_of(get_type(done[ix])));
+            }
+            tmp.type = comparison(e.op) ? bool_t(kind) : f64_t(kind);
+            return make_expr<Prim>(tmp);
         }
-        expr operator()(const Tuple& e) {
+        Step<expr> operator()(const Tuple& e, const Results<expr>& done) {
+            if (done.size() < e.fields.size()) return descend(e.fields[done.size()]);
             auto tmp = e;
             auto fields = std::vector<Types::type>{};
-            for (auto& field: tmp.fields) {
-                field = std::visit(*this, *field);
-                fields.push_back(get_type(field));
+            for (auto ix = 0ul; ix < done.size(); ++ix) {
+                tmp.fields[ix] = done[ix];
+                fields.push_back(get_type(done[ix]));
             }
             tmp.type = tuple_t(fields);
             return make_expr<Tuple>(tmp);
         }
-        expr operator()(const Proj& e) {
+        Step<expr> operator()(const Proj& e, const Results<expr>& done) {
+            if (done.empty()) return descend(e.tuple);
             auto tmp = e;
-            tmp.tuple = std::visit(*this, *tmp.tuple);
+            tmp.tuple = done[0];
             auto ty = std::make_shared<Type>(TyTuple{{}, -1});
             auto& tuple_ty = std::get<TyTuple>(*ty);
             for (auto ix = 0ul; ix <= e.field; ++ix) {
                 tuple_ty.field_types.push_back(genvar_t());
             }
-            unify(get_type(tmp.tuple), ty, std::make_shared<Expr>(e));
+            unify(get_type(tmp.tuple), ty, Memory::make_node<Expr>(e));
             tmp.type  =tuple_ty.field_types[e.field];
             return make_expr<Proj>(tmp);
         }
-        expr operator()(const App& e) {
-            auto tmp = e;
-            tmp.fun = std::visit(*this, *tmp.fun);
-            auto ty_fun = get_type(tmp.fun);
-            if (!std::holds_alternative<TyFunc>(*ty_fun)) { type_error("IMPOSSIBLE: Must unify with function", std::make_shared<Expr>(e)); }
-            auto func = std::get<TyFunc>(*ty_fun);
-            for (auto ix = 0ul; ix < func.args.size(); ++ix) {
-                tmp.args[ix] = std::visit(*this, *tmp.args[ix]);
-                auto ty_arg = get_type(tmp.args[ix]);
-                unify(func.args[ix], ty_arg, std::make_shared<Expr>(e));
+        Step<expr> operator()(const App& e, const Results<expr>& done) {
+            if (done.empty()) return descend(e.fun);
+            auto ty_fun = get_type(done[0]);
+            if (!std::holds_alternative<TyFunc>(*ty_fun)) { type_error("IMPOSSIBLE: Must unify with function", Memory::make_node<Expr>(e)); }
+            const auto& func = std::get<TyFunc>(*ty_fun);
+            auto ix = done.size() - 1;
+            if (ix > 0) {
+                unify(func.args[ix - 1], get_type(done.back()), Memory::make_node<Expr>(e));
             }
+            if (ix < func.args.size()) return descend(e.args[ix]);
+            auto tmp = e;
+            tmp.fun = done[0];
+            for (ix = 1; ix < done.size(); ++ix) tmp.args[ix - 1] = done[ix];
             tmp.type = func.result;
             return make_expr<App>(tmp);
         }
-        expr operator()(const Let& e) {
+        Step<expr> operator()(const Let& e, const Results<expr>& done) {
+            switch (done.size()) {
+            case 0:
+                return descend(e.val);
+            case 1:
+                enter();
+                bind(e.var, get_type(done[0]));
+                return descend(e.body);
+            }
             auto tmp = e;
-            tmp.val = std::visit(*this, *tmp.val);
-            auto ty_val = get_type(tmp.val);
-            context.push_back({{e.var, ty_val}});
-            tmp.body = std::visit(*this, *tmp.body);
+            tmp.val = done[0];
+            tmp.body = done[1];
             if (e.type) {
-                unify(tmp.type, e.type, std::make_shared<Expr>(e));
+                unify(tmp.type, e.type, Memory::make_node<Expr>(e));
             }
             tmp.type = get_type(tmp.body);
-            context.pop_back();
+            leave();
             return make_expr<Let>(tmp);
         }
-        expr operator()(const Lam& e) {
+        Step<expr> operator()(const Lam& e, const Results<expr>& done) {
+            if (done.empty()) {
+                enter();
+                for (auto ix = 0ul; ix < e.args.size(); ++ix) {
+                    type t = ((ix < e.arg_types.size()) && e.arg_types[ix]) ? e.arg_types[ix] : genvar_t();
+                    bind(e.args[ix], t);
+                }
+                return descend(e.body);
+            }
             auto tmp = e;
-            context.push_back({});
             auto args = std::vector<type>{};
-            for (const auto& arg: e.args) {
-                type t = genvar_t();
-                args.push_back(t);
-                context.back()[arg] = t;
-             }
-            tmp.body = std::visit(*this, *e.body);
+            for (const auto& arg: e.args) args.push_back(context.at(arg));
+            tmp.body = done[0];
             auto ty_body = get_type(tmp.body);
-            context.pop_back();
+            leave();
             tmp.type = func_t(args, ty_body);
             return make_expr<Lam>(tmp);
         }
-        expr operator()(const Bool& e) {
+        Step<expr> operator()(const Bool& e, const Results<expr>&) {
             auto tmp = e;
-            tmp.type = bool_t();
-            return make_expr<Bool>(e);
+            tmp.type = bool_t(Kind::Unique);
+            return make_expr<Bool>(tmp);
         }
-        expr operator()(const Cond& e) {
+        Step<expr> operator()(const Cond& e, const Results<expr>& done) {
+            switch (done.size()) {
+            case 0:
+                return descend(e.pred);
+            case 1:
+                unify(get_type(done[0]), bool_t(), Memory::make_node<Expr>(e));
+                return descend(e.on_t);
+            case 2:
+                return descend(e.on_f);
+            }
             auto tmp = e;
-            tmp.pred = std::visit(*this, *tmp.pred);
+            tmp.pred = done[0];
+            tmp.on_t = done[1];
+            tmp.on_f = done[2];
             auto ty_pred = get_type(tmp.pred);
-            unify(ty_pred, bool_t(), std::make_shared<Expr>(e));
-            tmp.on_t = std::visit(*this, *tmp.on_t);
-            tmp.on_f = std::visit(*this, *tmp.on_f);
-            unify(get_type(tmp.on_t), get_type(tmp.on_f), std::make_shared<Expr>(e));
+            unify(get_type(tmp.on_t), get_type(tmp.on_f), Memory::make_node<Expr>(e));
             tmp.type = get_type(tmp.on_t);
+            // unique only if the predicate and both arms are
+            auto kind = join(kind_of(ty_pred), join(kind_of(get_type(tmp.on_t)), kind_of(get_type(tmp.on_f))));
+            auto ty = resolve(tmp.type);
+            if ((kind == Kind::Range) && std::holds_alternative<TyF64>(*ty)) tmp.type = f64_t();
+            if ((kind == Kind::Range) && std::holds_alternative<TyBool>(*ty)) tmp.type = bool_t();
             return make_expr<Cond>(tmp);
         }
     };
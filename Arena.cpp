@@ -0,0 +1,45 @@
+#include <cstdint>
+#include <tuple>
+#include <deque>
+
+#include "Arena.hpp"
+
+namespace Memory {
+    void* Arena::allocate(size_t bytes, size_t align) {
+        auto pad = (align - reinterpret_cast<std::uintptr_t>(head) % align) % align;
+        if (!head || (pad + bytes > left)) {
+            auto size = std::max(block_size, bytes + align);
+            blocks.emplace_back(new std::byte[size]);
+            head = blocks.back().get();
+            left = size;
+            pad = (align - reinterpret_cast<std::uintptr_t>(head) % align) % align;
+        }
+        auto res = head + pad;
+        head += pad + bytes;
+        left -= pad + bytes;
+        total += bytes;
+        return res;
+    }
+
+    void Arena::destroy(const std::shared_ptr<Arena>& arena, void* node, void (*dtor)(void*)) {
+        static thread_local bool active = false;
+        static thread_local std::deque<std::tuple<std::shared_ptr<Arena>, void*, void (*)(void*)>> pending;
+        if (active) {
+            pending.emplace_back(arena, node, dtor);
+            return;
+        }
+        active = true;
+        dtor(node);
+        while (!pending.empty()) {
+            auto [a, n, d] = std::move(pending.front());
+            pending.pop_front();
+            d(n);
+        }
+        active = false;
+    }
+
+    std::shared_ptr<Arena>& Arena::current() {
+        static thread_local std::shared_ptr<Arena> arena = nullptr;
+        return arena;
+    }
+}
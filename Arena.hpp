@@ -0,0 +1,178 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <initializer_list>
+
+namespace Memory {
+    // Bump allocator owning the nodes of one IR generation. Nothing is freed
+    // individually; all blocks go at once, when the arena is destroyed.
+    class Arena {
+    public:
+        Arena() = default;
+        Arena(const Arena&) = delete;
+        Arena& operator=(const Arena&) = delete;
+
+        void* allocate(size_t bytes, size_t align);
+        size_t allocated() const { return total; }
+
+        // arena used by make_node on this thread, if any
+        static std::shared_ptr<Arena>& current();
+
+        // Run dtor on a node in arena, if any. Destroying a node drops its
+        // children, which would destroy them recursively, as deep as the
+        // longest chain of nodes; instead, destructions started while one is
+        // running are queued and run in order by the outermost one. Nodes
+        // outside arenas queue freeing their memory the same way.
+        static void destroy(const std::shared_ptr<Arena>& arena, void* node, void (*dtor)(void*));
+
+    private:
+        static constexpr size_t block_size = 64*1024;
+        std::vector<std::unique_ptr<std::byte[]>> blocks;
+        std::byte* head = nullptr;
+        size_t left = 0;
+        size_t total = 0;
+    };
+
+    // Allocates from an arena, which stays alive as long as any node in it,
+    // or from the heap if there is none
+    template<typename T>
+    struct Allocator {
+        using value_type = T;
+        std::shared_ptr<Arena> arena;
+
+        Allocator(const std::shared_ptr<Arena>& a): arena{a} {}
+        template<typename U> Allocator(const Allocator<U>& other): arena{other.arena} {}
+
+        T* allocate(size_t n) { return static_cast<T*>(arena ? arena->allocate(n*sizeof(T), alignof(T)) : ::operator new(n*sizeof(T))); }
+        void deallocate(T* p, size_t) { if (!arena) Arena::destroy(nullptr, p, [](void* q) { ::operator delete(q); }); }
+        template<typename U> void destroy(U* p) { Arena::destroy(arena, p, [](void* q) { static_cast<U*>(q)->~U(); }); }
+
+        template<typename U> bool operator==(const Allocator<U>& other) const { return arena == other.arena; }
+        template<typename U> bool operator!=(const Allocator<U>& other) const { return arena != other.arena; }
+    };
+
+    // Makes all nodes created on this thread come from a fresh arena, until
+    // the scope is left; nodes may outlive the scope.
+    struct Scope {
+        std::shared_ptr<Arena> previous;
+        Scope(): previous{Arena::current()} { Arena::current() = std::make_shared<Arena>(); }
+        ~Scope() { Arena::current() = previous; }
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    template<typename T, typename... Ts> std::shared_ptr<T> make_node(Ts&&... args) {
+        return std::allocate_shared<T>(Allocator<T>{Arena::current()}, std::forward<Ts>(args)...);
+    }
+
+    // Vector storing up to N elements inline, for argument lists of nodes
+    template<typename T, size_t N>
+    class SmallVector {
+    public:
+        using value_type = T;
+        using iterator = T*;
+        using const_iterator = const T*;
+        using size_type = size_t;
+        using reference = T&;
+        using const_reference = const T&;
+
+        SmallVector() = default;
+        SmallVector(std::initializer_list<T> xs) { assign(xs.begin(), xs.end()); }
+        SmallVector(const std::vector<T>& xs) { assign(xs.begin(), xs.end()); }
+        template<typename It> SmallVector(It b, It e) { assign(b, e); }
+        SmallVector(const SmallVector& other) { assign(other.begin(), other.end()); }
+        SmallVector(SmallVector&& other) { take(std::move(other)); }
+        SmallVector& operator=(const SmallVector& other) {
+            if (this != &other) { clear(); assign(other.begin(), other.end()); }
+            return *this;
+        }
+        SmallVector& operator=(SmallVector&& other) {
+            if (this != &other) { clear(); release(); take(std::move(other)); }
+            return *this;
+        }
+        ~SmallVector() { clear(); release(); }
+
+        operator std::vector<T>() const { return std::vector<T>(begin(), end()); }
+
+        T* data() { return ptr; }
+        const T* data() const { return ptr; }
+        iterator begin() { return ptr; }
+        iterator end() { return ptr + count; }
+        const_iterator begin() const { return ptr; }
+        const_iterator end() const { return ptr + count; }
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+
+        T& operator[](size_t ix) { return ptr[ix]; }
+        const T& operator[](size_t ix) const { return ptr[ix]; }
+        T& at(size_t ix) { check(ix); return ptr[ix]; }
+        const T& at(size_t ix) const { check(ix); return ptr[ix]; }
+        T& front() { return ptr[0]; }
+        const T& front() const { return ptr[0]; }
+        T& back() { return ptr[count - 1]; }
+        const T& back() const { return ptr[count - 1]; }
+
+        void reserve(size_t n) {
+            if (n <= capacity) return;
+            auto mem = static_cast<T*>(::operator new(n*sizeof(T)));
+            for (size_t ix = 0; ix < count; ++ix) {
+                new (mem + ix) T(std::move(ptr[ix]));
+                ptr[ix].~T();
+            }
+            release();
+            ptr = mem;
+            capacity = n;
+        }
+        template<typename... Ts> T& emplace_back(Ts&&... args) {
+            if (count == capacity) reserve(2*capacity);
+            new (ptr + count) T(std::forward<Ts>(args)...);
+            return ptr[count++];
+        }
+        void push_back(const T& x) { emplace_back(x); }
+        void push_back(T&& x) { emplace_back(std::move(x)); }
+        void pop_back() { ptr[--count].~T(); }
+        void clear() {
+            for (size_t ix = 0; ix < count; ++ix) ptr[ix].~T();
+            count = 0;
+        }
+
+        bool operator==(const SmallVector& other) const { return std::equal(begin(), end(), other.begin(), other.end()); }
+        bool operator!=(const SmallVector& other) const { return !(*this == other); }
+
+    private:
+        alignas(T) std::byte storage[N*sizeof(T)];
+        T* ptr = reinterpret_cast<T*>(storage);
+        size_t count = 0;
+        size_t capacity = N;
+
+        bool local() const { return ptr == reinterpret_cast<const T*>(storage); }
+        void check(size_t ix) const { if (ix >= count) throw std::out_of_range("SmallVector"); }
+        template<typename It> void assign(It b, It e) {
+            reserve(static_cast<size_t>(std::distance(b, e)));
+            for (; b != e; ++b) emplace_back(*b);
+        }
+        void release() {
+            if (!local()) ::operator delete(ptr);
+            ptr = reinterpret_cast<T*>(storage);
+            capacity = N;
+        }
+        void take(SmallVector&& other) {
+            if (other.local()) {
+                for (auto& x: other) emplace_back(std::move(x));
+                other.clear();
+            } else {
+                ptr = other.ptr;
+                count = other.count;
+                capacity = other.capacity;
+                other.ptr = reinterpret_cast<T*>(other.storage);
+                other.count = 0;
+                other.capacity = N;
+            }
+        }
+    };
+}
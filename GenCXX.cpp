@@ -0,0 +1,912 @@
+#include "GenCXX.hpp"
+
+namespace TailCPS {
+    namespace {
+        // restrict only applies to pointers, unique values are passed by value
+        std::string declare(const std::pair<std::string, std::string>& param) {
+            if (param.first.back() == '*') return param.first + " __restrict__ " + param.second;
+            return param.first + " " + param.second;
+        }
+
+        std::string access_name(Access access) {
+            switch (access) {
+                case Access::None:      return "sc::access::none";
+                case Access::Read:      return "sc::access::read";
+                case Access::Write:     return "sc::access::write";
+                case Access::ReadWrite: return "sc::access::read_write";
+            }
+            return "";
+        }
+
+        std::string result_name(Result result) {
+            switch (result) {
+                case Result::Store:      return "sc::result::store";
+                case Result::Accumulate: return "sc::result::accumulate";
+                case Result::InPlace:    return "sc::result::in_place";
+            }
+            return "";
+        }
+
+        size_t fields_of(const Types::type& t) {
+            auto ty = Types::resolve(t);
+            return std::holds_alternative<Types::TyTuple>(*ty) ? std::get<Types::TyTuple>(*ty).field_types.size() : 1ul;
+        }
+    }
+
+    std::vector<std::vector<Access>> field_access(const LetF& e, const CXXOptions& options) {
+        if (!e.type || !std::holds_alternative<Types::TyFunc>(*e.type)) {
+            throw std::runtime_error("SoA kernel needs a function type: "s + e.name);
+        }
+        const auto& fun_t = std::get<Types::TyFunc>(*e.type);
+        auto uses = census(e.body);
+        auto projected = Symbols::Map<std::vector<size_t>>{};
+        Traverse::walk([&](const auto& t) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(t)>, LetT>) projected[t.tuple].push_back(t.field);
+        }, e.body);
+
+        std::vector<std::vector<Access>> res;
+        for (auto ix = 0ul; ix < e.args.size(); ++ix) {
+            const auto& arg = e.args[ix];
+            auto& fields = res.emplace_back(fields_of(fun_t.args[ix]), Access::None);
+            auto count = uses.contains(arg) ? uses.at(arg) : 0ul;
+            auto direct = projected.contains(arg) ? projected.at(arg).size() : 0ul;
+            // used whole, eg passed to a function
+            if (count > direct) std::fill(fields.begin(), fields.end(), Access::Read);
+            if (!projected.contains(arg)) continue;
+            for (auto field: projected.at(arg)) fields.at(field) = Access::Read;
+        }
+        for (const auto& [result, target]: options.in_place) {
+            const auto& [arg, field] = target;
+            if ((result >= fields_of(fun_t.result)) || (arg >= res.size()) || (field >= res[arg].size())) {
+                throw std::runtime_error("No field to store result "s + std::to_string(result) + " of " + e.name + " in place");
+            }
+            auto& access = res[arg][field];
+            if ((access == Access::Write) || (access == Access::ReadWrite)) {
+                throw std::runtime_error("Two results of "s + e.name + " stored in the same field");
+            }
+            access = (access == Access::Read) ? Access::ReadWrite : Access::Write;
+        }
+        return res;
+    }
+
+    std::vector<Result> result_fields(const LetF& e, const CXXOptions& options) {
+        if (!e.type || !std::holds_alternative<Types::TyFunc>(*e.type)) {
+            throw std::runtime_error("SoA kernel needs a function type: "s + e.name);
+        }
+        const auto& fun_t = std::get<Types::TyFunc>(*e.type);
+        std::vector<Result> res(fields_of(fun_t.result), options.node_index ? Result::Accumulate : Result::Store);
+        for (const auto& [result, target]: options.in_place) {
+            if (result < res.size()) res[result] = Result::InPlace;
+        }
+        return res;
+    }
+
+    void GenCXX::kernel(const LetF& e) {
+        if (!e.type || !std::holds_alternative<Types::TyFunc>(*e.type)) {
+            throw std::runtime_error("SoA kernel needs a function type: "s + e.name);
+        }
+        auto fun_t = std::get<Types::TyFunc>(*e.type);
+        auto access = field_access(e, options);
+        auto tmp = ret;
+        arrays.clear();
+        results.clear();
+        params.clear();
+        scalars.clear();
+        indexed.clear();
+        uniform = {};
+
+        // unique values are passed once, not per CV; fields neither read nor
+        // written are not passed at all
+        auto array = [&](const Types::type& ty, Access mode) {
+            return ((mode == Access::Read) ? "const " : "") + std::visit(*this, *ty) + "*";
+        };
+        auto by_value = [&](const Types::type& ty, Access mode) {
+            if (Types::kind_of(ty) != Types::Kind::Unique) return false;
+            if (mode != Access::Read) throw std::runtime_error("Result of "s + e.name + " stored in place into a unique value");
+            return true;
+        };
+        for (auto ix = 0ul; ix < e.args.size(); ++ix) {
+            auto ty = Types::resolve(fun_t.args[ix]);
+            if (std::holds_alternative<Types::TyTuple>(*ty)) {
+                const auto& fields = std::get<Types::TyTuple>(*ty).field_types;
+                auto& names = arrays[e.args[ix]];
+                for (auto jx = 0ul; jx < fields.size(); ++jx) {
+                    names.push_back(e.args[ix] + "_" + std::to_string(jx));
+                    auto mode = access[ix][jx];
+                    if (mode == Access::None) continue;
+                    if (by_value(fields[jx], mode)) {
+                        uniform.params[e.args[ix]][jx] = names.back();
+                        params.emplace_back("const " + std::visit(*this, *fields[jx]), names.back());
+                    } else {
+                        params.emplace_back(array(fields[jx], mode), names.back());
+                    }
+                }
+            } else if (access[ix][0] == Access::None) {
+                continue;
+            } else if (by_value(ty, access[ix][0])) {
+                uniform.args.push_back(e.args[ix]);
+                uniform.uniform.insert(e.args[ix]);
+                uniform.order.push_back(e.args[ix]);
+                params.emplace_back("const " + std::visit(*this, *ty), e.args[ix] + "_0");
+            } else {
+                if (access[ix][0] != Access::Write) scalars.push_back(e.args[ix]);
+                params.emplace_back(array(ty, access[ix][0]), e.args[ix] + "_0");
+            }
+        }
+        auto res_t = Types::resolve(fun_t.result);
+        tupled = std::holds_alternative<Types::TyTuple>(*res_t);
+        auto fields = tupled ? std::get<Types::TyTuple>(*res_t).field_types : std::vector<Types::type>{res_t};
+        for (auto jx = 0ul; jx < fields.size(); ++jx) {
+            if (options.in_place.count(jx)) {
+                const auto& [arg, field] = options.in_place.at(jx);
+                results.push_back(arrays.count(e.args[arg]) ? arrays[e.args[arg]][field] : e.args[arg] + "_0");
+            } else {
+                results.push_back(e.name + "_result_" + std::to_string(jx));
+                params.emplace_back(std::visit(*this, *fields[jx]) + "*", results.back());
+            }
+        }
+
+        range = {{"std::size_t", "begin"}, {"std::size_t", "end"}};
+        if (options.node_index) {
+            if (options.index_arg >= e.args.size()) {
+                throw std::runtime_error("SoA kernel has no argument to index: "s + e.name);
+            }
+            const auto& arg = e.args[options.index_arg];
+            if (arrays.count(arg)) {
+                for (auto jx = 0ul; jx < arrays[arg].size(); ++jx) {
+                    if (!uniform.params[arg].count(jx)) indexed.insert(arrays[arg][jx]);
+                }
+            } else if (!uniform.uniform.count(arg)) {
+                indexed.insert(arg + "_0");
+            }
+            // stores through the index accumulate, they cannot update in place
+            for (auto jx = 0ul; jx < results.size(); ++jx) {
+                if (!options.in_place.count(jx)) {
+                    indexed.insert(results[jx]);
+                } else if (options.in_place.at(jx).first == options.index_arg) {
+                    throw std::runtime_error("Result of "s + e.name + " stored in place into the indexed argument");
+                }
+            }
+            range = {{"const sc::index_run*", "__runs"}, {"std::size_t", "__n_runs"}, {"const int*", "__node"}};
+            includes.insert("sc_index.hpp");
+        } else if (options.colored) {
+            throw std::runtime_error("Colored SoA kernel needs a node index: "s + e.name);
+        }
+
+        // nothing to tabulate if the axis is the same for all CVs
+        auto axis = (options.tables.arg < e.args.size()) ? e.args[options.tables.arg] : variable{};
+        if (!uniform.params[axis].count(options.tables.field)) tabulation = find_tables(e, options.tables);
+        if (!tabulation.empty()) {
+            includes.insert("sc_table.hpp");
+            tables = e.name + "_tables";
+        }
+        uniform.varying = tabulation.hidden;
+        uniform.varying.insert(tabulation.roots.begin(), tabulation.roots.end());
+        Traverse::walk(uniform, e.body);
+        scalar_only = diverges(e.body);
+
+        if (options.dispatch.empty()) {
+            variant(e, e.name, "");
+        } else {
+            auto isa = options.isa;
+            for (auto target: dispatch_order(options.dispatch)) {
+                options.isa = target;
+                variant(e, e.name + "_" + isa_name(target), "static " + isa_attribute(target));
+            }
+            options.isa = isa;
+            dispatcher(e);
+        }
+        if (options.node_index) {
+            // runs must fit the vector loops of all variants
+            auto width = options.lanes();
+            auto isa = options.isa;
+            for (auto target: options.dispatch) {
+                options.isa = target;
+                width = std::lcm(width, options.lanes());
+            }
+            options.isa = isa;
+            define("extern const std::size_t " + e.name + "_index_width = " + std::to_string(width) + ";");
+        }
+        if (options.colored) colored(e);
+        if (!tabulation.empty()) tables_init(e);
+        includes.insert("sc_access.hpp");
+        for (auto ix = 0ul; ix < access.size(); ++ix) {
+            std::string line = "extern const sc::access " + e.name + "_access_" + std::to_string(ix) + "[] = {";
+            for (auto jx = 0ul; jx < access[ix].size(); ++jx) line += (jx ? ", " : "") + access_name(access[ix][jx]);
+            define(line + "};");
+        }
+        auto delivered = result_fields(e, options);
+        define("extern const std::size_t " + e.name + "_results_size = " + std::to_string(delivered.size()) + ";");
+        std::string line = "extern const sc::result " + e.name + "_results[] = {";
+        for (auto jx = 0ul; jx < delivered.size(); ++jx) line += (jx ? ", " : "") + result_name(delivered[jx]);
+        define(line + "};");
+        tabulation = {};
+        tables = "";
+        uniform = {};
+        scalar_only = false;
+        ret = tmp;
+    }
+
+    void GenCXX::define(const std::string& line) {
+        emit(line);
+        if (line.size() > 2 && line.compare(line.size() - 2, 2, " {") == 0) {
+            exports.push_back(line.substr(0, line.size() - 2) + ";");
+        } else {
+            exports.push_back(line.substr(0, line.find(" = ")) + ";");
+        }
+    }
+
+    void GenCXX::helper(const LetF& e) {
+        // one overload per loop width the kernels may call it from
+        auto tmp = ret;
+        auto isa = options.isa;
+        auto targets = options.dispatch;
+        targets.push_back(options.isa);
+        auto scalar = diverges(e.body);
+        if (scalar) scalar_helpers.insert(e.name);
+        for (auto target: dispatch_order(targets)) {
+            options.isa = target;
+            if (scalar && (options.lanes() > 1)) continue;
+            lanes = options.lanes();
+            emit("static inline " + isa_attribute(target) + result_type(e) + " " + callee(e.name) + "(" + parameters(e) + ") {");
+            indent += 4;
+            ret = e.cont;
+            tuples.clear();
+            depth++;
+            Traverse::run<Unit>(*this, e.body);
+            depth--;
+            indent -= 4;
+            emit("}");
+        }
+        options.isa = isa;
+        lanes = 1;
+        ret = tmp;
+    }
+
+    bool GenCXX::diverges(const term& body) const {
+        auto res = false;
+        Traverse::walk([&](const auto& t) {
+            using E = std::decay_t<decltype(t)>;
+            if constexpr (std::is_same_v<E, If>) res = res || !uniform.uniform.count(t.cond);
+            if constexpr (std::is_same_v<E, AppF>) res = res || scalar_helpers.count(t.name);
+        }, body);
+        return res;
+    }
+
+    std::string GenCXX::parameters(const LetF& e) {
+        std::string res = "";
+        for (const auto& arg: e.args) res += std::visit(*this, *types.at(arg)) + " " + arg + ", ";
+        if (!res.empty()) { res.erase(res.begin() + res.size() - 2, res.end()); }
+        return res;
+    }
+
+    std::string GenCXX::result_type(const LetF& e) {
+        auto fun_t = std::get<Types::TyFunc>(*Types::resolve(types.at(e.name)));
+        return std::visit(*this, *fun_t.result);
+    }
+
+    std::string GenCXX::local(const variable& v, const std::string& name) {
+        return "const " + std::visit(*this, *types.at(v)) + " " + (name.empty() ? v.name() : name);
+    }
+
+    const LetC& GenCXX::continuation(const variable& k) const {
+        if (!continuations.count(k)) throw std::runtime_error("Unknown continuation: "s + k);
+        return *continuations.at(k);
+    }
+
+    bool GenCXX::join_point(const LetC& e) const {
+        return e.type && std::holds_alternative<Types::TyFunc>(*Types::resolve(e.type)) && uses.contains(e.name) && (uses.at(e.name) > 1);
+    }
+
+    void GenCXX::jump(const variable& k, const std::vector<std::string>& vals) {
+        const auto& args = continuation(k).args;
+        if (args.size() != vals.size()) throw std::runtime_error("Wrong number of arguments to continuation: "s + k);
+        for (auto ix = 0ul; ix < args.size(); ++ix) emit(args[ix] + " = " + vals[ix] + ";");
+        emit("goto " + joins.at(k) + ";");
+    }
+
+    std::string GenCXX::callee(const variable& f) const {
+        if (soa() && (lanes > 1) && helpers.count(f)) return f + "_" + isa_name(options.isa);
+        return f;
+    }
+
+    std::string GenCXX::value(const variable& v) {
+        if (!tuples.count(v) && !arrays.count(v)) return use(v);
+        std::string res = std::visit(*this, *types.at(v)) + "{";
+        if (tuples.count(v)) {
+            for (const auto& field: tuples[v]) res += value(field) + ", ";
+        } else {
+            const auto& names = arrays[v];
+            for (auto jx = 0ul; jx < names.size(); ++jx) {
+                if (uniform.params[v].count(jx)) {
+                    res += splat(uniform.params[v][jx]) + ", ";
+                } else {
+                    res += load(names[jx]) + ", ";
+                }
+            }
+        }
+        if (res.back() == ' ') { res.erase(res.begin() + res.size() - 2, res.end()); }
+        return res + "}";
+    }
+
+    std::string GenCXX::tuple_type(const std::vector<std::string>& fields) {
+        std::string code = "";
+        for (const auto& field: fields) {
+            if (field == "double") {
+                code += "d";
+            } else if (field == "bool") {
+                code += "b";
+            } else if (codes.count(field)) {
+                code += "T" + codes[field] + "E";
+            } else {
+                // vector types, as length and identifier characters
+                std::string chars = "";
+                for (auto c: field) if (std::isalnum(static_cast<unsigned char>(c)) || (c == '_')) chars += c;
+                code += std::to_string(chars.size()) + chars;
+            }
+        }
+        auto name = "__sc_tuple_" + code;
+        if (codes.count(name)) return name;
+        codes[name] = code;
+        // guarded, so generated files can share a translation unit
+        std::string def = "#ifndef " + name + "_defined\n#define " + name + "_defined\nstruct " + name + " {";
+        for (auto ix = 0ul; ix < fields.size(); ++ix) def += " " + fields[ix] + " _" + std::to_string(ix) + ";";
+        structs.push_back(def + " };\n#endif");
+        return name;
+    }
+
+    void GenCXX::yield(const variable& v) {
+        if (tuples.count(v)) {
+            const auto& fields = tuples[v];
+            for (auto ix = 0ul; ix < fields.size(); ++ix) {
+                emit(store(results.at(ix), use(fields[ix])) + ";");
+            }
+        } else if (tupled) {
+            for (auto ix = 0ul; ix < results.size(); ++ix) {
+                emit(store(results[ix], use(v) + "._" + std::to_string(ix)) + ";");
+            }
+        } else {
+            emit(store(results.at(0), use(v)) + ";");
+        }
+        // skip the bodies of join points following in the loop
+        if (joining > 0) emit("continue;");
+    }
+
+    void GenCXX::variant(const LetF& e, const std::string& name, const std::string& prefix) {
+        std::string line = prefix + "void " + name + "(" + range.front().first + " " + range.front().second;
+        for (auto ix = 1ul; ix < range.size(); ++ix) line += ", " + range[ix].first + " " + range[ix].second;
+        for (const auto& param: params) line += ", " + declare(param);
+        if (!tables.empty()) line += ", const sc::table* " + tables;
+        line += ") {";
+        if (prefix.empty()) {
+            define(line);
+        } else {
+            emit(line);
+        }
+        indent += 4;
+        for (const auto& [ty, name]: params) {
+            if (ty.back() != '*') continue;
+            emit(name + " = static_cast<" + ty + ">(__builtin_assume_aligned(" + name + ", " + std::to_string(options.alignment) + "));");
+        }
+        hoist();
+        if (options.node_index) {
+            runs(e);
+        } else {
+            emit("std::size_t __cv = begin;");
+            if (scalar_only && (options.lanes() > 1)) emit("// branches per CV, no vector loop");
+            if (!scalar_only && (options.lanes() > 1)) loop(e, options.lanes());
+            loop(e, 1);
+        }
+        indent -= 4;
+        emit("}");
+    }
+
+    void GenCXX::dispatcher(const LetF& e) {
+        auto fn_t = e.name + "_kernel";
+        std::string line = "using " + fn_t + " = void (*)(" + range.front().first;
+        for (auto ix = 1ul; ix < range.size(); ++ix) line += ", " + range[ix].first;
+        for (const auto& param: params) line += ", " + param.first;
+        if (!tables.empty()) line += ", const sc::table*";
+        line += ");";
+        emit(line);
+        emit("static " + fn_t + " " + e.name + "_select() {");
+        indent += 4;
+        emit("__builtin_cpu_init();");
+        for (auto target: dispatch_order(options.dispatch)) {
+            auto name = e.name + "_" + isa_name(target);
+            auto check = isa_check(target);
+            if (check.empty()) {
+                emit("return " + name + ";");
+                break;
+            }
+            emit("if (" + check + ") return " + name + ";");
+        }
+        indent -= 4;
+        emit("}");
+        emit("// resolved once, when the translation unit is loaded");
+        emit("static const " + fn_t + " " + e.name + "_impl = " + e.name + "_select();");
+        line = "void " + e.name + "(" + range.front().first + " " + range.front().second;
+        for (auto ix = 1ul; ix < range.size(); ++ix) line += ", " + range[ix].first + " " + range[ix].second;
+        for (const auto& param: params) line += ", " + declare(param);
+        if (!tables.empty()) line += ", const sc::table* " + tables;
+        line += ") {";
+        define(line);
+        line = e.name + "_impl(" + range.front().second;
+        for (auto ix = 1ul; ix < range.size(); ++ix) line += ", " + range[ix].second;
+        for (const auto& param: params) line += ", " + param.second;
+        if (!tables.empty()) line += ", " + tables;
+        line += ");";
+        indent += 4;
+        emit(line);
+        indent -= 4;
+        emit("}");
+    }
+
+    void GenCXX::loop(const LetF& e, size_t width) {
+        lanes = width;
+        ret = e.cont;
+        sink = e.cont;
+        tuples.clear();
+        if (width == 1) {
+            emit("for (; __cv < end; ++__cv) {");
+        } else {
+            emit("for (; __cv + " + std::to_string(width) + " <= end; __cv += " + std::to_string(width) + ") {");
+        }
+        indent += 4;
+        for (const auto& arg: scalars) emit(local(arg) + " = " + load(arg + "_0") + ";");
+        depth++;
+        Traverse::run<Unit>(*this, e.body);
+        depth--;
+        indent -= 4;
+        emit("}");
+        sink = "";
+        lanes = 1;
+    }
+
+    void GenCXX::runs(const LetF& e) {
+        static const std::vector<std::pair<Index, std::string>> kinds = {
+            {Index::Contiguous, "contiguous"}, {Index::Constant, "constant"}, {Index::Independent, "independent"}
+        };
+        emit("for (std::size_t __run = 0; __run < __n_runs; ++__run) {");
+        indent += 4;
+        emit("std::size_t __cv = __runs[__run].begin;");
+        emit("const std::size_t end = __runs[__run].end;");
+        if (scalar_only && (options.lanes() > 1)) emit("// branches per CV, no vector loop");
+        if (!scalar_only && (options.lanes() > 1)) {
+            emit("switch (__runs[__run].kind) {");
+            for (const auto& [kind, name]: kinds) {
+                emit("case sc::index_kind::" + name + ":");
+                indent += 4;
+                index = kind;
+                loop(e, options.lanes());
+                emit("break;");
+                indent -= 4;
+            }
+            emit("default:");
+            emit("    break;");
+            emit("}");
+        }
+        // conflicting runs and remainders
+        index = Index::Gather;
+        loop(e, 1);
+        index = Index::Direct;
+        indent -= 4;
+        emit("}");
+    }
+
+    void GenCXX::colored(const LetF& e) {
+        std::string line = "void " + e.name + "_colored(const sc::schedule& __schedule";
+        for (const auto& param: params) line += ", " + declare(param);
+        if (!tables.empty()) line += ", const sc::table* " + tables;
+        line += ") {";
+        emit("// one group after the other, the chunks of each group in parallel");
+        define(line);
+        indent += 4;
+        emit("for (std::size_t __group = 0; __group + 1 < __schedule.groups.size(); ++__group) {");
+        indent += 4;
+        emit("const std::ptrdiff_t __first = __schedule.groups[__group], __last = __schedule.groups[__group + 1];");
+        // without OpenMP the chunks run in order, which is just as correct
+        emit("#ifdef _OPENMP");
+        emit("#pragma omp parallel for schedule(static)");
+        emit("#endif");
+        emit("for (std::ptrdiff_t __chunk = __first; __chunk < __last; ++__chunk) {");
+        indent += 4;
+        emit("const sc::schedule::chunk& __c = __schedule.chunks[__chunk];");
+        line = e.name + "(__schedule.runs.data() + __c.begin, __c.end - __c.begin, __schedule.node.data()";
+        for (const auto& param: params) line += ", " + param.second;
+        if (!tables.empty()) line += ", " + tables;
+        line += ");";
+        emit(line);
+        indent -= 4;
+        emit("}");
+        indent -= 4;
+        emit("}");
+        indent -= 4;
+        emit("}");
+    }
+
+    void GenCXX::hoist() {
+        for (const auto& arg: uniform.args) emit(local(arg) + " = " + arg + "_0;");
+        for (const auto& binding: uniform.bindings) {
+            if (const auto& v = std::get_if<LetV>(binding.get())) {
+                emit(local(v->name) + " = " + std::visit(*this, *v->val) + ";");
+            } else if (const auto& t = std::get_if<LetT>(binding.get()); t && uniform.params.count(t->tuple)) {
+                emit(local(t->name) + " = " + uniform.params[t->tuple].at(t->field) + ";");
+            } else if (t) {
+                emit(local(t->name) + " = " + uniform.tuples[t->tuple].at(t->field) + ";");
+            } else if (const auto& p = std::get_if<LetP>(binding.get())) {
+                emit(local(p->var) + " = " + prim(*p) + ";");
+            }
+        }
+        if ((options.lanes() == 1) || scalar_only) return;
+        lanes = options.lanes();
+        for (const auto& var: uniform.order) {
+            if (!uniform.escaping.count(var)) continue;
+            emit(local(var, var + "_splat") + " = " + (uniform.predicates.count(var) ? mask(var) : splat(var)) + ";");
+        }
+        lanes = 1;
+    }
+
+    std::string GenCXX::use(const variable& v) const {
+        if ((lanes > 1) && uniform.escaping.count(v)) return v + "_splat";
+        return v;
+    }
+
+    void GenCXX::lookup(const LetP& e) {
+        auto ix = std::find(tabulation.roots.begin(), tabulation.roots.end(), e.var) - tabulation.roots.begin();
+        auto kind = (options.tables.interpolation == TableOptions::Interpolation::Cubic) ? "sc::cubic" : "sc::linear";
+        emit(local(e.var) + " = sc::lookup<" + kind + ">(" + tables + "[" + std::to_string(ix) + "], " + use(tabulation.axis) + ", [&]() {");
+        indent += 4;
+        for (const auto& binding: tabulation.fallbacks[e.var]) {
+            if (const auto& v = std::get_if<LetV>(binding.get())) {
+                emit(local(v->name) + " = " + splat(std::visit(*this, *v->val)) + ";");
+            } else if (const auto& p = std::get_if<LetP>(binding.get())) {
+                emit(local(p->var) + " = " + prim(*p) + ";");
+            }
+        }
+        emit("return " + prim(e) + ";");
+        indent -= 4;
+        emit("});");
+    }
+
+    void GenCXX::tables_init(const LetF& e) {
+        define("extern const std::size_t " + e.name + "_tables_size = " + std::to_string(tabulation.roots.size()) + ";");
+        emit("// sample all tables of " + e.name + " on [lo, hi], with the given step");
+        define("void " + e.name + "_tables_init(sc::table* " + tables + ", double lo, double hi, double step) {");
+        indent += 4;
+        for (auto ix = 0ul; ix < tabulation.roots.size(); ++ix) {
+            const auto& root = tabulation.roots[ix];
+            emit(tables + "[" + std::to_string(ix) + "].fill([](double " + tabulation.axis + ") {");
+            indent += 4;
+            for (const auto& binding: tabulation.cones[root]) {
+                if (const auto& v = std::get_if<LetV>(binding.get())) {
+                    emit(local(v->name) + " = " + std::visit(*this, *v->val) + ";");
+                } else if (const auto& p = std::get_if<LetP>(binding.get()); p && (p->var != root)) {
+                    emit(local(p->var) + " = " + prim(*p) + ";");
+                } else if (p) {
+                    emit("return " + prim(*p) + ";");
+                }
+            }
+            indent -= 4;
+            emit("}, lo, hi, step);");
+        }
+        indent -= 4;
+        emit("}");
+    }
+
+    std::string GenCXX::prim(const LetP& e) {
+        std::vector<std::string> args;
+        for (const auto& arg: e.args) args.push_back(use(arg));
+        if ((e.name == "+") || (e.name == "-") || (e.name == "*") || (e.name == "/")) {
+            return binary(e.name, args[0], args[1]);
+        }
+        if ((e.name == "exp") || (e.name == "log") || (e.name == "expm1") || (e.name == "exprelr")) {
+            // scalars and vectors alike
+            includes.insert("sc_math.hpp");
+            return "sc::math::" + e.name + "(" + args[0] + ")";
+        }
+        if ((e.name == "fma") || (e.name == "fms") || (e.name == "fnma")) {
+            // SoA always includes it
+            if ((lanes == 1) && !soa()) includes.insert("<cmath>");
+            return fused(e.name, args[0], args[1], args[2]);
+        }
+        if (comparison(e.name)) return compare(e.name, args[0], args[1]);
+        if (e.name == "select") return select(args[0], args[1], args[2]);
+        throw std::runtime_error("Unimplemented PrimOp: '"s + e.name + "'");
+    }
+
+    size_t CXXOptions::lanes() const {
+        switch (isa) {
+            case ISA::Scalar: return 1;
+            case ISA::Vector: return width;
+            case ISA::SSE2:   return 2;
+            case ISA::AVX2:   return 4;
+            case ISA::AVX512: return 8;
+        }
+        return 1;
+    }
+
+    std::vector<CXXOptions::ISA> dispatch_order(const std::vector<CXXOptions::ISA>& isas) {
+        // best first; there is always a scalar fallback
+        auto res = isas;
+        res.push_back(CXXOptions::ISA::Scalar);
+        std::sort(res.begin(), res.end(), [](auto a, auto b) { return a > b; });
+        res.erase(std::unique(res.begin(), res.end()), res.end());
+        return res;
+    }
+
+    std::string isa_name(CXXOptions::ISA isa) {
+        switch (isa) {
+            case CXXOptions::ISA::Scalar: return "scalar";
+            case CXXOptions::ISA::Vector: return "vector";
+            case CXXOptions::ISA::SSE2:   return "sse2";
+            case CXXOptions::ISA::AVX2:   return "avx2";
+            case CXXOptions::ISA::AVX512: return "avx512";
+        }
+        return "";
+    }
+
+    std::string isa_attribute(CXXOptions::ISA isa) {
+        switch (isa) {
+            case CXXOptions::ISA::SSE2:   return "__attribute__((target(\"sse2\"))) ";
+            case CXXOptions::ISA::AVX2:   return "__attribute__((target(\"avx2,fma\"))) ";
+            case CXXOptions::ISA::AVX512: return "__attribute__((target(\"avx512f,avx2,fma\"))) ";
+            default: return "";
+        }
+    }
+
+    std::string isa_check(CXXOptions::ISA isa) {
+        switch (isa) {
+            case CXXOptions::ISA::SSE2:   return "__builtin_cpu_supports(\"sse2\")";
+            case CXXOptions::ISA::AVX2:   return "__builtin_cpu_supports(\"avx2\") && __builtin_cpu_supports(\"fma\")";
+            case CXXOptions::ISA::AVX512: return "__builtin_cpu_supports(\"avx512f\")";
+            default: return "";
+        }
+    }
+
+    namespace {
+        // runtime/ headers are quoted, standard ones come with their brackets
+        void include(std::ostream& os, const std::string& header) {
+            if (header.front() == '<') {
+                os << "#include " << header << "\n";
+            } else {
+                os << "#include \"" << header << "\"\n";
+            }
+        }
+
+        std::string intrinsic(CXXOptions::ISA isa, const std::string& op) {
+            switch (isa) {
+                case CXXOptions::ISA::SSE2:   return "_mm_"    + op + "_pd";
+                case CXXOptions::ISA::AVX2:   return "_mm256_" + op + "_pd";
+                case CXXOptions::ISA::AVX512: return "_mm512_" + op + "_pd";
+                default: throw std::runtime_error("No intrinsics for this ISA");
+            }
+        }
+
+        void prelude(std::ostream& os, const CXXOptions& options, const GenCXX& gen) {
+            if (options.layout != CXXOptions::Layout::SoA) {
+                for (const auto& header: gen.includes) include(os, header);
+                for (const auto& def: gen.structs) os << def << "\n";
+                return;
+            }
+            os << "#include <cstddef>\n"
+               << "#include <cmath>\n";
+            // vector and remainder loops must round identically
+            os << "#if defined(__clang__)\n"
+               << "#pragma STDC FP_CONTRACT OFF\n"
+               << "#elif defined(__GNUC__)\n"
+               << "#pragma GCC optimize(\"fp-contract=off\")\n"
+               << "#endif\n";
+            auto isas = options.dispatch;
+            isas.push_back(options.isa);
+            auto uses = [&](auto isa) { return std::find(isas.begin(), isas.end(), isa) != isas.end(); };
+            if (std::any_of(isas.begin(), isas.end(), [](auto isa) { return isa != CXXOptions::ISA::Scalar; })) {
+                // vectors wider than the default target only pass between
+                // static inline functions here, which never follow the ABI
+                os << "#if defined(__clang__)\n"
+                   << "#if __has_warning(\"-Wpsabi\")\n"
+                   << "#pragma clang diagnostic ignored \"-Wpsabi\"\n"
+                   << "#endif\n"
+                   << "#elif defined(__GNUC__)\n"
+                   << "#pragma GCC diagnostic ignored \"-Wpsabi\"\n"
+                   << "#endif\n";
+            }
+            if (uses(CXXOptions::ISA::Vector)) {
+                auto n = "__sc_f64x" + std::to_string(options.width);
+                os << "typedef double " << n << " __attribute__((vector_size(" << 8*options.width << ")));\n"
+                   << "static inline " << n << " " << n << "_load(const double* p) { " << n << " r; __builtin_memcpy(&r, p, sizeof(r)); return r; }\n"
+                   << "static inline void " << n << "_store(double* p, " << n << " v) { __builtin_memcpy(p, &v, sizeof(v)); }\n";
+            }
+            if (uses(CXXOptions::ISA::SSE2) || uses(CXXOptions::ISA::AVX2) || uses(CXXOptions::ISA::AVX512)) {
+                os << "#include <immintrin.h>\n";
+            }
+            if (uses(CXXOptions::ISA::Vector) || uses(CXXOptions::ISA::SSE2)) {
+                // no fused vector ops on these, go lane by lane; 0: a*b + c, 1: a*b - c, 2: c - a*b
+                os << "template<int Op, typename V> static inline V __sc_fma_lanes(V a, V b, V c) {\n"
+                   << "    constexpr std::size_t N = sizeof(V)/sizeof(double);\n"
+                   << "    double x[N], y[N], z[N];\n"
+                   << "    __builtin_memcpy(x, &a, sizeof(V)); __builtin_memcpy(y, &b, sizeof(V)); __builtin_memcpy(z, &c, sizeof(V));\n"
+                   << "    for (std::size_t i = 0; i < N; ++i) x[i] = std::fma(Op == 2 ? -x[i] : x[i], y[i], Op == 1 ? -z[i] : z[i]);\n"
+                   << "    __builtin_memcpy(&a, x, sizeof(V));\n"
+                   << "    return a;\n"
+                   << "}\n";
+            }
+            // after the pragmas, so these are not contracted either
+            for (const auto& header: gen.includes) include(os, header);
+            for (const auto& def: gen.structs) os << def << "\n";
+        }
+    }
+
+    std::string GenCXX::vector_type() const {
+        switch (options.isa) {
+            case CXXOptions::ISA::Scalar: return "double";
+            case CXXOptions::ISA::Vector: return "__sc_f64x" + std::to_string(options.width);
+            case CXXOptions::ISA::SSE2:   return "__m128d";
+            case CXXOptions::ISA::AVX2:   return "__m256d";
+            case CXXOptions::ISA::AVX512: return "__m512d";
+        }
+        return "double";
+    }
+
+    // Result of comparing vectors: lanes of all ones or zeros, or a bit per
+    // lane on AVX512
+    std::string GenCXX::mask_type() const {
+        switch (options.isa) {
+            case CXXOptions::ISA::Scalar: return "bool";
+            case CXXOptions::ISA::Vector: return "decltype(" + vector_type() + "{} < " + vector_type() + "{})";
+            case CXXOptions::ISA::SSE2:   return "__m128d";
+            case CXXOptions::ISA::AVX2:   return "__m256d";
+            case CXXOptions::ISA::AVX512: return "__mmask8";
+        }
+        return "bool";
+    }
+
+    std::string GenCXX::load(const std::string& ptr) const {
+        if (indexed.count(ptr)) return gather(ptr);
+        if (lanes == 1) return ptr + "[__cv]";
+        if (options.isa == CXXOptions::ISA::Vector) return vector_type() + "_load(" + ptr + " + __cv)";
+        return intrinsic(options.isa, "loadu") + "(" + ptr + " + __cv)";
+    }
+
+    std::string GenCXX::store(const std::string& ptr, const std::string& val) const {
+        if (indexed.count(ptr)) return scatter_add(ptr, val);
+        if (lanes == 1) return ptr + "[__cv] = " + val;
+        if (options.isa == CXXOptions::ISA::Vector) return vector_type() + "_store(" + ptr + " + __cv, " + val + ")";
+        return intrinsic(options.isa, "storeu") + "(" + ptr + " + __cv, " + val + ")";
+    }
+
+    std::string GenCXX::gather(const std::string& ptr) const {
+        if ((lanes == 1) || (index == Index::Gather)) return ptr + "[__node[__cv]]";
+        switch (index) {
+            case Index::Contiguous:
+                if (options.isa == CXXOptions::ISA::Vector) return vector_type() + "_load(" + ptr + " + __node[__cv])";
+                return intrinsic(options.isa, "loadu") + "(" + ptr + " + __node[__cv])";
+            case Index::Constant:
+                return splat(ptr + "[__node[__cv]]");
+            case Index::Independent:
+                if (options.isa == CXXOptions::ISA::AVX2) {
+                    return "_mm256_i32gather_pd(" + ptr + ", _mm_loadu_si128(reinterpret_cast<const __m128i*>(__node + __cv)), 8)";
+                }
+                if (options.isa == CXXOptions::ISA::AVX512) {
+                    return "_mm512_i32gather_pd(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(__node + __cv)), " + ptr + ", 8)";
+                }
+                return "sc::gather<" + vector_type() + ">(" + ptr + ", __node + __cv)";
+            default:
+                throw std::runtime_error("No vector access without a node index pattern");
+        }
+    }
+
+    std::string GenCXX::scatter_add(const std::string& ptr, const std::string& val) const {
+        if ((lanes == 1) || (index == Index::Gather)) return ptr + "[__node[__cv]] += " + val;
+        switch (index) {
+            case Index::Contiguous:
+                if (options.isa == CXXOptions::ISA::Vector) {
+                    return vector_type() + "_store(" + ptr + " + __node[__cv], " + binary("+", gather(ptr), val) + ")";
+                }
+                return intrinsic(options.isa, "storeu") + "(" + ptr + " + __node[__cv], " + binary("+", gather(ptr), val) + ")";
+            case Index::Constant:
+                return "sc::accumulate(" + ptr + " + __node[__cv], " + val + ")";
+            case Index::Independent:
+                if (options.isa == CXXOptions::ISA::AVX512) {
+                    return "_mm512_i32scatter_pd(" + ptr + ", _mm256_loadu_si256(reinterpret_cast<const __m256i*>(__node + __cv)), " + binary("+", gather(ptr), val) + ", 8)";
+                }
+                return "sc::scatter_add(" + ptr + ", __node + __cv, " + val + ")";
+            default:
+                throw std::runtime_error("No vector access without a node index pattern");
+        }
+    }
+
+    std::string GenCXX::splat(const std::string& val) const {
+        if (lanes == 1) return val;
+        if (options.isa == CXXOptions::ISA::Vector) return "(" + vector_type() + "{} + " + val + ")";
+        return intrinsic(options.isa, "set1") + "(" + val + ")";
+    }
+
+    std::string GenCXX::mask(const std::string& val) const {
+        if (lanes == 1) return val;
+        switch (options.isa) {
+            case CXXOptions::ISA::Vector: return "(" + mask_type() + "{} - " + val + ")";
+            case CXXOptions::ISA::SSE2:   return "_mm_castsi128_pd(_mm_set1_epi64x(-(long long)" + val + "))";
+            case CXXOptions::ISA::AVX2:   return "_mm256_castsi256_pd(_mm256_set1_epi64x(-(long long)" + val + "))";
+            case CXXOptions::ISA::AVX512: return "(" + val + " ? __mmask8(0xFF) : __mmask8(0))";
+            default: return val;
+        }
+    }
+
+    std::string GenCXX::binary(const std::string& op, const std::string& lhs, const std::string& rhs) const {
+        if ((lanes == 1) || (options.isa == CXXOptions::ISA::Vector)) return lhs + " " + op + " " + rhs;
+        static const std::unordered_map<std::string, std::string> names = {{"+", "add"}, {"-", "sub"}, {"*", "mul"}, {"/", "div"}};
+        return intrinsic(options.isa, names.at(op)) + "(" + lhs + ", " + rhs + ")";
+    }
+
+    std::string GenCXX::fused(const std::string& op, const std::string& a, const std::string& b, const std::string& c) const {
+        if (lanes == 1) {
+            if (op == "fms")  return "std::fma(" + a + ", " + b + ", -" + c + ")";
+            if (op == "fnma") return "std::fma(-" + a + ", " + b + ", " + c + ")";
+            return "std::fma(" + a + ", " + b + ", " + c + ")";
+        }
+        if ((options.isa == CXXOptions::ISA::AVX2) || (options.isa == CXXOptions::ISA::AVX512)) {
+            static const std::unordered_map<std::string, std::string> names = {{"fma", "fmadd"}, {"fms", "fmsub"}, {"fnma", "fnmadd"}};
+            return intrinsic(options.isa, names.at(op)) + "(" + a + ", " + b + ", " + c + ")";
+        }
+        static const std::unordered_map<std::string, std::string> modes = {{"fma", "0"}, {"fms", "1"}, {"fnma", "2"}};
+        return "__sc_fma_lanes<" + modes.at(op) + ">(" + a + ", " + b + ", " + c + ")";
+    }
+
+    std::string GenCXX::compare(const std::string& op, const std::string& lhs, const std::string& rhs) const {
+        if ((lanes == 1) || (options.isa == CXXOptions::ISA::Vector)) return lhs + " " + op + " " + rhs;
+        if (options.isa == CXXOptions::ISA::SSE2) {
+            static const std::unordered_map<std::string, std::string> names = {{"<", "cmplt"}, {">", "cmpgt"}, {"<=", "cmple"}, {">=", "cmpge"}};
+            return intrinsic(options.isa, names.at(op)) + "(" + lhs + ", " + rhs + ")";
+        }
+        // ordered and quiet, as the scalar comparisons
+        static const std::unordered_map<std::string, std::string> predicates = {{"<", "_CMP_LT_OQ"}, {">", "_CMP_GT_OQ"}, {"<=", "_CMP_LE_OQ"}, {">=", "_CMP_GE_OQ"}};
+        if (options.isa == CXXOptions::ISA::AVX2) return "_mm256_cmp_pd(" + lhs + ", " + rhs + ", " + predicates.at(op) + ")";
+        return "_mm512_cmp_pd_mask(" + lhs + ", " + rhs + ", " + predicates.at(op) + ")";
+    }
+
+    std::string GenCXX::select(const std::string& cond, const std::string& lhs, const std::string& rhs) const {
+        if ((lanes == 1) || (options.isa == CXXOptions::ISA::Vector)) return "(" + cond + " ? " + lhs + " : " + rhs + ")";
+        switch (options.isa) {
+            case CXXOptions::ISA::SSE2:   return "_mm_or_pd(_mm_and_pd(" + cond + ", " + lhs + "), _mm_andnot_pd(" + cond + ", " + rhs + "))";
+            case CXXOptions::ISA::AVX2:   return "_mm256_blendv_pd(" + rhs + ", " + lhs + ", " + cond + ")";
+            case CXXOptions::ISA::AVX512: return "_mm512_mask_blend_pd(" + cond + ", " + rhs + ", " + lhs + ")";
+            default: throw std::runtime_error("No select for this ISA");
+        }
+    }
+
+    void generate_cxx(std::ostream& os, const term& t, const CXXOptions& options) {
+        std::ostringstream header;
+        generate_cxx(os, header, t, options);
+    }
+
+    void generate_cxx(std::ostream& os, std::ostream& header, const term& t, const CXXOptions& options) {
+        auto gen = GenCXX(options);
+        // branching per lane is impossible in vector loops
+        auto limit = options.select;
+        auto vectors = options.lanes() > 1;
+        for (auto isa: options.dispatch) vectors = vectors || (isa != CXXOptions::ISA::Scalar);
+        if ((options.layout == CXXOptions::Layout::SoA) && vectors) limit = std::numeric_limits<size_t>::max();
+        // dead continuations are never applied, nothing tells their types
+        auto lifted = infer_types(dead_let(if_convert(lambda_lift(t), limit)));
+        gen.types = check_types(lifted);
+        gen.uses = census(lifted);
+        Traverse::walk([&](const auto& e) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(e)>, AppF>) gen.called.insert(e.name);
+        }, lifted);
+        Traverse::run<Unit>(gen, lifted);
+        prelude(os, options, gen);
+        for(const auto& line: gen.code) {
+            os << line << '\n';
+        }
+        header << "#pragma once\n"
+               << "#include <cstddef>\n";
+        for (const auto& inc: gen.includes) if (inc != "sc_math.hpp") include(header, inc);
+        // SoA kernels take arrays of scalars, structs in their helpers may
+        // hold vectors
+        if (options.layout != CXXOptions::Layout::SoA) {
+            for (const auto& def: gen.structs) header << def << "\n";
+        }
+        for (const auto& line: gen.exports) header << line << '\n';
+    }
+}
@@ -0,0 +1,509 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <charconv>
+#include <unordered_map>
+#include <algorithm>
+#include <set>
+#include <map>
+#include <numeric>
+#include <limits>
+#include <cctype>
+
+#include "TailCPS.hpp"
+#include "Tables.hpp"
+
+namespace TailCPS {
+    struct CXXOptions {
+        // Tuple: one function per mechanism, called per CV with plain structs
+        // SoA:   one kernel per mechanism looping over CVs in [begin, end),
+        //        taking one array per tuple field
+        enum class Layout { Tuple, SoA };
+        Layout layout = Layout::Tuple;
+        // alignment in bytes promised for all SoA arrays
+        size_t alignment = 64;
+        // SoA only: lower arithmetic to explicit vector operations, followed
+        // by a scalar remainder loop.
+        // Vector: GCC/Clang vector extensions with `width` lanes
+        // SSE2/AVX2/AVX512: intrinsics, width is fixed by the ISA
+        enum class ISA { Scalar, Vector, SSE2, AVX2, AVX512 };
+        ISA isa = ISA::Scalar;
+        size_t width = 4;
+        // SoA only: emit one variant of each kernel per ISA listed here, plus
+        // a scalar fallback, and a dispatcher picking the best variant the
+        // CPU supports once at load time.
+        std::vector<ISA> dispatch;
+        // SoA only: replace expensive subterms of the voltage by table lookups
+        TableOptions tables;
+        // SoA only: the fields of argument `index_arg` and of the result live
+        // on nodes, not CVs; they are read and accumulated through a node
+        // index per CV. The kernel takes runs of CVs classified by index
+        // pattern, see runtime/sc_index.hpp, instead of [begin, end).
+        bool node_index = false;
+        size_t index_arg = 0;
+        // SoA with node_index only: also emit <kernel>_colored, running the
+        // kernel over a sc::schedule, in parallel within each group. Arrays
+        // on CVs are in the order of the schedule, see sc::schedule::permute.
+        bool colored = false;
+        // SoA only: store result field j into field in_place[j] = {argument,
+        // field} of the kernel's arguments, instead of into an output array
+        // of its own; eg a state updated from its old value
+        std::map<size_t, std::pair<size_t, size_t>> in_place;
+        // Conditionals whose arms are at most this size together, estimated
+        // as for inlining, compute both arms and select the result instead
+        // of branching. Vector loops cannot branch per lane, so SoA programs
+        // with vector variants select wherever possible.
+        size_t select = 16;
+
+        size_t lanes() const;
+    };
+
+    std::vector<CXXOptions::ISA> dispatch_order(const std::vector<CXXOptions::ISA>&);
+    std::string isa_name(CXXOptions::ISA);
+    std::string isa_attribute(CXXOptions::ISA);
+    std::string isa_check(CXXOptions::ISA);
+
+    // How a SoA kernel uses each field of its arguments, arguments which are
+    // not tuples having a single field: read if projected, all of them if the
+    // argument is used whole, and written if a result is stored there in
+    // place. Kernels only take the fields they read or write, and list the
+    // access per field in <kernel>_access_<argument>, see runtime/sc_access.hpp
+    enum class Access { None = 0, Read = 1, Write = 2, ReadWrite = 3 };
+    std::vector<std::vector<Access>> field_access(const LetF& kernel, const CXXOptions& options);
+
+    // How a SoA kernel delivers each field of its result, a result which is
+    // not a tuple having a single field: stored into an output array of its
+    // own, added to it through the node index, or stored in place into a
+    // field of an argument. Listed in <kernel>_results, see
+    // runtime/sc_access.hpp
+    enum class Result { Store = 0, Accumulate = 1, InPlace = 2 };
+    std::vector<Result> result_fields(const LetF& kernel, const CXXOptions& options);
+
+    // Bindings of a kernel body which are the same for all CVs: constants,
+    // unique parameters, and primitives of those
+    struct FindUniform {
+        // unique fields of the kernel's arguments, and the parameters holding
+        // them; unique arguments which are not tuples
+        std::unordered_map<variable, std::unordered_map<int, std::string>> params;
+        std::vector<variable> args;
+        // never uniform, eg bindings replaced by table lookups
+        std::unordered_set<variable> varying;
+        // uniform bindings, in program order
+        std::unordered_set<variable> uniform;
+        std::vector<term> bindings;
+        std::vector<variable> order;
+        // ... those used by anything else
+        std::unordered_set<variable> escaping;
+        std::unordered_map<variable, std::vector<variable>> tuples;
+        // uniform Bools, broadcast to masks instead of vectors
+        std::unordered_set<variable> predicates;
+
+        void bind(const variable& v, const Term& t) {
+            uniform.insert(v);
+            bindings.push_back(Memory::make_node<Term>(t));
+            order.push_back(v);
+        }
+        void escape(const variable& v) {
+            if (uniform.count(v)) escaping.insert(v);
+            if (tuples.count(v)) for (const auto& field: tuples[v]) escape(field);
+        }
+
+        void operator()(const LetV& e) {
+            if (std::holds_alternative<Tuple>(*e.val)) {
+                tuples[e.name] = std::get<Tuple>(*e.val).fields;
+            } else if (!varying.count(e.name)) {
+                bind(e.name, e);
+                if (std::holds_alternative<Bool>(*e.val)) predicates.insert(e.name);
+            }
+        }
+        void operator()(const LetC&) {}
+        void operator()(const LetT& e) {
+            if (params.count(e.tuple) && params[e.tuple].count(e.field)) {
+                bind(e.name, e);
+            } else if (tuples.count(e.tuple) && uniform.count(tuples[e.tuple].at(e.field))) {
+                bind(e.name, e);
+            } else {
+                escape(e.tuple);
+            }
+        }
+        void operator()(const LetF&) {}
+        void operator()(const LetP& e) {
+            auto all = std::all_of(e.args.begin(), e.args.end(), [&](const auto& arg) { return uniform.count(arg); });
+            if (all && !varying.count(e.var)) {
+                bind(e.var, e);
+                if (comparison(e.name)) predicates.insert(e.var);
+            } else {
+                for (const auto& arg: e.args) escape(arg);
+            }
+        }
+        void operator()(const AppC& e) { for (const auto& arg: e.args) escape(arg); }
+        void operator()(const AppF& e) { for (const auto& arg: e.args) escape(arg); }
+        // branches test the scalar condition
+        void operator()(const If&) {}
+        void operator()(const Halt& e) { escape(e.name); }
+    };
+
+    struct GenCXX {
+        CXXOptions options;
+        std::string ret = "";
+        int indent = 0;
+        std::vector<std::string> code;
+        // SoA: arrays standing in for the kernel's arguments
+        std::unordered_map<variable, std::vector<std::string>> arrays;
+        // SoA: arrays storing the fields of the kernel's result, outputs of
+        // their own or fields of the arguments updated in place
+        std::vector<std::string> results;
+        // SoA: tuples built in the kernel body, never materialised
+        std::unordered_map<variable, std::vector<variable>> tuples;
+        // SoA: number of CVs handled by the loop body being emitted
+        size_t lanes = 1;
+        // SoA: parameters selecting the CVs to handle, then kernel parameters
+        // as (type, name), and arguments which are not tuples
+        std::vector<std::pair<std::string, std::string>> range;
+        std::vector<std::pair<std::string, std::string>> params;
+        std::vector<std::string> scalars;
+        // headers from runtime/ needed by the generated code
+        std::set<std::string> includes;
+        // declarations of everything the generated code defines for other
+        // translation units, making up its header
+        std::vector<std::string> exports;
+        // tuples are plain structs with fields _0, _1, ...; one per list of
+        // field types, named after these, eg __sc_tuple_dd for two doubles.
+        // Definitions in order, inner tuples first, and the code per name
+        std::vector<std::string> structs;
+        std::unordered_map<std::string, std::string> codes;
+        // SoA: subterms replaced by table lookups in the current kernel, and
+        // the name of the kernel's parameter holding the tables
+        Tabulation tabulation;
+        std::string tables = "";
+        // SoA: arrays accessed through the node index, and the index pattern
+        // of the loop being emitted; Gather is the general case
+        std::set<std::string> indexed;
+        enum class Index { Direct, Gather, Contiguous, Constant, Independent };
+        Index index = Index::Direct;
+        // SoA: bindings computed once, before the loops
+        FindUniform uniform;
+        // functions applied anywhere in the program; those at the top level
+        // are emitted as static inline helpers, in SoA once per vector width
+        std::unordered_set<variable> called;
+        std::unordered_set<variable> helpers;
+        // SoA: helpers branching per CV, which have no vector variants; and
+        // whether the kernel being emitted branches per CV, or calls one of
+        // these. Such kernels run their scalar loop only.
+        std::unordered_set<variable> scalar_helpers;
+        bool scalar_only = false;
+        // number of function bodies around the code being emitted; functions
+        // below the top level are closures, emitted as lambdas
+        size_t depth = 0;
+        // continuations in scope, their bodies are emitted where they are applied
+        std::unordered_map<variable, const LetC*> continuations;
+        // use sites per variable; typed continuations applied more than once
+        // become join points instead: their arguments are assigned, followed
+        // by a goto to the body, which is emitted once after the scope
+        Symbols::Map<size_t> uses;
+        std::unordered_map<variable, std::string> joins;
+        size_t labels = 0;
+        // number of join point scopes around the code being emitted
+        size_t joining = 0;
+        // SoA: the continuation of the kernel being emitted, applying it stores
+        // the results; and whether the kernel returns a tuple
+        variable sink = "";
+        bool tupled = false;
+        // continuations returned to around the branches being emitted
+        std::vector<std::string> branches;
+        // types of all variables, from check_types; bindings are declared
+        // with these rather than auto
+        Symbols::Map<Types::type> types;
+
+        GenCXX(const CXXOptions& o={}): options{o} {}
+
+        bool soa() const { return options.layout == CXXOptions::Layout::SoA; }
+        void emit(const std::string& line) { code.push_back(std::string(indent, ' ') + line); }
+        // emit the first line of a definition with external linkage, a
+        // function's ending in " {", a constant's in its initialiser
+        void define(const std::string& line);
+
+        void kernel(const LetF& e);
+        void helper(const LetF& e);
+        // SoA: whether body branches on a condition which is not uniform, or
+        // calls a helper that does
+        bool diverges(const term& body) const;
+        std::string parameters(const LetF& e);
+        std::string result_type(const LetF& e);
+        // declaration of v with its type, as scalar or vector as per `lanes`
+        std::string local(const variable& v, const std::string& name="");
+        const LetC& continuation(const variable& k) const;
+        bool join_point(const LetC& e) const;
+        void jump(const variable& k, const std::vector<std::string>& vals);
+        // name of function f as called from the loop being emitted
+        std::string callee(const variable& f) const;
+        // a variable as a C++ value, building the tuples SoA keeps apart
+        std::string value(const variable& v);
+        // the struct holding fields of the given C++ types
+        std::string tuple_type(const std::vector<std::string>& fields);
+        // SoA: store the results of the kernel
+        void yield(const variable& v);
+        void variant(const LetF& e, const std::string& name, const std::string& prefix);
+        void dispatcher(const LetF& e);
+        void loop(const LetF& e, size_t width);
+        void runs(const LetF& e);
+        void colored(const LetF& e);
+        void hoist();
+        // SoA: a variable as used in the loop being emitted
+        std::string use(const variable& v) const;
+        void lookup(const LetP& e);
+        void tables_init(const LetF& e);
+
+        // SoA: lane-wise operations, scalar or vector depending on `lanes`
+        std::string vector_type() const;
+        std::string mask_type() const;
+        std::string load(const std::string& ptr) const;
+        std::string store(const std::string& ptr, const std::string& val) const;
+        std::string gather(const std::string& ptr) const;
+        std::string scatter_add(const std::string& ptr, const std::string& val) const;
+        std::string splat(const std::string& val) const;
+        std::string mask(const std::string& val) const;
+        std::string binary(const std::string& op, const std::string& lhs, const std::string& rhs) const;
+        std::string fused(const std::string& op, const std::string& a, const std::string& b, const std::string& c) const;
+        std::string compare(const std::string& op, const std::string& lhs, const std::string& rhs) const;
+        std::string select(const std::string& cond, const std::string& lhs, const std::string& rhs) const;
+        std::string prim(const LetP& e);
+
+        Step<Unit> operator()(const LetV& e, const Results<Unit>& done) {
+            if (!done.empty()) return Unit{};
+            if (soa() && std::holds_alternative<Tuple>(*e.val)) {
+                tuples[e.name] = std::get<Tuple>(*e.val).fields;
+                return descend(e.in);
+            }
+            if (uniform.uniform.count(e.name)) {
+                return descend(e.in);
+            }
+            if (soa() && std::holds_alternative<F64>(*e.val)) {
+                if (!tabulation.hidden.count(e.name)) emit(local(e.name) + " = " + splat(std::visit(*this, *e.val)) + ";");
+                return descend(e.in);
+            }
+            auto value = std::visit(*this, *e.val);
+            std::string line = local(e.name) + " = " + value + ";";
+            code.push_back(std::string(indent, ' ') + line);
+            return descend(e.in);
+        }
+        Step<Unit> operator()(const LetC& e, const Results<Unit>& done) {
+            if (!join_point(e)) {
+                if (!done.empty()) return Unit{};
+                continuations[e.name] = &e;
+                return descend(e.in);
+            }
+            switch (done.size()) {
+            case 0: {
+                continuations[e.name] = &e;
+                for (const auto& arg: e.args) emit(std::visit(*this, *types.at(arg)) + " " + arg + ";");
+                joins[e.name] = e.name + "_" + std::to_string(labels++);
+                joining++;
+                emit("{");
+                indent += 4;
+                return descend(e.in);
+            }
+            case 1:
+                indent -= 4;
+                emit("}");
+                joining--;
+                emit(joins[e.name] + ":;");
+                return descend(e.body);
+            }
+            return Unit{};
+        }
+        Step<Unit> operator()(const LetT& e, const Results<Unit>& done) {
+            if (!done.empty()) return Unit{};
+            if (uniform.uniform.count(e.name)) {
+                return descend(e.in);
+            }
+            std::string line = local(e.name) + " = " + e.tuple + "._" + std::to_string(e.field) + ";";
+            if (arrays.count(e.tuple)) {
+                line = local(e.name) + " = " + load(arrays[e.tuple].at(e.field)) + ";";
+            } else if (tuples.count(e.tuple)) {
+                line = local(e.name) + " = " + use(tuples[e.tuple].at(e.field)) + ";";
+            }
+            code.push_back(std::string(indent, ' ') + line);
+            return descend(e.in);
+        }
+        Step<Unit> operator()(const LetP& e, const Results<Unit>& done) {
+            if (!done.empty()) return Unit{};
+            if (uniform.uniform.count(e.var) || tabulation.hidden.count(e.var)) {
+                return descend(e.in);
+            }
+            if (tabulation.cones.count(e.var)) {
+                lookup(e);
+                return descend(e.in);
+            }
+            code.push_back(std::string(indent, ' ') + local(e.var) + " = " + prim(e) + ";");
+            return descend(e.in);
+        }
+        // continuations returned to by the enclosing functions
+        std::vector<std::string> outer;
+        Step<Unit> operator()(const LetF& e, const Results<Unit>& done) {
+            if ((depth == 0) && called.count(e.name)) helpers.insert(e.name);
+            if (soa() && (depth == 0)) {
+                if (!done.empty()) return Unit{};
+                if (helpers.count(e.name)) {
+                    helper(e);
+                } else {
+                    kernel(e);
+                }
+                return descend(e.in);
+            }
+            switch (done.size()) {
+            case 1:
+                depth--;
+                indent -= 4;
+                emit((depth > 0) ? "};" : "}");
+                ret = outer.back();
+                outer.pop_back();
+                return descend(e.in);
+            case 2:
+                return Unit{};
+            }
+            outer.push_back(ret);
+            ret = e.cont;
+            if (depth > 0) {
+                // closures capture by value, they may outlive the scope
+                emit("const auto " + e.name + " = [=](" + parameters(e) + ") -> " + result_type(e) + " {");
+            } else {
+                if (helpers.count(e.name)) {
+                    emit("static inline " + result_type(e) + " " + e.name + "(" + parameters(e) + ") {");
+                } else {
+                    define(result_type(e) + " " + e.name + "(" + parameters(e) + ") {");
+                }
+            }
+            depth++;
+            indent += 4;
+            return descend(e.body);
+        }
+        Step<Unit> operator()(const AppC& e, const Results<Unit>& done) {
+            if (!done.empty()) return Unit{};
+            if (soa() && (e.name == sink)) {
+                yield(e.args.at(0));
+                ret = "";
+            } else if (e.name == ret) {
+                emit("return " + value(e.args.at(0)) + ";");
+                ret = "";
+            } else if (joins.count(e.name)) {
+                auto vals = std::vector<std::string>{};
+                for (const auto& arg: e.args) vals.push_back(value(arg));
+                jump(e.name, vals);
+            } else {
+                const auto& k = continuation(e.name);
+                if (k.args.size() != e.args.size()) throw std::runtime_error("Wrong number of arguments to continuation: "s + e.name);
+                for (auto ix = 0ul; ix < e.args.size(); ++ix) {
+                    if (tuples.count(e.args[ix])) {
+                        tuples[k.args[ix]] = tuples[e.args[ix]];
+                    } else {
+                        emit(local(k.args[ix]) + " = " + use(e.args[ix]) + ";");
+                    }
+                }
+                return descend(k.body);
+            }
+            return Unit{};
+        }
+        Step<Unit> operator()(const If& e, const Results<Unit>& done) {
+            switch (done.size()) {
+            case 0:
+                // uniform conditions are scalars computed before the loops
+                if ((lanes > 1) && !uniform.uniform.count(e.cond)) {
+                    throw std::runtime_error("Cannot branch on a condition differing between lanes: "s + e.cond);
+                }
+                branches.push_back(ret);
+                emit("if (" + e.cond + ") {");
+                indent += 4;
+                return descend(e.then);
+            case 1:
+                ret = branches.back();
+                indent -= 4;
+                emit("} else {");
+                indent += 4;
+                return descend(e.otherwise);
+            }
+            ret = branches.back();
+            branches.pop_back();
+            indent -= 4;
+            emit("}");
+            return Unit{};
+        }
+        Step<Unit> operator()(const AppF& e, const Results<Unit>& done) {
+            if (!done.empty()) return Unit{};
+            std::string call = callee(e.name) + "(";
+            for (const auto& arg: e.args) call += value(arg) + ", ";
+            if (call.back() == ' ') { call.erase(call.begin() + call.size() - 2, call.end()); }
+            call += ")";
+            if (soa() && (e.cont == sink)) {
+                variable res = e.cont + "_value";
+                auto result = std::get<Types::TyFunc>(*Types::resolve(types.at(e.name))).result;
+                emit("const " + std::visit(*this, *result) + " " + res + " = " + call + ";");
+                yield(res);
+                ret = "";
+            } else if (e.cont == ret) {
+                emit("return " + call + ";");
+                ret = "";
+            } else if (joins.count(e.cont)) {
+                jump(e.cont, {call});
+            } else {
+                const auto& k = continuation(e.cont);
+                if (k.args.size() != 1) throw std::runtime_error("Continuation without exactly one argument: "s + e.cont);
+                emit(local(k.args[0]) + " = " + call + ";");
+                return descend(k.body);
+            }
+            return Unit{};
+        }
+        Step<Unit> operator()(const Halt& e, const Results<Unit>&) {
+            code.push_back(std::string(indent, ' ') + "// HALT " + e.name);
+            return Unit{};
+        }
+        std::string operator()(const F64& v) {
+            // shortest round-trip form, std::to_string only keeps six digits
+            char buf[32];
+            auto res = std::string(buf, std::to_chars(buf, buf + sizeof(buf), v.value).ptr);
+            if (res.find_first_of(".en") == std::string::npos) { res += ".0"; }
+            return res;
+        }
+        std::string operator()(const Bool& v) { return std::to_string(v.value); }
+        std::string operator()(const Tuple& v) {
+            std::string res = "{";
+            for (const auto& field: v.fields) {
+                res += field + ", ";
+            }
+            if (res.back() == ' ') { res.erase(res.begin() + res.size() - 2, res.end()); }
+            res += "}";
+            if (!v.type) throw Types::TypeError("Tuple without a type");
+            return std::visit(*this, *v.type) + res;
+        }
+        std::string operator()(const Types::TyF64&) { return (lanes > 1) ? vector_type() : "double"; }
+        std::string operator()(const Types::TyBool&) { return (lanes > 1) ? mask_type() : "bool"; }
+        std::string operator()(const Types::TyTuple& t) {
+            std::vector<std::string> fields;
+            for (const auto& type: t.field_types) fields.push_back(std::visit(*this, *type));
+            return tuple_type(fields);
+        }
+        std::string operator()(const Types::TyFunc& t) {
+            includes.insert("<functional>");
+            std::string res = "std::function<" + std::visit(*this, *t.result) + "(";
+            for (const auto& type: t.args) {
+                res += std::visit(*this, *type);
+                res += ", ";
+            }
+            if (res.back() == ' ') { res.erase(res.begin() + res.size() - 2, res.end()); }
+            res += ")>";
+            return res;
+        }
+        std::string operator()(const Types::TyVar& v) {
+            if (v.alias) { return std::visit(*this, *v.alias); }
+            throw Types::TypeError("Unresolved type variable: __ty_var_" + std::to_string(v.id));
+        }
+    };
+
+    void generate_cxx(std::ostream&, const term&, const CXXOptions& options={});
+    // ... also writing a header declaring the functions and constants the
+    // generated code exports
+    void generate_cxx(std::ostream&, std::ostream& header, const term&, const CXXOptions& options={});
+}
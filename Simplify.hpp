@@ -1,149 +1,563 @@
 #pragma once
 
+#include <cmath>
+#include <queue>
+
 #include "TailCPS.hpp"
+#include "runtime/sc_math.hpp"
 
 namespace TailCPS {
+    bool foldable(const std::string& op) {
+        static const std::vector<std::string> ops = {"+", "-", "*", "/", "exp", "log", "expm1", "exprelr", "fma", "fms", "fnma"};
+        return std::find(ops.begin(), ops.end(), op) != ops.end();
+    }
+
+    // Evaluate a primitive on known arguments; same implementation as the
+    // generated code, so folded constants are identical to computed ones.
+    double fold(const std::string& op, const std::vector<double>& xs) {
+        if (op == "+")       return xs[0] + xs[1];
+        if (op == "-")       return xs[0] - xs[1];
+        if (op == "*")       return xs[0] * xs[1];
+        if (op == "/")       return xs[0] / xs[1];
+        if (op == "exp")     return sc::math::exp(xs[0]);
+        if (op == "log")     return sc::math::log(xs[0]);
+        if (op == "expm1")   return sc::math::expm1(xs[0]);
+        if (op == "exprelr") return sc::math::exprelr(xs[0]);
+        if (op == "fma")     return std::fma(xs[0], xs[1], xs[2]);
+        if (op == "fms")     return std::fma(xs[0], xs[1], -xs[2]);
+        if (op == "fnma")    return std::fma(-xs[0], xs[1], xs[2]);
+        throw std::runtime_error("Unimplemented PrimOp: '"s + op + "'");
+    }
+
+    bool compare(const std::string& op, double lhs, double rhs) {
+        if (op == "<")  return lhs < rhs;
+        if (op == ">")  return lhs > rhs;
+        if (op == "<=") return lhs <= rhs;
+        if (op == ">=") return lhs >= rhs;
+        throw std::runtime_error("Unimplemented comparison: '"s + op + "'");
+    }
+
     struct PrimSimplify {
-        std::vector<std::pair<std::string, double>> known_f64;
-        std::vector<std::pair<std::string, bool>> known_bool;
-        std::vector<std::pair<std::string, std::vector<std::string>>> known_tuple;
+        std::vector<std::pair<variable, double>> known_f64;
+        std::vector<std::pair<variable, bool>> known_bool;
+        std::vector<std::pair<variable, variables>> known_tuple;
 
-        std::vector<std::pair<std::string, double>>::reverse_iterator
-        try_find_f64(const std::string& name) {
+        std::vector<std::pair<variable, double>>::reverse_iterator
+        try_find_f64(const variable& name) {
             return std::find_if(known_f64.rbegin(),
                                 known_f64.rend(),
                                 [&](const auto& it){ return it.first == name; });
         }
 
-        std::vector<std::pair<std::string, bool>>::reverse_iterator
-        try_find_bool(const std::string& name) {
+        std::vector<std::pair<variable, bool>>::reverse_iterator
+        try_find_bool(const variable& name) {
             return std::find_if(known_bool.rbegin(),
                                 known_bool.rend(),
                                 [&](const auto& it){ return it.first == name; });
         }
 
-        std::vector<std::pair<std::string, std::vector<std::string>>>::reverse_iterator
-        try_find_tuple(const std::string& name) {
+        std::vector<std::pair<variable, variables>>::reverse_iterator
+        try_find_tuple(const variable& name) {
             return std::find_if(known_tuple.rbegin(),
                                 known_tuple.rend(),
                                 [&](const auto& it){ return it.first == name; });
         }
 
-        term operator()(const LetV& t) {
-            auto tmp = t;
-            if (std::holds_alternative<F64>(*tmp.val)) {
-                known_f64.push_back({tmp.name, std::get<F64>(*tmp.val).value});
-                tmp.in = std::visit(*this, *tmp.in);
+        // Values pushed when entering a binding, popped when leaving it
+        bool pushed_f64(const variable& name) const { return !known_f64.empty() && (known_f64.back().first == name); }
+        bool pushed_bool(const variable& name) const { return !known_bool.empty() && (known_bool.back().first == name); }
+
+        Step<term> operator()(const LetV& t, const Results<term>& done) {
+            if (done.empty()) {
+                if (std::holds_alternative<F64>(*t.val)) known_f64.push_back({t.name, std::get<F64>(*t.val).value});
+                if (std::holds_alternative<Bool>(*t.val)) known_bool.push_back({t.name, std::get<Bool>(*t.val).value});
+                if (std::holds_alternative<Tuple>(*t.val)) known_tuple.push_back({t.name, std::get<Tuple>(*t.val).fields});
+                return descend(t.in);
+            }
+            if (std::holds_alternative<F64>(*t.val)) known_f64.pop_back();
+            if (std::holds_alternative<Bool>(*t.val)) known_bool.pop_back();
+            if (std::holds_alternative<Tuple>(*t.val)) known_tuple.pop_back();
+            return rebuild(t, done);
+        }
+        Step<term> operator()(const LetC& t, const Results<term>& done) { return rewrite_children(t, done); }
+        Step<term> operator()(const LetT& t, const Results<term>& done) {
+            if (done.empty()) {
+                auto tuple = try_find_tuple(t.tuple);
+                if (tuple != known_tuple.rend()) {
+                    auto name = tuple->second[t.field];
+                    auto pf64 = try_find_f64(name);
+                    if (pf64 != known_f64.rend()) {
+                        known_f64.push_back({t.name, pf64->second});
+                        return descend(t.in);
+                    }
+                    auto pbool = try_find_bool(name);
+                    if (pbool != known_bool.rend()) {
+                        known_bool.push_back({t.name, pbool->second});
+                        return descend(t.in);
+                    }
+                }
+                return descend(t.in);
+            }
+            if (pushed_f64(t.name)) {
+                auto val = known_f64.back().second;
                 known_f64.pop_back();
-                return std::make_shared<Term>(tmp);
+                return let(t.name, f64(val), done[0]);
             }
-            if (std::holds_alternative<Bool>(*tmp.val)) {
-                known_bool.push_back({tmp.name, std::get<Bool>(*tmp.val).value});
-                tmp.in = std::visit(*this, *tmp.in);
+            if (pushed_bool(t.name)) {
+                auto val = known_bool.back().second;
                 known_bool.pop_back();
-                return std::make_shared<Term>(tmp);
+                return let(t.name, boolean(val), done[0]);
             }
+            return rebuild(t, done);
+        }
+        Step<term> operator()(const LetF& t, const Results<term>& done) { return rewrite_children(t, done); }
+        Step<term> operator()(const LetP& t, const Results<term>& done) {
+            if (done.empty()) {
+                if (t.name == "select") {
+                    auto cond = try_find_bool(t.args[0]);
+                    if (cond == known_bool.rend()) return descend(t.in);
+                    auto x = try_find_f64(t.args[cond->second ? 1 : 2]);
+                    if (x != known_f64.rend()) known_f64.push_back({t.var, x->second});
+                    return descend(t.in);
+                }
+                if (!foldable(t.name) && !comparison(t.name)) throw std::runtime_error("Unimplemented PrimOp: '"s + t.name + "'");
+                auto xs = std::vector<double>{};
+                for (const auto& arg: t.args) {
+                    auto x = try_find_f64(arg);
+                    if (x == known_f64.rend()) break;
+                    xs.push_back(x->second);
+                }
+                if (xs.size() == t.args.size()) {
+                    if (comparison(t.name)) {
+                        known_bool.push_back({t.var, compare(t.name, xs[0], xs[1])});
+                    } else {
+                        known_f64.push_back({t.var, fold(t.name, xs)});
+                    }
+                }
+                return descend(t.in);
+            }
+            if (pushed_f64(t.var)) {
+                auto res = known_f64.back().second;
+                known_f64.pop_back();
+                return let(t.var, f64(res), done[0]);
+            }
+            if (pushed_bool(t.var)) {
+                auto res = known_bool.back().second;
+                known_bool.pop_back();
+                return let(t.var, boolean(res), done[0]);
+            }
+            return rebuild(t, done);
+        }
+        Step<term> operator()(const AppF& t, const Results<term>& done) { return rewrite_children(t, done); }
+        Step<term> operator()(const AppC& t, const Results<term>& done) { return rewrite_children(t, done); }
+        // only the arm taken on a known condition
+        Step<term> operator()(const If& t, const Results<term>& done) {
+            auto cond = try_find_bool(t.cond);
+            if (cond == known_bool.rend()) return rewrite_children(t, done);
+            if (done.empty()) return descend(cond->second ? t.then : t.otherwise);
+            return done[0];
+        }
+        Step<term> operator()(const Halt& t, const Results<term>& done) { return rewrite_children(t, done); }
+    };
+
+    term prim_simplify(const term& in) {
+        auto simplify = PrimSimplify();
+        return dead_let(Traverse::run<term>(simplify, in));
+    }
+
+    // Shrinking reductions in the style of Appel and Jim: one traversal
+    //  - removes bindings without uses
+    //  - inlines functions and continuations applied exactly once
+    //  - folds primitives on known constants
+    //  - takes branches and selects on known conditions
+    //  - resolves projections from known tuples
+    //  - propagates the copies arising from the above
+    // keeping the census of use sites up to date as it goes. None of these
+    // grow the program; each may expose more, so shrink repeats to a fixpoint.
+    // Relies on unique names, ie alpha conversion.
+    struct Shrink {
+        size_t count = 0ul;
+        Symbols::Map<size_t> uses;
+        Symbols::Map<variable> rename;
+        Symbols::Map<double> known_f64;
+        std::unordered_map<variable, bool> known_bool;
+        Symbols::Map<variables> known_tuple;
+        // continuation and arguments, unshrunk body
+        Symbols::Map<std::tuple<variable, variables, term>> functions;
+        Symbols::Map<std::pair<variables, term>> continuations;
+        Symbols::Set inlined;
+
+        Shrink(const Symbols::Map<size_t>& u): uses{u} {}
+
+        variable resolve(variable v) const {
+            while (rename.contains(v)) v = rename.at(v);
+            return v;
+        }
+        void resolve(variables& vs) const { for (auto& v: vs) v = resolve(v); }
+
+        // replace v by w, which inherits its uses
+        void alias(const variable& v, const variable& w) {
+            rename[v] = w;
+            uses[w] += uses[v];
+            uses[v] = 0;
+        }
+
+        bool dead(const variable& v) { return uses[v] == 0; }
+        void release(const variable& v) { Release{uses, &rename}.release(v); }
+        void release(const term& t) { Traverse::walk(Release{uses, &rename}, t); }
+
+        Step<term> operator()(const LetV& t, const Results<term>& done) {
+            if (done.empty()) {
+                if (std::holds_alternative<Tuple>(*t.val)) {
+                    auto fields = std::get<Tuple>(*t.val).fields;
+                    resolve(fields);
+                    known_tuple[t.name] = fields;
+                }
+                if (std::holds_alternative<F64>(*t.val)) known_f64[t.name] = std::get<F64>(*t.val).value;
+                if (std::holds_alternative<Bool>(*t.val)) known_bool[t.name] = std::get<Bool>(*t.val).value;
+                return descend(t.in);
+            }
+            auto tmp = t;
+            if (std::holds_alternative<Tuple>(*t.val)) tmp.val = update(t.val, known_tuple.at(t.name));
+            tmp.in = done[0];
+            if (!dead(t.name)) return update(t, tmp);
+            count++;
             if (std::holds_alternative<Tuple>(*tmp.val)) {
-                known_tuple.push_back({tmp.name, std::get<Tuple>(*tmp.val).fields});
-                tmp.in = std::visit(*this, *tmp.in);
-                known_tuple.pop_back();
-                return std::make_shared<Term>(tmp);
+                for (const auto& field: std::get<Tuple>(*tmp.val).fields) release(field);
             }
-            tmp.in = std::visit(*this, *tmp.in);
-            return std::make_shared<Term>(tmp);
+            return tmp.in;
         }
-        term operator()(const LetC& t) {
+        Step<term> operator()(const LetT& t, const Results<term>& done) {
+            if (done.empty()) {
+                auto tuple = resolve(t.tuple);
+                if (known_tuple.contains(tuple)) {
+                    count++;
+                    release(tuple);
+                    alias(t.name, known_tuple.at(tuple)[t.field]);
+                }
+                return descend(t.in);
+            }
+            // resolved to a field of a known tuple
+            if (rename.contains(t.name)) return done[0];
             auto tmp = t;
-            tmp.body = std::visit(*this, *tmp.body);
-            tmp.in = std::visit(*this, *tmp.in);
-            return std::make_shared<Term>(tmp);
+            tmp.tuple = resolve(t.tuple);
+            tmp.in = done[0];
+            if (!dead(t.name)) return update(t, tmp);
+            count++;
+            release(tmp.tuple);
+            return tmp.in;
         }
-        term operator()(const LetT& t) {
+        Step<term> operator()(const LetP& t, const Results<term>& done) {
             auto tmp = t;
-            auto tuple = try_find_tuple(tmp.tuple);
-            if (tuple != known_tuple.rend()) {
-                auto name = tuple->second[t.field];
-                auto pf64 = try_find_f64(name);
-                if (pf64 != known_f64.rend()) {
-                    auto val = pf64->second;
-                    known_f64.push_back({tmp.name, val});
-                    tmp.in = std::visit(*this, *tmp.in);
-                    known_f64.pop_back();
-                    return let(tmp.name, f64(val), tmp.in);
-                }
-                auto pbool = try_find_bool(name);
-                if (pbool != known_bool.rend()) {
-                    auto val = pbool->second;
-                    known_bool.push_back({tmp.name, val});
-                    tmp.in = std::visit(*this, *tmp.in);
-                    known_bool.pop_back();
-                    return let(tmp.name, boolean(val), tmp.in);
-                }
-            }
-            tmp.in = std::visit(*this, *tmp.in);
-            return std::make_shared<Term>(tmp);
-        }
-        term operator()(const LetF& t) {
+            resolve(tmp.args);
+            if (done.empty()) {
+                if ((t.name == "select") && known_bool.count(tmp.args[0])) {
+                    count++;
+                    for (const auto& arg: tmp.args) release(arg);
+                    alias(t.var, tmp.args[known_bool.at(tmp.args[0]) ? 1 : 2]);
+                    return descend(t.in);
+                }
+                auto xs = std::vector<double>{};
+                for (const auto& arg: tmp.args) {
+                    if (!known_f64.contains(arg)) break;
+                    xs.push_back(known_f64.at(arg));
+                }
+                if (xs.size() == tmp.args.size()) {
+                    if (foldable(t.name)) known_f64[t.var] = fold(t.name, xs);
+                    if (comparison(t.name)) known_bool[t.var] = compare(t.name, xs[0], xs[1]);
+                }
+                return descend(t.in);
+            }
+            // resolved to the selected argument
+            if (rename.contains(t.var)) return done[0];
+            auto known = known_f64.contains(t.var) || known_bool.count(t.var);
+            tmp.in = done[0];
+            if (known || dead(t.var)) {
+                count++;
+                for (const auto& arg: tmp.args) release(arg);
+            }
+            if (dead(t.var)) return tmp.in;
+            if (known_bool.count(t.var)) return let(t.var, boolean(known_bool.at(t.var)), tmp.in);
+            if (known) return let(t.var, f64(known_f64.at(t.var)), tmp.in);
+            return update(t, tmp);
+        }
+        Step<term> operator()(const LetC& t, const Results<term>& done) {
+            switch (done.size()) {
+            case 0:
+                continuations[t.name] = {t.args, t.body};
+                return descend(t.in);
+            case 1:
+                if (inlined.contains(t.name)) return done[0];
+                if (dead(t.name)) {
+                    count++;
+                    release(t.body);
+                    return done[0];
+                }
+                // no inlining into its own body
+                inlined.insert(t.name);
+                return descend(t.body);
+            }
             auto tmp = t;
-            tmp.body = std::visit(*this, *tmp.body);
-            tmp.in = std::visit(*this, *tmp.in);
-            return std::make_shared<Term>(tmp);
+            tmp.in = done[0];
+            tmp.body = done[1];
+            return update(t, tmp);
         }
-        term operator()(const LetP& t) {
+        Step<term> operator()(const LetF& t, const Results<term>& done) {
+            switch (done.size()) {
+            case 0:
+                functions[t.name] = {t.cont, t.args, t.body};
+                return descend(t.in);
+            case 1:
+                if (inlined.contains(t.name)) return done[0];
+                if (dead(t.name)) {
+                    count++;
+                    release(t.body);
+                    return done[0];
+                }
+                inlined.insert(t.name);
+                return descend(t.body);
+            }
             auto tmp = t;
-            if (tmp.name == "+") {
-                auto lhs = try_find_f64(tmp.args[0]);
-                auto rhs = try_find_f64(tmp.args[1]);
-                if ((lhs != known_f64.rend()) && (rhs != known_f64.rend())) {
-                    auto res = lhs->second + rhs->second;
-                    known_f64.push_back({tmp.var, res});
-                    tmp.in = std::visit(*this, *tmp.in);
-                    known_f64.pop_back();
-                    return let(tmp.var, f64(res), tmp.in);
-                }
-                return std::make_shared<Term>(tmp);
-            }
-            if (tmp.name == "-") {
-                auto lhs = try_find_f64(tmp.args[0]);
-                auto rhs = try_find_f64(tmp.args[1]);
-                if ((lhs != known_f64.rend()) && (rhs != known_f64.rend())) {
-                    auto res = lhs->second - rhs->second;
-                    known_f64.push_back({tmp.var, res});
-                    tmp.in = std::visit(*this, *tmp.in);
-                    known_f64.pop_back();
-                    return let(tmp.var, f64(res), tmp.in);
-                }
-                return std::make_shared<Term>(tmp);
-            }
-            if (tmp.name == "*") {
-                auto lhs = try_find_f64(tmp.args[0]);
-                auto rhs = try_find_f64(tmp.args[1]);
-                if ((lhs != known_f64.rend()) && (rhs != known_f64.rend())) {
-                    auto res = lhs->second * rhs->second;
-                    known_f64.push_back({tmp.var, res});
-                    tmp.in = std::visit(*this, *tmp.in);
-                    known_f64.pop_back();
-                    return let(tmp.var, f64(res), tmp.in);
-                }
-                return std::make_shared<Term>(tmp);
-            }
-            throw std::runtime_error("Unimplemented PrimOp: '"s + t.name + "'");
-        }
-        term operator()(const AppF& t) {
+            tmp.in = done[0];
+            tmp.body = done[1];
+            return update(t, tmp);
+        }
+        // Inlined bodies are shrunk in place of the application
+        Step<term> operator()(const AppC& t, const Results<term>& done) {
+            if (!done.empty()) return done[0];
             auto tmp = t;
-            return std::make_shared<Term>(tmp);
+            tmp.name = resolve(t.name);
+            resolve(tmp.args);
+            if (continuations.contains(tmp.name) && !inlined.contains(tmp.name) && (uses[tmp.name] == 1)) {
+                const auto& [args, body] = continuations.at(tmp.name);
+                if (args.size() == tmp.args.size()) {
+                    count++;
+                    inlined.insert(tmp.name);
+                    release(tmp.name);
+                    for (auto ix = 0ul; ix < args.size(); ++ix) {
+                        release(tmp.args[ix]);
+                        alias(args[ix], tmp.args[ix]);
+                    }
+                    return descend(body);
+                }
+            }
+            return update(t, tmp);
         }
-        term operator()(const AppC& t) {
+        // Only the arm taken on a known condition
+        Step<term> operator()(const If& t, const Results<term>& done) {
+            auto cond = resolve(t.cond);
+            if (known_bool.count(cond)) {
+                if (!done.empty()) return done[0];
+                count++;
+                release(cond);
+                release(known_bool.at(cond) ? t.otherwise : t.then);
+                return descend(known_bool.at(cond) ? t.then : t.otherwise);
+            }
+            if (auto next = child(t, done.size())) return descend(next);
             auto tmp = t;
-            return std::make_shared<Term>(tmp);
+            tmp.cond = cond;
+            tmp.then = done[0];
+            tmp.otherwise = done[1];
+            return update(t, tmp);
         }
-        term operator()(const Halt& t) {
+        Step<term> operator()(const AppF& t, const Results<term>& done) {
+            if (!done.empty()) return done[0];
             auto tmp = t;
-            return std::make_shared<Term>(tmp);
+            tmp.name = resolve(t.name);
+            tmp.cont = resolve(t.cont);
+            resolve(tmp.args);
+            if (functions.contains(tmp.name) && !inlined.contains(tmp.name) && (uses[tmp.name] == 1)) {
+                const auto& [cont, args, body] = functions.at(tmp.name);
+                if (args.size() == tmp.args.size()) {
+                    count++;
+                    inlined.insert(tmp.name);
+                    release(tmp.name);
+                    release(tmp.cont);
+                    alias(cont, tmp.cont);
+                    for (auto ix = 0ul; ix < args.size(); ++ix) {
+                        release(tmp.args[ix]);
+                        alias(args[ix], tmp.args[ix]);
+                    }
+                    return descend(body);
+                }
+            }
+            return update(t, tmp);
+        }
+        Step<term> operator()(const Halt& t, const Results<term>&) {
+            auto tmp = t;
+            tmp.name = resolve(t.name);
+            return update(t, tmp);
         }
     };
 
-    term prim_simplify(const term& in) {
-        return dead_let(std::visit(PrimSimplify(), *in));
+    term shrink(const term& in) {
+        auto res = in;
+        for (;;) {
+            auto shrink = Shrink(census(res));
+            res = Traverse::run<term>(shrink, res);
+            if (shrink.count == 0) return res;
+        }
+    }
+
+    // Fuse a multiplication into the single addition or subtraction using it
+    //   a*b + c => (fma a b c)
+    //   a*b - c => (fms a b c)
+    //   c - a*b => (fnma a b c)
+    // This rounds once instead of twice.
+    struct PrimFMA {
+        Symbols::Map<size_t> uses;
+        Symbols::Map<variables> products;
+
+        PrimFMA(const Symbols::Map<size_t>& u): uses{u} {}
+
+        template<typename E>
+        Step<term> operator()(const E& t, const Results<term>& done) { return rewrite_children(t, done); }
+        Step<term> operator()(const LetP& t, const Results<term>& done) {
+            if (done.empty()) {
+                if ((t.name == "*") && (uses[t.var] == 1)) {
+                    products[t.var] = t.args;
+                }
+                return descend(t.in);
+            }
+            auto tmp = t;
+            if ((tmp.name == "+") || (tmp.name == "-")) {
+                if (products.contains(tmp.args[0])) {
+                    const auto& lhs = products.at(tmp.args[0]);
+                    tmp.name = (tmp.name == "+") ? "fma" : "fms";
+                    tmp.args = {lhs[0], lhs[1], tmp.args[1]};
+                } else if (products.contains(tmp.args[1])) {
+                    const auto& rhs = products.at(tmp.args[1]);
+                    tmp.name = (tmp.name == "+") ? "fma" : "fnma";
+                    tmp.args = {rhs[0], rhs[1], tmp.args[0]};
+                }
+            }
+            tmp.in = done[0];
+            return update(t, tmp);
+        }
+    };
+
+    term prim_fma(const term& in) {
+        auto fma = PrimFMA(census(in));
+        return dead_let(Traverse::run<term>(fma, in));
+    }
+
+    // For each variable used as a primitive's argument, the name of that primitive
+    struct Consumers {
+        Symbols::Map<variable> ops;
+
+        void operator()(const LetV&) {}
+        void operator()(const LetC&) {}
+        void operator()(const LetT&) {}
+        void operator()(const LetF&) {}
+        void operator()(const LetP& e) {
+            for (const auto& arg: e.args) ops[arg] = e.name;
+        }
+        void operator()(const AppC&) {}
+        void operator()(const AppF&) {}
+        void operator()(const If&) {}
+        void operator()(const Halt&) {}
+    };
+
+    // Rebuild chains of single-use associative primitives (+, *) as balanced
+    // trees, e.g. a + (b + (c + d)) => (a + b) + (c + d)
+    // Operands are combined in order of availability, ie the estimated depth of
+    // the dependency chain computing them, ties are broken by source order.
+    // This changes rounding and is therefore not part of the default pipeline.
+    struct PrimReassociate {
+        Symbols::Map<size_t> uses;
+        Symbols::Map<variable> consumers;
+        Symbols::Map<variables> chains;
+        Symbols::Map<size_t> depth;
+
+        PrimReassociate(const Symbols::Map<size_t>& u,
+                        const Symbols::Map<variable>& c): uses{u}, consumers{c} {}
+
+        static bool associative(const std::string& op) { return (op == "+") || (op == "*"); }
+
+        bool interior(const LetP& t) {
+            return (uses[t.var] == 1) && (consumers[t.var] == t.name);
+        }
+
+        size_t depth_of(const variable& v) {
+            return depth.contains(v) ? depth.at(v) : 0;
+        }
+
+        // Collect operands, looking through interior nodes of the chain
+        void leaves(const variable& v, std::vector<variable>& res) {
+            if (!chains.contains(v)) {
+                res.push_back(v);
+                return;
+            }
+            for (const auto& arg: chains.at(v)) leaves(arg, res);
+        }
+
+        // Rewritten primitive and the new bindings to put before it, per
+        // primitive whose scope is being visited, innermost last
+        using binding = std::tuple<variable, variable, variable>;
+        std::vector<std::pair<LetP, std::vector<binding>>> pending;
+
+        Step<term> enter(const LetP& t, const std::vector<binding>& steps={}) {
+            pending.emplace_back(t, steps);
+            return descend(t.in);
+        }
+
+        template<typename E>
+        Step<term> operator()(const E& t, const Results<term>& done) { return rewrite_children(t, done); }
+        Step<term> operator()(const LetP& t, const Results<term>& done) {
+            if (!done.empty()) {
+                auto [tmp, steps] = pending.back();
+                pending.pop_back();
+                tmp.in = done[0];
+                if (steps.empty()) return update(t, tmp);
+                term res = Memory::make_node<Term>(tmp);
+                for (auto it = steps.rbegin(); it != steps.rend(); ++it) {
+                    const auto& [v, lhs, rhs] = *it;
+                    res = Memory::make_node<Term>(LetP{tmp.name, v, {lhs, rhs}, res, tmp.type});
+                }
+                return res;
+            }
+            auto tmp = t;
+            auto d = 0ul;
+            for (const auto& arg: tmp.args) d = std::max(d, depth_of(arg) + 1);
+            depth[tmp.var] = d;
+            if (!associative(tmp.name)) return enter(tmp);
+            if (interior(tmp)) {
+                // left in place, the chain's root will no longer use it
+                chains[tmp.var] = tmp.args;
+                return enter(tmp);
+            }
+            auto ops = std::vector<variable>{};
+            for (const auto& arg: tmp.args) leaves(arg, ops);
+            // combine the two operands available first, until one is left
+            using item = std::tuple<size_t, size_t, variable>;
+            auto queue = std::priority_queue<item, std::vector<item>, std::greater<item>>{};
+            for (auto ix = 0ul; ix < ops.size(); ++ix) queue.push({depth_of(ops[ix]), ix, ops[ix]});
+            auto order = ops.size();
+            auto steps = std::vector<binding>{};
+            while (queue.size() > 2) {
+                auto [da, ia, a] = queue.top(); queue.pop();
+                auto [db, ib, b] = queue.top(); queue.pop();
+                auto v = tmp.var + "_" + std::to_string(steps.size());
+                steps.emplace_back(v, a, b);
+                depth[v] = std::max(da, db) + 1;
+                queue.push({depth[v], order++, v});
+            }
+            auto [da, ia, a] = queue.top(); queue.pop();
+            auto [db, ib, b] = queue.top(); queue.pop();
+            if (std::max(da, db) + 1 >= d) {
+                // no shorter than what we have
+                return enter(tmp);
+            }
+            depth[tmp.var] = std::max(da, db) + 1;
+            tmp.args = {a, b};
+            return enter(tmp, steps);
+        }
+    };
+
+    term prim_reassociate(const term& in) {
+        auto consumers = Consumers();
+        Traverse::walk(consumers, in);
+        auto reassociate = PrimReassociate(census(in), consumers.ops);
+        return dead_let(Traverse::run<term>(reassociate, in));
     }
 }
@@ -0,0 +1,50 @@
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "Symbol.hpp"
+
+namespace Symbols {
+    namespace {
+        // deque, so references to names stay valid; id 0 is the empty name.
+        // Lookups share the lock, interning a new name takes it alone.
+        struct Table {
+            std::deque<std::string> names = {""};
+            std::unordered_map<std::string, uint32_t> ids = {{"", 0}};
+            std::shared_mutex lock;
+        };
+
+        Table& table() {
+            static Table res;
+            return res;
+        }
+    }
+
+    uint32_t Symbol::intern(const std::string& name) {
+        auto& t = table();
+        {
+            std::shared_lock<std::shared_mutex> read(t.lock);
+            auto it = t.ids.find(name);
+            if (it != t.ids.end()) return it->second;
+        }
+        std::unique_lock<std::shared_mutex> write(t.lock);
+        // another thread may have interned it in between
+        auto id = static_cast<uint32_t>(t.names.size());
+        auto [it, fresh] = t.ids.emplace(name, id);
+        if (fresh) t.names.push_back(name);
+        return it->second;
+    }
+
+    const std::string& Symbol::name() const {
+        auto& t = table();
+        std::shared_lock<std::shared_mutex> read(t.lock);
+        return t.names[id];
+    }
+
+    size_t Symbol::count() {
+        auto& t = table();
+        std::shared_lock<std::shared_mutex> read(t.lock);
+        return t.names.size();
+    }
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+#include <iostream>
+#include <functional>
+#include <algorithm>
+#include <unordered_map>
+
+namespace Symbols {
+    // Interned name: equality, ordering and hashing only look at the 32-bit
+    // id; the text is kept in a global table for printing and code generation.
+    struct Symbol {
+        uint32_t id = 0;
+
+        Symbol() = default;
+        Symbol(const std::string& name): id{intern(name)} {}
+        Symbol(const char* name): id{intern(name)} {}
+
+        const std::string& name() const;
+        operator const std::string&() const { return name(); }
+        bool empty() const { return id == 0; }
+
+        // the table of names is shared by all threads
+        static uint32_t intern(const std::string&);
+        // number of symbols interned so far, an upper bound on all ids
+        static size_t count();
+    };
+
+    inline bool operator==(const Symbol& a, const Symbol& b) { return a.id == b.id; }
+    inline bool operator!=(const Symbol& a, const Symbol& b) { return a.id != b.id; }
+    inline bool operator<(const Symbol& a, const Symbol& b) { return a.id < b.id; }
+
+    // comparing with text does not intern it
+    inline bool operator==(const Symbol& a, const char* b) { return a.name() == b; }
+    inline bool operator!=(const Symbol& a, const char* b) { return a.name() != b; }
+    inline bool operator==(const Symbol& a, const std::string& b) { return a.name() == b; }
+    inline bool operator!=(const Symbol& a, const std::string& b) { return a.name() != b; }
+
+    inline std::string operator+(const std::string& a, const Symbol& b) { return a + b.name(); }
+    inline std::string operator+(const char* a, const Symbol& b) { return a + b.name(); }
+    inline std::string operator+(const Symbol& a, const std::string& b) { return a.name() + b; }
+    inline std::string operator+(const Symbol& a, const char* b) { return a.name() + b; }
+
+    inline std::ostream& operator<<(std::ostream& os, const Symbol& s) { return os << s.name(); }
+
+    // Map keyed by symbols. Few keys spread over many ids go in a hash map;
+    // once they cover at least half of their range of ids, in an array over
+    // that range. Neither depends on the number of symbols interned overall.
+    template<typename T>
+    class Map {
+    public:
+        bool contains(const Symbol& s) const {
+            if (!dense) return sparse.count(s.id) > 0;
+            return (s.id >= lo) && (s.id - lo < known.size()) && known[s.id - lo];
+        }
+        size_t count(const Symbol& s) const { return contains(s) ? 1 : 0; }
+        size_t size() const { return n; }
+        bool empty() const { return n == 0; }
+
+        T& operator[](const Symbol& s) {
+            if (contains(s)) return dense ? values[s.id - lo] : sparse[s.id];
+            first = n ? std::min(first, s.id) : s.id;
+            last = n ? std::max(last, s.id) : s.id;
+            n++;
+            auto span = static_cast<size_t>(last - first) + 1;
+            if (dense && (4*n < span)) to_sparse();
+            if (!dense && (n >= min_dense) && (2*n >= span)) to_dense();
+            if (!dense) return sparse[s.id];
+            if (s.id < lo) {
+                // leave as much room below as the array covers
+                auto room = static_cast<uint32_t>(std::min<size_t>(lo, values.size()));
+                shift(std::min(s.id, lo - room));
+            }
+            if (s.id - lo >= values.size()) {
+                values.resize(s.id - lo + 1);
+                known.resize(s.id - lo + 1, false);
+            }
+            known[s.id - lo] = true;
+            return values[s.id - lo];
+        }
+
+        const T& at(const Symbol& s) const {
+            if (!contains(s)) throw std::out_of_range("Unknown symbol: " + s.name());
+            return dense ? values[s.id - lo] : sparse.at(s.id);
+        }
+
+    private:
+        static constexpr size_t min_dense = 16;
+        bool dense = false;
+        std::unordered_map<uint32_t, T> sparse;
+        // dense: values of ids lo, lo + 1, ...
+        uint32_t lo = 0;
+        std::vector<T> values;
+        std::vector<bool> known;
+        // smallest and largest key
+        uint32_t first = 0, last = 0;
+        size_t n = 0;
+
+        void to_dense() {
+            lo = first;
+            values.resize(static_cast<size_t>(last - first) + 1);
+            known.assign(values.size(), false);
+            for (auto& [id, value]: sparse) {
+                values[id - lo] = std::move(value);
+                known[id - lo] = true;
+            }
+            sparse.clear();
+            dense = true;
+        }
+        void to_sparse() {
+            for (size_t ix = 0; ix < values.size(); ++ix) {
+                if (known[ix]) sparse.emplace(static_cast<uint32_t>(lo + ix), std::move(values[ix]));
+            }
+            values.clear();
+            known.clear();
+            dense = false;
+        }
+        // move the start of the array down to id `to`
+        void shift(uint32_t to) {
+            auto by = lo - to;
+            values.insert(values.begin(), by, T{});
+            known.insert(known.begin(), by, false);
+            lo = to;
+        }
+    };
+
+    // Set of symbols
+    class Set {
+    public:
+        bool contains(const Symbol& s) const { return keys.contains(s); }
+        size_t count(const Symbol& s) const { return keys.count(s); }
+        size_t size() const { return keys.size(); }
+        bool empty() const { return keys.empty(); }
+
+        void insert(const Symbol& s) { keys[s] = true; }
+
+    private:
+        Map<char> keys;
+    };
+}
+
+template<> struct std::hash<Symbols::Symbol> {
+    size_t operator()(const Symbols::Symbol& s) const { return s.id; }
+};
@@ -0,0 +1,67 @@
+#include "Tables.hpp"
+
+namespace TailCPS {
+    namespace {
+        // all bindings reachable from `start` through primitive arguments,
+        // not looking further than `stop`
+        std::unordered_set<variable> closure(const FindTables& find, const std::vector<variable>& start, const std::unordered_set<variable>& stop={}) {
+            std::unordered_set<variable> res(start.begin(), start.end());
+            auto todo = start;
+            while (!todo.empty()) {
+                auto var = todo.back();
+                todo.pop_back();
+                const auto& binding = *find.bindings.at(var);
+                if (!std::holds_alternative<LetP>(binding)) continue;
+                for (const auto& arg: std::get<LetP>(binding).args) {
+                    if (find.bindings.count(arg) && !res.count(arg)) {
+                        res.insert(arg);
+                        if (!stop.count(arg)) todo.push_back(arg);
+                    }
+                }
+            }
+            return res;
+        }
+    }
+
+    Tabulation find_tables(const LetF& kernel, const TableOptions& options) {
+        auto res = Tabulation{};
+        if (!options.enabled || (options.arg >= kernel.args.size())) return res;
+        auto find = FindTables(kernel.args[options.arg], static_cast<int>(options.field));
+        Traverse::walk(find, kernel.body);
+        if (find.axis.empty()) return res;
+        res.axis = find.axis;
+
+        auto in_order = [&](const auto& a, const auto& b) { return find.order.at(a) < find.order.at(b); };
+
+        // escaping values are either tabulated, or computed as usual along
+        // with everything they depend on
+        std::vector<variable> cheap;
+        for (const auto& var: find.escaping) {
+            if (find.expensive.count(var)) {
+                res.roots.push_back(var);
+            } else {
+                cheap.push_back(var);
+            }
+        }
+        std::sort(res.roots.begin(), res.roots.end(), in_order);
+        auto computed = closure(find, cheap);
+        for (const auto& binding: find.bindings) {
+            const auto& var = binding.first;
+            if (!computed.count(var) && !find.escaping.count(var)) res.hidden.insert(var);
+        }
+
+        std::unordered_set<variable> available(res.roots.begin(), res.roots.end());
+        available.insert(computed.begin(), computed.end());
+        for (const auto& root: res.roots) {
+            auto seen = closure(find, {root});
+            std::vector<variable> cone(seen.begin(), seen.end());
+            std::sort(cone.begin(), cone.end(), in_order);
+            auto needed = closure(find, {root}, available);
+            for (const auto& var: cone) {
+                res.cones[root].push_back(find.bindings.at(var));
+                if (res.hidden.count(var) && needed.count(var)) res.fallbacks[root].push_back(find.bindings.at(var));
+            }
+        }
+        return res;
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "TailCPS.hpp"
+
+namespace TailCPS {
+    struct TableOptions {
+        // tabulate subterms depending only on field `field` of argument `arg`,
+        // by default the voltage, ie pi-0 of the first argument
+        bool enabled = false;
+        size_t arg = 0;
+        size_t field = 0;
+        enum class Interpolation { Linear, Cubic };
+        Interpolation interpolation = Interpolation::Linear;
+    };
+
+    // Subterms of a kernel body which depend only on the table axis and call
+    // math functions
+    struct Tabulation {
+        variable axis = "";
+        // values to tabulate, in program order
+        std::vector<variable> roots;
+        // per root: the bindings needed to compute it, excluding the axis, in
+        // program order; these are copies, `in` is not to be followed
+        std::unordered_map<variable, std::vector<term>> cones;
+        // bindings only used to compute roots, these are evaluated only when
+        // the table cannot be used
+        std::unordered_set<variable> hidden;
+        // per root: the hidden bindings needed to compute it, in program order
+        std::unordered_map<variable, std::vector<term>> fallbacks;
+
+        bool empty() const { return roots.empty(); }
+    };
+
+    struct FindTables {
+        variable tuple;
+        int field;
+        variable axis = "";
+        // bindings depending only on the axis, and their position
+        std::unordered_map<variable, term> bindings;
+        std::unordered_map<variable, size_t> order;
+        // ... those calling math functions, directly or not
+        std::unordered_set<variable> expensive;
+        // ... those used by anything else
+        std::unordered_set<variable> escaping;
+
+        FindTables(const variable& t, int f): tuple{t}, field{f} {}
+
+        bool axis_only(const variable& v) { return (v == axis) || bindings.count(v); }
+        void escape(const variable& v) { if (bindings.count(v)) escaping.insert(v); }
+
+        void operator()(const LetV& e) {
+            if (std::holds_alternative<F64>(*e.val)) {
+                order[e.name] = order.size();
+                bindings[e.name] = Memory::make_node<Term>(e);
+            } else if (std::holds_alternative<Tuple>(*e.val)) {
+                for (const auto& field: std::get<Tuple>(*e.val).fields) escape(field);
+            }
+        }
+        void operator()(const LetC&) {}
+        void operator()(const LetT& e) {
+            if ((e.tuple == tuple) && (e.field == field)) axis = e.name;
+            escape(e.tuple);
+        }
+        void operator()(const LetF&) {}
+        void operator()(const LetP& e) {
+            // tables hold F64 values of a smooth function of the axis
+            auto smooth = !comparison(e.name) && (e.name != "select");
+            auto pure = smooth && std::all_of(e.args.begin(), e.args.end(), [&](const auto& arg) { return axis_only(arg); });
+            if (pure) {
+                order[e.var] = order.size();
+                bindings[e.var] = Memory::make_node<Term>(e);
+                auto math = (e.name == "exp") || (e.name == "log") || (e.name == "expm1") || (e.name == "exprelr");
+                for (const auto& arg: e.args) math = math || expensive.count(arg);
+                if (math) expensive.insert(e.var);
+            } else {
+                for (const auto& arg: e.args) escape(arg);
+            }
+        }
+        void operator()(const AppC& e) { for (const auto& arg: e.args) escape(arg); }
+        void operator()(const AppF& e) { for (const auto& arg: e.args) escape(arg); }
+        void operator()(const If&) {}
+        void operator()(const Halt& e) { escape(e.name); }
+    };
+
+    Tabulation find_tables(const LetF& kernel, const TableOptions& options);
+}
@@ -1,203 +1,447 @@
+#include <atomic>
+
 #include "TailCPS.hpp"
 
 namespace TailCPS {
     namespace convenience {
-        template<typename E, typename... Ts> term make_term(const Ts&... args) { return std::make_shared<Term>(E(args...)); }
-        term let(const std::string& n, const value& v, const term& i) { return make_term<LetV>(n, v, i); }
-        term pi(int f, const std::string& n, const std::string& t, const term& i) { return make_term<LetT>(f, n, t, i); }
-        term let_cont(const std::string& n, const std::vector<variable>& as, const term& b, const term& i) { return make_term<LetC>(n, as, b, i); }
-        term let_func(const std::string& n, const std::string& c, const std::vector<variable>& as, const term& b, const term& i, const Types::type& t) { return make_term<LetF>(n, c, as, b, i, t); }
-        term let_prim(const std::string& n, const std::string& c, const std::vector<std::string>& a, const term& i, const Types::type& t) { return make_term<LetP>(n, c, a, i, t); }
-        term app_cont(const std::string& n, const std::string& a) { return make_term<AppC>(n, a); }
-        term app_func(const std::string& n, const std::string& c, const std::vector<std::string>& a) { return make_term<AppF>(n, c, a); }
+        template<typename E, typename... Ts> term make_term(const Ts&... args) { return Memory::make_node<Term>(E(args...)); }
+        term let(const variable& n, const value& v, const term& i) { return make_term<LetV>(n, v, i); }
+        term pi(int f, const variable& n, const variable& t, const term& i, const Types::type& ty) { return make_term<LetT>(f, n, t, i, ty); }
+        term let_cont(const variable& n, const std::vector<variable>& as, const term& b, const term& i, const Types::type& t) { return make_term<LetC>(n, as, b, i, t); }
+        term let_func(const variable& n, const variable& c, const std::vector<variable>& as, const term& b, const term& i, const Types::type& t) { return make_term<LetF>(n, c, as, b, i, t); }
+        term let_prim(const variable& n, const variable& c, const std::vector<variable>& a, const term& i, const Types::type& t) { return make_term<LetP>(n, c, a, i, t); }
+        term app_cont(const variable& n, const std::vector<variable>& as) { return make_term<AppC>(n, as); }
+        term app_func(const variable& n, const variable& c, const std::vector<variable>& a) { return make_term<AppF>(n, c, a); }
+        term branch(const variable& c, const term& t, const term& o) { return make_term<If>(c, t, o); }
         term halt(const variable& v) { return make_term<Halt>(v); }
 
-        template<typename E, typename... Ts> value make_value(const Ts&... args) { return std::make_shared<Value>(E(args...)); }
+        template<typename E, typename... Ts> value make_value(const Ts&... args) { return Memory::make_node<Value>(E(args...)); }
         value f64(double v) { return make_value<F64>(v); }
         value boolean(bool v) { return make_value<Bool>(v); }
         value tuple(const std::vector<variable>& fs, const Types::type& t) { return make_value<Tuple>(fs, t); }
     }
 
-    std::string ToCPS::genvar() {
+    variable ToCPS::genvar() {
         return "__var_" + std::to_string(counter++);
     }
 
-    std::string ToCPSHelper::genvar() { return parent.genvar(); }
+    term ToCPS::plug(const Frames& frames, term t) {
+        for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+            t = std::visit([&](auto frame) {
+                using E = std::decay_t<decltype(frame)>;
+                if constexpr (std::is_same_v<E, LetC>) {
+                    frame.body = t;
+                } else if constexpr (std::is_same_v<E, LetV> || std::is_same_v<E, LetT> || std::is_same_v<E, LetF> || std::is_same_v<E, LetP>) {
+                    frame.in = t;
+                } else {
+                    throw std::runtime_error("Not a binding");
+                }
+                return make_term<E>(frame);
+            }, *it);
+        }
+        return t;
+    }
+
+    std::shared_ptr<ToCPS::Frames> ToCPS::join(const std::vector<std::shared_ptr<Frames>>& frames) {
+        std::shared_ptr<Frames> res = nullptr;
+        for (const auto& next: frames) {
+            if (!res) {
+                res = next;
+            } else if (res->size() >= next->size()) {
+                res->insert(res->end(), std::make_move_iterator(next->begin()), std::make_move_iterator(next->end()));
+            } else {
+                next->insert(next->begin(), std::make_move_iterator(res->begin()), std::make_move_iterator(res->end()));
+                res = next;
+            }
+        }
+        return res ? res : std::make_shared<Frames>();
+    }
+
+    ToCPS::Next ToCPS::into(const AST::expr& e, const variable& k) {
+        contexts.push_back({k, {}});
+        return descend(e);
+    }
+
+    ToCPS::Converted ToCPS::value(std::shared_ptr<Frames> frames, const variable& atom) {
+        auto k = contexts.back().k;
+        contexts.pop_back();
+        if (!frames) frames = std::make_shared<Frames>();
+        if (k.empty()) return {frames, atom, nullptr};
+        return {nullptr, {}, plug(*frames, app_cont(k, {atom}))};
+    }
+
+    ToCPS::Converted ToCPS::whole(const term& t) {
+        contexts.pop_back();
+        return {nullptr, {}, t};
+    }
+
+    namespace {
+        std::vector<std::shared_ptr<ToCPS::Frames>> frames_of(const Results<ToCPS::Converted>& done) {
+            std::vector<std::shared_ptr<ToCPS::Frames>> res;
+            for (const auto& d: done) res.push_back(d.frames);
+            return res;
+        }
+
+        std::vector<variable> atoms_of(const Results<ToCPS::Converted>& done, size_t first=0) {
+            std::vector<variable> res;
+            for (auto ix = first; ix < done.size(); ++ix) res.push_back(done[ix].atom);
+            return res;
+        }
+    }
 
-    void ToCPSHelper::operator()(const AST::Var& e) {
-        result = app_cont(ctx, e.name);
+    ToCPS::Next ToCPS::operator()(const AST::Var& e, const Results<Converted>&) {
+        return value(nullptr, e.name);
     }
-    void ToCPSHelper::operator()(const AST::F64& e) {
+    ToCPS::Next ToCPS::operator()(const AST::F64& e, const Results<Converted>&) {
         auto x = genvar();
-        result = let(x, f64(e.val), app_cont(ctx, x));
+        auto frames = std::make_shared<Frames>();
+        frames->push_back(LetV(x, f64(e.val), nullptr));
+        return value(frames, x);
     }
-    void ToCPSHelper::operator()(const AST::Bool& e) {
+    ToCPS::Next ToCPS::operator()(const AST::Bool& e, const Results<Converted>&) {
         auto x = genvar();
-        result = let(x, boolean(e.val), app_cont(ctx, x));
+        auto frames = std::make_shared<Frames>();
+        frames->push_back(LetV(x, boolean(e.val), nullptr));
+        return value(frames, x);
+    }
+    ToCPS::Next ToCPS::operator()(const AST::Prim& e, const Results<Converted>& done) {
+        if (done.size() < e.args.size()) return into(e.args[done.size()]);
+        auto frames = join(frames_of(done));
+        auto n = genvar();
+        frames->push_back(LetP(e.op, n, atoms_of(done), nullptr, e.type));
+        return value(frames, n);
     }
-    void ToCPSHelper::operator()(const AST::Proj& e) {
-        auto kappa = parent.ctx;
+    ToCPS::Next ToCPS::operator()(const AST::Tuple& e, const Results<Converted>& done) {
+        if (done.size() < e.fields.size()) return into(e.fields[done.size()]);
+        auto frames = join(frames_of(done));
         auto x = genvar();
-        auto k = ctx;
-        parent.ctx = [&](const auto& z){
-            parent.result = pi(e.field, x, z, app_cont(k, x));
-            return parent.result;
-        };
-        std::visit(parent, *e.tuple);
-        result = parent.result;
-        parent.ctx = kappa;
-    }
-    // NB. this is different (WRONG!) in Kennedy'07
-    void ToCPSHelper::operator()(const AST::Lam& e) {
-        // recurse into body
-        auto tmp = ctx;
-        auto j = genvar();
-        ctx = j;
-        std::visit(*this, *e.body);
-        auto body = result;
-        ctx = tmp;
-        // generate result
-        auto f = genvar();
-        result = let_func(f, j, e.args, body, app_cont(ctx, f), e.type);
-    }
-    void ToCPSHelper::app_helper(const std::vector<AST::expr>& args, size_t ix, const variable& zs, std::vector<variable>& ys, const variable& f, const variable& kappa) {
-        auto tmp = parent.ctx;
-        parent.ctx = [&](auto y) {
-            ys.push_back(y);
-            if (ix + 1 == args.size()) {
-                parent.result = app_func(f, kappa, ys);
-                result = parent.result;
-            } else {
-                app_helper(args, ix + 1, zs, ys, f, kappa);
-            }
-            return parent.result;
-        };
-        std::visit(parent, *args[ix]);
-        parent.ctx = tmp;
+        frames->push_back(LetV(x, tuple(atoms_of(done), e.type), nullptr));
+        return value(frames, x);
     }
-    void ToCPSHelper::operator()(const AST::App& e) {
-        auto kappa = parent.ctx;
+    ToCPS::Next ToCPS::operator()(const AST::Proj& e, const Results<Converted>& done) {
+        if (done.empty()) return into(e.tuple);
+        auto frames = done[0].frames;
+        auto x = genvar();
+        frames->push_back(LetT(e.field, x, done[0].atom, nullptr, e.type));
+        return value(frames, x);
+    }
+    // In tail position, the function returns to k directly, otherwise to
+    // a fresh continuation holding the rest of the program
+    ToCPS::Next ToCPS::operator()(const AST::App& e, const Results<Converted>& done) {
+        if (done.empty()) return into(e.fun);
+        if (done.size() <= e.args.size()) return into(e.args[done.size() - 1]);
+        auto frames = join(frames_of(done));
+        auto f = done[0].atom;
+        auto ys = atoms_of(done, 1);
+        if (auto k = contexts.back().k; !k.empty()) return whole(plug(*frames, app_func(f, k, ys)));
+        auto k = genvar();
         auto zs = genvar();
+        frames->push_back(LetC(k, {zs}, nullptr, app_func(f, k, ys)));
+        return value(frames, zs);
+    }
+    ToCPS::Next ToCPS::operator()(const AST::Lam& e, const Results<Converted>& done) {
+        if (done.empty()) {
+            auto k = genvar();
+            contexts.back().j = k;
+            return into(e.body, k);
+        }
         auto f = genvar();
-        std::vector<variable> ys{};
-        auto tmp = parent.ctx;
-        parent.ctx = [&](auto y) {
-            app_helper(e.args, 0, zs, ys, y, ctx);
-            return parent.result;
-        };
-        std::visit(parent, *e.fun);
-        result = parent.result;
-        parent.ctx = kappa;
-    }
-
-    void ToCPSHelper::prim_helper(const std::vector<AST::expr>& args, size_t ix, std::vector<variable>& ys, const variable& op, const variable& kappa, const Types::type& t) {
-        auto tmp = parent.ctx;
-        parent.ctx = [&](auto y) {
-            ys.push_back(y);
-            if (ix + 1 == args.size()) {
-                auto n = genvar();
-                parent.result = let_prim(op, n, ys, app_cont(kappa, n), t);
-                result = parent.result;
-            } else {
-                prim_helper(args, ix + 1, ys, op, kappa, t);
-            }
-            return parent.result;
-        };
-        std::visit(parent, *args[ix]);
-        result = parent.result;
-        parent.ctx = tmp;
-    }
-    void ToCPSHelper::operator()(const AST::Prim& e) {
-        auto kappa = parent.ctx;
-        std::vector<variable> ys = {};
-        prim_helper(e.args, 0, ys, e.op, ctx, e.type);
-        parent.ctx = kappa;
-    }
-
-    void ToCPSHelper::tuple_helper(const std::vector<AST::expr>& fields, size_t ix, const variable& x, std::vector<variable>& xs, const variable& kappa, const Types::type& t) {
-        auto tmp = parent.ctx;
-        parent.ctx = [&](auto z1) {
-            xs.push_back(z1);
-            if (ix + 1 == fields.size()) {
-                parent.result = let(x, tuple(xs, t), app_cont(kappa, x));
-            } else {
-                tuple_helper(fields, ix + 1, x, xs, kappa, t);
-            }
-            return parent.result;
-        };
-        std::visit(parent, *fields[ix]);
-        result = parent.result;
-        parent.ctx = tmp;
-    }
-    void ToCPSHelper::operator()(const AST::Tuple& e) {
-        auto kappa = ctx;
-        auto x = genvar();
-        std::vector<variable> xs{};
-        tuple_helper(e.fields, 0, x, xs, kappa, e.type);
+        auto frames = std::make_shared<Frames>();
+        frames->push_back(LetF(f, contexts.back().j, e.args, done[0].whole, nullptr, e.type));
+        return value(frames, f);
     }
-    void ToCPSHelper::operator()(const AST::Let& e) {
-        std::visit(*this, *e.body);
-        auto body = result;
-        auto x = e.var;
-        auto j = genvar();
-        ctx = j;
-        std::visit(*this, *e.val);
-        auto in = result;
-        result = let_cont(j, {x}, body, in);
+    // The value returns to continuation j binding the variable, whose body
+    // is the rest of the let; long chains only grow the explicit stack
+    ToCPS::Next ToCPS::operator()(const AST::Let& e, const Results<Converted>& done) {
+        switch (done.size()) {
+        case 0: {
+            auto j = genvar();
+            contexts.back().j = j;
+            return into(e.val, j);
+        }
+        case 1:
+            return into(e.body, contexts.back().k);
+        }
+        auto frames = std::make_shared<Frames>();
+        frames->push_back(LetC(contexts.back().j, {e.var}, nullptr, done[0].whole, cont_t(AST::get_type(e.val), e.type)));
+        if (!contexts.back().k.empty()) return whole(plug(*frames, done[1].whole));
+        return value(join({frames, done[1].frames}), done[1].atom);
+    }
+    // Both arms return to the continuation of the conditional in tail
+    // position, otherwise to the join continuation j, which goes on with the
+    // value of the conditional
+    ToCPS::Next ToCPS::operator()(const AST::Cond& e, const Results<Converted>& done) {
+        switch (done.size()) {
+        case 0:
+            return into(e.pred);
+        case 1: {
+            auto j = contexts.back().k.empty() ? genvar() : contexts.back().k;
+            contexts.back().j = j;
+            return into(e.on_t, j);
+        }
+        case 2:
+            return into(e.on_f, contexts.back().j);
+        }
+        auto test = plug(*done[0].frames, branch(done[0].atom, done[1].whole, done[2].whole));
+        if (!contexts.back().k.empty()) return whole(test);
+        auto x = genvar();
+        auto frames = std::make_shared<Frames>();
+        frames->push_back(LetC(contexts.back().j, {x}, nullptr, test, cont_t(e.type, e.type)));
+        return value(frames, x);
     }
 
     term ast_to_cps(const AST::expr& e) {
         auto to_cps = ToCPS();
-        std::visit(to_cps, *e);
-        return to_cps.result;
+        to_cps.contexts.push_back({});
+        auto res = Traverse::run<ToCPS::Converted>(to_cps, e);
+        return ToCPS::plug(*res.frames, halt(res.atom));
     }
 
     void cps_to_sexp(std::ostream& os, const term& t) {
         ToSExp to_sexp(os);
-        std::visit(to_sexp, *t);
+        Traverse::run<Unit>(to_sexp, t);
     }
 
-    term substitute(const term& t, const std::unordered_map<variable, variable>& mapping) {
+    term substitute(const term& t, const Symbols::Map<variable>& mapping) {
         auto subst = Substitute(mapping);
-        return  std::visit(subst, *t);
+        return Traverse::run<term>(subst, t);
     }
 
-    std::unordered_set<variable> used_symbols(const term& t) {
+    Symbols::Set used_symbols(const term& t) {
         auto used = UsedSymbols();
-        std::visit(used, *t);
+        Traverse::walk(used, t);
         return used.symbols;
     }
 
-    term dead_let(const term& t) {
-        auto tmp = t;
-        for (;;) {
-            auto live = used_symbols(tmp);
-            auto dead = DeadLet(live);
-            tmp = std::visit(dead, *tmp);
-            if (dead.count == 0) return tmp;
-        }
+    std::vector<variable> free_variables(const variables& args, const term& body) {
+        auto free = FreeVariables();
+        for (const auto& arg: args) free.bind(arg);
+        Traverse::walk(free, body);
+        return free.free;
+    }
+
+    Symbols::Map<size_t> census(const term& t, const Symbols::Map<variable>* rename) {
+        auto census = Census();
+        census.rename = rename;
+        Traverse::walk(census, t);
+        return census.count;
+    }
+
+    term dead_let(const term& t, const Symbols::Map<variable>* rename) {
+        auto dead = DeadLet(census(t, rename), rename);
+        return Traverse::run<term>(dead, t);
+    }
+
+    variable Copy::fresh(const variable& v) {
+        static std::atomic<size_t> counter{0};
+        return v.name() + "_in" + std::to_string(counter++);
+    }
+
+    term copy(const term& t, const Symbols::Map<variable>& mapping, const Symbols::Map<variable>* rename) {
+        auto copy = Copy(mapping, rename);
+        return Traverse::run<term>(copy, t);
+    }
+
+    size_t size(const term& t) {
+        auto size = Size();
+        Traverse::walk(size, t);
+        return size.total;
+    }
+
+    term inline_calls(const term& t, const InlineOptions& options) {
+        auto inliner = Inline(census(t), size(t), options);
+        auto res = Traverse::run<term>(inliner, t);
+        return inliner.count ? dead_let(res, &inliner.rename) : res;
     }
 
     term beta_func(const term& t) {
-        return dead_let(std::visit(BetaFunc{}, *t));
+        auto options = InlineOptions{};
+        options.continuations = false;
+        return inline_calls(t, options);
     }
 
     term beta_cont(const term& t) {
-        return dead_let(std::visit(BetaCont{}, *t));
+        auto options = InlineOptions{};
+        options.functions = false;
+        return inline_calls(t, options);
+    }
+
+    Symbols::Map<variable> returns(const term& t) {
+        auto calls = Returns();
+        Traverse::walk(calls, t);
+        auto uses = census(t);
+        auto res = Symbols::Map<variable>{};
+        for (const auto& f: calls.callees) {
+            // also used as a value
+            if (calls.mixed.contains(f) || (uses[f] != calls.calls.at(f))) continue;
+            res[f] = calls.cont.at(f);
+        }
+        return res;
+    }
+
+    term contify(const term& t) {
+        auto contify = Contify(returns(t));
+        return Traverse::run<term>(contify, t);
+    }
+
+    variable Unbox::fresh(const variable& v) {
+        static std::atomic<size_t> counter{0};
+        return v.name() + "_un" + std::to_string(counter++);
+    }
+
+    term unbox_tuples(const term& t) {
+        auto res = t;
+        for (;;) {
+            auto args = TupleArgs();
+            Traverse::walk(args, res);
+            auto unbox = Unbox(args.tuples, args.split);
+            res = Traverse::run<term>(unbox, res);
+            if (!unbox.count) return res;
+        }
     }
 
     term prim_cse(const term& t) {
         auto cse = PrimCSE();
-        std::visit(cse, *t);
-        auto tmp = substitute(t, cse.replace);
-        return dead_let(tmp);
+        return Traverse::run<term>(cse, t);
+    }
+
+    term lambda_lift(const term& t) {
+        auto lift = LambdaLift();
+        auto res = Traverse::run<term>(lift, t);
+        for (auto it = lift.lifted.rbegin(); it != lift.lifted.rend(); ++it) {
+            auto tmp = *it;
+            tmp.in = res;
+            res = Memory::make_node<Term>(tmp);
+        }
+        return res;
+    }
+
+    variable IfConvert::fresh(const variable& v) {
+        static std::atomic<size_t> counter{0};
+        return v.name() + "_sel" + std::to_string(counter++);
+    }
+
+    term if_convert(const term& t, size_t limit) {
+        auto convert = IfConvert(census(t), limit);
+        auto res = Traverse::run<term>(convert, t);
+        return convert.count ? dead_let(res) : res;
     }
 
-    void generate_cxx(std::ostream& os, const term& t) {
-        auto gen = GenCXX();
-        std::visit(gen, *t);
-        for(const auto& line: gen.code) {
-            os << line << '\n';
+    Types::type prim_type(const variable& op, const std::vector<Types::type>& args) {
+        auto kind = Types::Kind::Unique;
+        for (const auto& arg: args) kind = Types::join(kind, Types::kind_of(arg));
+        if (comparison(op)) return Types::bool_t(kind);
+        if ((op == "select") && (args.size() == 3)) {
+            auto arm = Types::resolve(args[1]);
+            if (arm && std::holds_alternative<Types::TyBool>(*arm)) return Types::bool_t(kind);
         }
+        return Types::f64_t(kind);
+    }
+
+    term infer_types(const term& t) {
+        auto infer = TypeInfer();
+        do {
+            infer.changed = false;
+            Traverse::run<Unit>(infer, t);
+        } while (infer.changed);
+        auto annotate = TypeAnnotate(infer.types);
+        return Traverse::run<term>(annotate, t);
+    }
+
+    bool TypeCheck::ground(const Types::type& t) {
+        auto ty = Types::resolve(t);
+        if (!ty) return false;
+        return std::visit([](const auto& e) {
+            using T = std::decay_t<decltype(e)>;
+            if constexpr (std::is_same_v<T, Types::TyVar>) {
+                return false;
+            } else if constexpr (std::is_same_v<T, Types::TyTuple>) {
+                return std::all_of(e.field_types.begin(), e.field_types.end(), ground);
+            } else if constexpr (std::is_same_v<T, Types::TyFunc>) {
+                return std::all_of(e.args.begin(), e.args.end(), ground) && ground(e.result);
+            } else {
+                return true;
+            }
+        }, *ty);
+    }
+
+    bool TypeCheck::compatible(const Types::type& lhs, const Types::type& rhs) {
+        auto l = Types::resolve(lhs);
+        auto r = Types::resolve(rhs);
+        if (!l || !r || (l->index() != r->index())) return false;
+        if (const auto& lt = std::get_if<Types::TyTuple>(l.get())) {
+            const auto& rt = std::get<Types::TyTuple>(*r);
+            if (lt->field_types.size() != rt.field_types.size()) return false;
+            for (auto ix = 0ul; ix < lt->field_types.size(); ++ix) {
+                if (!compatible(lt->field_types[ix], rt.field_types[ix])) return false;
+            }
+            return true;
+        }
+        if (const auto& lf = std::get_if<Types::TyFunc>(l.get())) {
+            const auto& rf = std::get<Types::TyFunc>(*r);
+            if (lf->args.size() != rf.args.size()) return false;
+            for (auto ix = 0ul; ix < lf->args.size(); ++ix) {
+                if (!compatible(lf->args[ix], rf.args[ix])) return false;
+            }
+            // continuations of the top level have no result
+            return (!lf->result && !rf.result) || compatible(lf->result, rf.result);
+        }
+        return !std::holds_alternative<Types::TyVar>(*l);
+    }
+
+    void TypeCheck::operator()(const LetV& e) {
+        auto val = std::visit([](const auto& v) { return v.type; }, *e.val);
+        if (const auto& tuple = std::get_if<Tuple>(e.val.get())) {
+            auto ty = Types::resolve(val);
+            if (!ty || !std::holds_alternative<Types::TyTuple>(*ty)) throw Types::TypeError("No tuple type for "s + e.name + ": " + Types::show_type(val));
+            arguments(e.name, tuple->fields, std::get<Types::TyTuple>(*ty).field_types);
+        }
+        if (!compatible(e.type, val)) throw Types::TypeError("Type mismatch at "s + e.name + ": " + Types::show_type(e.type) + " bound to " + Types::show_type(val));
+        bind(e.name, e.type);
+    }
+
+    void TypeCheck::operator()(const LetT& e) {
+        auto ty = Types::resolve(type_of(e.tuple));
+        if (!std::holds_alternative<Types::TyTuple>(*ty)) throw Types::TypeError("Projection from a non-tuple: "s + e.tuple + ": " + Types::show_type(ty));
+        const auto& fields = std::get<Types::TyTuple>(*ty).field_types;
+        if ((e.field < 0) || (size_t(e.field) >= fields.size())) throw Types::TypeError("Projection out of range: "s + e.name);
+        bind(e.name, e.type);
+        expect(e.name, fields[e.field], e.name);
+    }
+
+    void TypeCheck::operator()(const LetP& e) {
+        bind(e.var, e.type);
+        auto f64 = Types::f64_t();
+        auto boolean = Types::bool_t();
+        if (comparison(e.name)) {
+            arguments(e.var, e.args, {f64, f64});
+            expect(e.var, boolean, e.var);
+        } else if (e.name == "select") {
+            if (e.args.size() != 3) throw Types::TypeError("Wrong number of arguments: "s + e.var);
+            expect(e.args[0], boolean, e.var);
+            expect(e.args[1], e.type, e.var);
+            expect(e.args[2], e.type, e.var);
+        } else if ((e.name == "+") || (e.name == "-") || (e.name == "*") || (e.name == "/")) {
+            arguments(e.var, e.args, {f64, f64});
+            expect(e.var, f64, e.var);
+        } else if ((e.name == "exp") || (e.name == "log") || (e.name == "expm1") || (e.name == "exprelr")) {
+            arguments(e.var, e.args, {f64});
+            expect(e.var, f64, e.var);
+        } else if ((e.name == "fma") || (e.name == "fms") || (e.name == "fnma")) {
+            arguments(e.var, e.args, {f64, f64, f64});
+            expect(e.var, f64, e.var);
+        } else {
+            throw Types::TypeError("Unknown primitive "s + e.name + ": " + e.var);
+        }
+        if (Types::kind_of(e.type) != Types::Kind::Unique) return;
+        for (const auto& arg: e.args) {
+            if (Types::kind_of(type_of(arg)) != Types::Kind::Unique) throw Types::TypeError("Unique result of varying operands: "s + e.var);
+        }
+    }
+
+    Symbols::Map<Types::type> check_types(const term& t) {
+        auto check = TypeCheck();
+        Traverse::walk(check, t);
+        return check.types;
     }
 }
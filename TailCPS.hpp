@@ -2,6 +2,7 @@
 
 #include <functional>
 #include <vector>
+#include <deque>
 #include <string>
 #include <memory>
 #include <iostream>
@@ -11,8 +12,11 @@
 #include <unordered_set>
 #include <exception>
 #include <variant>
+#include <optional>
+#include <cstring>
 
 #include "AST.hpp"
+#include "Traverse.hpp"
 
 using namespace std::string_literals;
 
@@ -25,13 +29,15 @@ namespace TailCPS {
     struct Halt;
     struct AppC;
     struct AppF;
+    struct If;
 
     struct Tuple;
     struct F64;
     struct Bool;
 
     // Variables
-    using variable = std::string;
+    using variable = Symbols::Symbol;
+    using variables = Memory::SmallVector<variable, 4>;
     using Value    = std::variant<Tuple,
                                   F64,
                                   Bool>;
@@ -43,34 +49,35 @@ namespace TailCPS {
                                   LetP,
                                   AppF,
                                   AppC,
+                                  If,
                                   Halt>;
     using term     = std::shared_ptr<Term>;
 
     struct Tuple: Types::Typed {
-        std::vector<variable> fields;
-        Tuple(const std::vector<std::string>& fs, const Types::type& t=nullptr): Typed{t}, fields{fs} {}
+        variables fields;
+        Tuple(const variables& fs, const Types::type& t=nullptr): Typed{t}, fields{fs} {}
     };
 
     struct F64: Types::Typed {
         double value;
-        F64(double v): Typed{Types::f64_t()}, value{v} { }
+        F64(double v): Typed{Types::f64_t(Types::Kind::Unique)}, value{v} { }
     };
 
     struct Bool: Types::Typed {
         bool value;
-        Bool(bool v): Typed{Types::bool_t()}, value{v} { }
+        Bool(bool v): Typed{Types::bool_t(Types::Kind::Unique)}, value{v} { }
     };
 
     struct Halt {
         variable name;
-        Halt(const std::string&n): name{n} {}
+        Halt(const variable&n): name{n} {}
     };
 
     struct LetV: Types::Typed {
         variable name;
         term in;
         value val;
-        LetV(const std::string& n, const value& v, const term& i): name{n}, in{i}, val{v} {}
+        LetV(const variable& n, const value& v, const term& i): name{n}, in{i}, val{v} {}
     };
 
     struct LetT: Types::Typed {
@@ -78,16 +85,16 @@ namespace TailCPS {
         term in;
         int field;
         variable tuple;
-        LetT(int f, const std::string& n, const std::string& t, const term& i): name{n}, in{i}, field{f}, tuple{t} {}
+        LetT(int f, const variable& n, const variable& t, const term& i, const Types::type& ty=nullptr): Typed{ty}, name{n}, in{i}, field{f}, tuple{t} {}
     };
 
     struct LetF: Types::Typed {
         variable name;
         term in;
         variable cont;
-        std::vector<variable> args;
+        variables args;
         term body;
-        LetF(const std::string& n, const std::string& c, const std::vector<variable>& as,
+        LetF(const variable& n, const variable& c, const variables& as,
              const term& b, const term& i,
              const Types::type& t=nullptr): Typed{t}, name{n}, in{i}, cont{c}, args{as}, body{b} {}
     };
@@ -95,41 +102,51 @@ namespace TailCPS {
     struct LetC: Types::Typed {
         variable name;
         term in;
-        std::vector<variable> args;
+        variables args;
         term body;
-        LetC(const std::string& n, const std::vector<variable>& as, const term& b, const term& i): name{n}, in{i}, args{as}, body{b} {}
+        LetC(const variable& n, const variables& as, const term& b, const term& i,
+             const Types::type& t=nullptr): Typed{t}, name{n}, in{i}, args{as}, body{b} {}
     };
 
     struct AppC: Types::Typed {
         variable name;
-        variable arg;
-        AppC(const std::string& n, const variable& a): name{n}, arg{a} {}
+        variables args;
+        AppC(const variable& n, const variables& as): name{n}, args{as} {}
+    };
+
+    // Continue with `then` if the Bool `cond` holds, else with `otherwise`
+    struct If {
+        variable cond;
+        term then;
+        term otherwise;
+        If(const variable& c, const term& t, const term& o): cond{c}, then{t}, otherwise{o} {}
     };
 
     struct AppF: Types::Typed {
         variable name;
         variable cont;
-        std::vector<variable> args;
-        AppF(const std::string& f, const std::string& c, const std::vector<variable>& as): name{f}, cont{c}, args{as} {}
+        variables args;
+        AppF(const variable& f, const variable& c, const variables& as): name{f}, cont{c}, args{as} {}
     };
 
     struct LetP: Types::Typed {
         variable name;
         variable var;
-        std::vector<variable> args;
+        variables args;
         term in;
-        LetP(const std::string& f, const std::string& v, const std::vector<variable>& a, const term& i, const Types::type& t=nullptr): Typed{t}, name{f}, var{v}, args{a}, in{i} {}
+        LetP(const variable& f, const variable& v, const variables& a, const term& i, const Types::type& t=nullptr): Typed{t}, name{f}, var{v}, args{a}, in{i} {}
     };
 
     namespace convenience {
         template<typename E, typename... Ts> term make_term(const Ts&... args);
-        term let(const std::string& n, const value& v, const term& i);
-        term pi(int f, const std::string& n, const std::string& t, const term& i);
-        term let_cont(const std::string& n, const std::vector<variable>& as, const term& b, const term& i);
-        term let_func(const std::string& n, const std::string& c, const std::vector<variable>& as, const term& b, const term& i, const Types::type& t=nullptr);
-        term let_prim(const std::string&, const std::string&, const std::vector<std::string>&, const term&, const Types::type& t=nullptr);
-        term app_cont(const std::string& n, const std::string& a);
-        term app_func(const std::string& n, const std::string& c, const std::vector<std::string>& a);
+        term let(const variable& n, const value& v, const term& i);
+        term pi(int f, const variable& n, const variable& t, const term& i, const Types::type& ty=nullptr);
+        term let_cont(const variable& n, const std::vector<variable>& as, const term& b, const term& i, const Types::type& t=nullptr);
+        term let_func(const variable& n, const variable& c, const std::vector<variable>& as, const term& b, const term& i, const Types::type& t=nullptr);
+        term let_prim(const variable&, const variable&, const std::vector<variable>&, const term&, const Types::type& t=nullptr);
+        term app_cont(const variable& n, const std::vector<variable>& as);
+        term branch(const variable& c, const term& t, const term& o);
+        term app_func(const variable& n, const variable& c, const std::vector<variable>& a);
         term halt(const variable& v);
 
         template<typename E, typename... Ts> value make_value(const Ts&... args);
@@ -139,6 +156,93 @@ namespace TailCPS {
     }
 
     using namespace convenience;
+    using AST::comparison;
+
+    // Passes over terms run on Traverse::run, see there
+    using Traverse::Unit;
+    using Traverse::descend;
+    template<typename R> using Step = Traverse::Step<term, R>;
+    template<typename R> using Results = std::vector<R>;
+
+    // Sub-terms of a term in the order passes visit them, nullptr past the last
+    inline term child(const LetV& e, size_t ix) { return (ix == 0) ? e.in : nullptr; }
+    inline term child(const LetT& e, size_t ix) { return (ix == 0) ? e.in : nullptr; }
+    inline term child(const LetP& e, size_t ix) { return (ix == 0) ? e.in : nullptr; }
+    inline term child(const LetC& e, size_t ix) { return (ix == 0) ? e.body : (ix == 1) ? e.in : nullptr; }
+    inline term child(const LetF& e, size_t ix) { return (ix == 0) ? e.body : (ix == 1) ? e.in : nullptr; }
+    inline term child(const AppC&, size_t) { return nullptr; }
+    inline term child(const If& e, size_t ix) { return (ix == 0) ? e.then : (ix == 1) ? e.otherwise : nullptr; }
+    inline term child(const AppF&, size_t) { return nullptr; }
+    inline term child(const Halt&, size_t) { return nullptr; }
+
+    using Traverse::keep;
+
+    // Whether two terms have the same variables and the same sub-terms,
+    // values, and types by identity
+    inline bool same(const LetV& a, const LetV& b) { return (a.name == b.name) && (a.in == b.in) && (a.val == b.val) && (a.type == b.type); }
+    inline bool same(const LetT& a, const LetT& b) { return (a.name == b.name) && (a.in == b.in) && (a.field == b.field) && (a.tuple == b.tuple) && (a.type == b.type); }
+    inline bool same(const LetP& a, const LetP& b) { return (a.name == b.name) && (a.var == b.var) && (a.args == b.args) && (a.in == b.in) && (a.type == b.type); }
+    inline bool same(const LetC& a, const LetC& b) { return (a.name == b.name) && (a.in == b.in) && (a.args == b.args) && (a.body == b.body) && (a.type == b.type); }
+    inline bool same(const LetF& a, const LetF& b) { return (a.name == b.name) && (a.in == b.in) && (a.cont == b.cont) && (a.args == b.args) && (a.body == b.body) && (a.type == b.type); }
+    inline bool same(const AppC& a, const AppC& b) { return (a.name == b.name) && (a.args == b.args) && (a.type == b.type); }
+    inline bool same(const If& a, const If& b) { return (a.cond == b.cond) && (a.then == b.then) && (a.otherwise == b.otherwise); }
+    inline bool same(const AppF& a, const AppF& b) { return (a.name == b.name) && (a.cont == b.cont) && (a.args == b.args) && (a.type == b.type); }
+    inline bool same(const Halt& a, const Halt& b) { return a.name == b.name; }
+
+    // Result of rewriting e to tmp: e itself if that changed nothing
+    template<typename E>
+    Step<term> update(const E& e, const E& tmp) {
+        if (same(e, tmp)) return keep;
+        return Memory::make_node<Term>(tmp);
+    }
+
+    // Tuple value with fields, v itself if they are the same
+    inline value update(const value& v, const variables& fields) {
+        const auto& tuple = std::get<Tuple>(*v);
+        if (tuple.fields == fields) return v;
+        auto tmp = tuple;
+        tmp.fields = fields;
+        return Memory::make_node<Value>(tmp);
+    }
+
+    // Whether the sub-terms of e were rewritten to themselves
+    template<typename E>
+    bool unchanged(const E& e, const Results<term>& done) {
+        for (auto ix = 0ul; ix < done.size(); ++ix) {
+            if (done[ix] != child(e, ix)) return false;
+        }
+        return true;
+    }
+
+    // Copy of e with its sub-terms replaced by done, in the order of child
+    template<typename E>
+    E with_children(const E& e, const Results<term>& done) {
+        auto tmp = e;
+        if constexpr (std::is_same_v<E, LetC> || std::is_same_v<E, LetF>) {
+            tmp.body = done[0];
+            tmp.in = done[1];
+        } else if constexpr (std::is_same_v<E, LetV> || std::is_same_v<E, LetT> || std::is_same_v<E, LetP>) {
+            tmp.in = done[0];
+        } else if constexpr (std::is_same_v<E, If>) {
+            tmp.then = done[0];
+            tmp.otherwise = done[1];
+        }
+        return tmp;
+    }
+
+    // e with its sub-terms replaced by done; e itself if none of them changed
+    template<typename E>
+    Step<term> rebuild(const E& e, const Results<term>& done) {
+        if (unchanged(e, done)) return keep;
+        return Memory::make_node<Term>(with_children(e, done));
+    }
+
+    // Default for rewriting passes: rewrite all sub-terms, then rebuild
+    template<typename E>
+    Step<term> rewrite_children(const E& e, const Results<term>& done) {
+        if (auto next = child(e, done.size())) return descend(next);
+        return rebuild(e, done);
+    }
 
     struct ToSExp {
         std::ostream& os;
@@ -150,56 +254,87 @@ namespace TailCPS {
             os << prefix << std::string(indent, ' ');
         }
 
-        void operator()(const LetV& e) {
-            os << "(let-value ("
-               << e.name
-               << " ";
-            std::visit(*this, *e.val);
-            indent += 4;
-            os << ")\n" << prefix << std::string(indent, ' ');
-            std::visit(*this, *e.in);
+        Step<Unit> operator()(const LetV& e, const Results<Unit>& done) {
+            if (done.empty()) {
+                os << "(let-value ("
+                   << e.name
+                   << " ";
+                std::visit(*this, *e.val);
+                indent += 4;
+                os << ")\n" << prefix << std::string(indent, ' ');
+                return descend(e.in);
+            }
             os << ")";
             indent -= 4;
-        }
-        void operator()(const LetC& e) {
-            os << "(let-cont "
-               << e.name
-               << " (";
-            for(const auto& arg: e.args) os << arg << " ";
-            indent += 4;
-            os << ")\n" << prefix << std::string(indent, ' ');
-            std::visit(*this, *e.body);
-            os << "\n" << prefix << std::string(indent, ' ');
-            std::visit(*this, *e.in);
+            return Unit{};
+        }
+        Step<Unit> operator()(const LetC& e, const Results<Unit>& done) {
+            switch (done.size()) {
+            case 0:
+                os << "(let-cont "
+                   << e.name
+                   << " (";
+                for(const auto& arg: e.args) os << arg << " ";
+                indent += 4;
+                os << ")\n" << prefix << std::string(indent, ' ');
+                return descend(e.body);
+            case 1:
+                os << "\n" << prefix << std::string(indent, ' ');
+                return descend(e.in);
+            }
             os << ")";
             indent -= 4;
-        }
-        void operator()(const LetT& e) {
-            os << "(pi-"
-               << e.field
-               << " "
-               << e.name
-               << " "
-               << e.tuple;
-            indent += 4;
-            os << ")\n" << prefix << std::string(indent, ' ');
-            std::visit(*this, *e.in);
+            return Unit{};
+        }
+        Step<Unit> operator()(const LetT& e, const Results<Unit>& done) {
+            if (done.empty()) {
+                os << "(pi-"
+                   << e.field
+                   << " "
+                   << e.name
+                   << " "
+                   << e.tuple;
+                if (e.type) {
+                    os << ": " << Types::show_type(e.type);
+                }
+                indent += 4;
+                os << ")\n" << prefix << std::string(indent, ' ');
+                return descend(e.in);
+            }
             os << ")";
             indent -= 4;
+            return Unit{};
         }
-        void operator()(const Halt& e) {
+        Step<Unit> operator()(const Halt& e, const Results<Unit>&) {
             os << "(halt "
                << e.name
                << ")";
+            return Unit{};
         }
-        void operator()(const AppC& e) {
+        Step<Unit> operator()(const AppC& e, const Results<Unit>&) {
             os << "(apply-cont "
-               << e.name
-               << " "
-               << e.arg
-               << ")";
+               << e.name;
+            for (const auto& arg: e.args) os << " " << arg;
+            os << ")";
+            return Unit{};
+        }
+        Step<Unit> operator()(const If& e, const Results<Unit>& done) {
+            switch (done.size()) {
+            case 0:
+                os << "(if "
+                   << e.cond;
+                indent += 4;
+                os << "\n" << prefix << std::string(indent, ' ');
+                return descend(e.then);
+            case 1:
+                os << "\n" << prefix << std::string(indent, ' ');
+                return descend(e.otherwise);
+            }
+            os << ")";
+            indent -= 4;
+            return Unit{};
         }
-        void operator()(const AppF& e) {
+        Step<Unit> operator()(const AppF& e, const Results<Unit>&) {
             os << "(apply-func "
                << e.name
                << " "
@@ -207,45 +342,54 @@ namespace TailCPS {
                << " ";
             for (const auto& arg: e.args) os << arg << " ";
             os << ")";
-        }
-        void operator()(const LetP& e) {
-            os << "(let-prim "
-               << e.var
-               << " ("
-               << e.name
-               << " ";
-            for (const auto& arg: e.args) os << arg << " ";
-            os << ")";
-            if (e.type) {
-                os << ": " << Types::show_type(e.type);
+            return Unit{};
+        }
+        Step<Unit> operator()(const LetP& e, const Results<Unit>& done) {
+            if (done.empty()) {
+                os << "(let-prim "
+                   << e.var
+                   << " ("
+                   << e.name
+                   << " ";
+                for (const auto& arg: e.args) os << arg << " ";
+                os << ")";
+                if (e.type) {
+                    os << ": " << Types::show_type(e.type);
+                }
+                indent += 4;
+                os << '\n' << prefix << std::string(indent, ' ');
+                return descend(e.in);
             }
-            indent += 4;
-            os << '\n' << prefix << std::string(indent, ' ');
-            std::visit(*this, *e.in);
             os << ")";
             indent -= 4;
-        }
-        void operator()(const LetF& e) {
-            os << "(let-func "
-               << e.name
-               << " "
-               << e.cont
-               << " (";
-            for (const auto& arg: e.args) os << arg << " ";
-            os << ")";
-            if (e.type) {
-                os << ": " << Types::show_type(e.type);
-            }
-            indent += 4;
-            os << '\n' << prefix << std::string(indent, ' ') << ";; function";
-            os << "\n" << prefix << std::string(indent, ' ');
-            std::visit(*this, *e.body);
-            os << "\n" << prefix << std::string(indent, ' ') << ";; in";
-            os << "\n" << prefix << std::string(indent, ' ');
-            std::visit(*this, *e.in);
+            return Unit{};
+        }
+        Step<Unit> operator()(const LetF& e, const Results<Unit>& done) {
+            switch (done.size()) {
+            case 0:
+                os << "(let-func "
+                   << e.name
+                   << " "
+                   << e.cont
+                   << " (";
+                for (const auto& arg: e.args) os << arg << " ";
+                os << ")";
+                if (e.type) {
+                    os << ": " << Types::show_type(e.type);
+                }
+                indent += 4;
+                os << '\n' << prefix << std::string(indent, ' ') << ";; function";
+                os << "\n" << prefix << std::string(indent, ' ');
+                return descend(e.body);
+            case 1:
+                os << "\n" << prefix << std::string(indent, ' ') << ";; in";
+                os << "\n" << prefix << std::string(indent, ' ');
+                return descend(e.in);
+            }
             os << ")";
 
             indent -= 4;
+            return Unit{};
         };
         void operator()(const Tuple& v) {
             os << "(";
@@ -266,291 +410,233 @@ namespace TailCPS {
         };
     };
 
-    struct ToCPS;
-
-    struct ToCPSHelper {
-        ToCPS& parent;
-        term result;
-        variable ctx;
-        ToCPSHelper(ToCPS&p): parent{p} {}
-
-        std::string genvar();
-
-        void operator()(const AST::F64&);
-        void operator()(const AST::Bool&);
-        void operator()(const AST::Let&);
-        void operator()(const AST::Var&);
-        void operator()(const AST::Proj&);
-        void operator()(const AST::App&);
-        void operator()(const AST::Lam&);
-        void operator()(const AST::Tuple&);
-        void operator()(const AST::Prim&);
-        void operator()(const AST::Cond&)  {}
-
-        void app_helper(const std::vector<AST::expr>&, size_t, const variable&, std::vector<variable>&, const variable&, const variable&);
-        void tuple_helper(const std::vector<AST::expr>&, size_t, const variable&, std::vector<variable>&, const variable&, const Types::type&);
-        void prim_helper(const std::vector<AST::expr>& args, size_t ix, std::vector<variable>& ys, const variable& op, const variable& kappa, const Types::type& t);
-    };
-
+    // Conversion from the AST after Kennedy'07, without recursion. Each
+    // expression becomes the bindings computing it, in program order, and
+    // the variable holding its value; the rest of the program goes in the
+    // hole of the last binding, the body of a LetC, the `in` of any other.
+    // In tail position, ie returning to a continuation k, an expression
+    // becomes a complete term instead.
     struct ToCPS {
-        size_t counter;
-        ToCPSHelper helper;
+        using Frames = std::deque<Term>;
+        struct Converted {
+            std::shared_ptr<Frames> frames;
+            variable atom;
+            term whole;
+        };
+        using Next = Traverse::Step<AST::expr, Converted>;
 
-        ToCPS(): counter{0}, helper{*this} {}
+        // per expression being converted, innermost last: the continuation
+        // it returns to, if in tail position, and the one its sub-terms in
+        // tail position return to
+        struct Context {
+            variable k;
+            variable j;
+        };
+        std::vector<Context> contexts;
+        size_t counter = 0;
 
-        using context = std::function<term(variable)>;
-        context ctx = [&](auto v) { return halt(v); };
+        variable genvar();
 
-        term result;
+        // Type of a continuation taking one value of type t, if known
+        static Types::type cont_t(const Types::type& t, const Types::type& res) {
+            return t ? Types::func_t({t}, res) : nullptr;
+        }
 
-        std::string genvar();
+        // fill the holes of frames, innermost first, the last with t
+        static term plug(const Frames& frames, term t);
+        // the frames of several sub-terms in order, moving the shorter
+        // lists into the longer, so deep nesting stays linear overall
+        static std::shared_ptr<Frames> join(const std::vector<std::shared_ptr<Frames>>& frames);
 
-        term convert(const AST::expr& e) {
-            std::visit(*this, *e);
-            return result;
-        }
+        // convert sub-term e next, returning to k if given
+        Next into(const AST::expr& e, const variable& k={});
+        // finish the current expression: its value is atom, after frames
+        Converted value(std::shared_ptr<Frames> frames, const variable& atom);
+        // ... or, in tail position, term t
+        Converted whole(const term& t);
 
-        void operator()(const AST::Var& e) {
-            result = ctx(e.name);
-        }
-        template<typename K>
-        void app_helper(const std::vector<AST::expr>& args, size_t ix, const variable& zs, std::vector<variable>& ys, const variable& f, K& kappa) {
-            auto tmp = ctx;
-            ctx = [&](auto y) {
-                ys.push_back(y);
-                if (ix + 1 == args.size()) {
-                    auto k = genvar();
-                    result = let_cont(k, {zs}, kappa(zs),
-                                      app_func(f, k, ys));
-                } else {
-                    app_helper(args, ix + 1, zs, ys, f, kappa);
-                }
-                return result;
-            };
-            std::visit(*this, *args[ix]);
-            ctx = tmp;
-        }
-        void operator()(const AST::App& e) {
-            auto kappa = ctx;
-            auto zs = genvar();
-            std::vector<variable> ys{};
-            ctx = [&](auto y) {
-                app_helper(e.args, 0, zs, ys, y, kappa);
-                return result;
-            };
-            std::visit(*this, *e.fun);
-            ctx = kappa;
-        }
-
-        template<typename K>
-        void prim_helper(const std::vector<AST::expr>& args, size_t ix, std::vector<variable>& ys, const variable& op, K& kappa, const Types::type& t) {
-            auto tmp = ctx;
-            ctx = [&](auto y) {
-                ys.push_back(y);
-                if (ix + 1 == args.size()) {
-                    auto n = genvar();
-                    result = let_prim(op, n, ys, kappa(n), t);
-                } else {
-                    prim_helper(args, ix + 1, ys, op, kappa, t);
-                }
-                return result;
-            };
-            std::visit(*this, *args[ix]);
-            ctx = tmp;
-        }
-        void operator()(const AST::Prim& e) {
-            auto kappa = ctx;
-            std::vector<variable> ys = {};
-            prim_helper(e.args, 0, ys, e.op, kappa, e.type);
-            ctx = kappa;
-        }
-        void operator()(const AST::Lam& e) {
-            auto f = genvar();
-            auto k = genvar();
-            auto x = e.args;
-            helper.ctx = k;
-            std::visit(helper, *e.body);
-            auto body = helper.result;
-            result = let_func(f, k, x, body, ctx(f), e.type);
-        }
-        template<typename K>
-        void tuple_helper(const std::vector<AST::expr>& fields, size_t ix, const variable& x, std::vector<variable>& xs, K& kappa, const Types::type& t) {
-            auto tmp = ctx;
-            ctx = [&](auto z1) {
-                xs.push_back(z1);
-                if (ix + 1 == fields.size()) {
-                    result = let(x, tuple(xs, t), kappa(x));
-                } else {
-                    tuple_helper(fields, ix + 1, x, xs, kappa, t);
-                }
-                return result;
-            };
-            std::visit(*this, *fields[ix]);
-            ctx = tmp;
-        }
-        void operator()(const AST::Tuple& e) {
-            auto kappa = ctx;
-            auto x = genvar();
-            std::vector<variable> xs{};
-            tuple_helper(e.fields, 0, x, xs, kappa, e.type);
-        }
-        void operator()(const AST::F64& e) {
-            auto x = genvar();
-            result = let(x, f64(e.val), ctx(x));
-        }
-        void operator()(const AST::Bool& e)  {
-            auto x = genvar();
-            result = let(x, boolean(e.val), ctx(x));
-        }
-        void operator()(const AST::Proj& e)  {
-            auto kappa = ctx;
-            auto x = genvar();
-            ctx = [&](auto z) { return pi(e.field, x, z, kappa(x)); };
-            std::visit(*this, *e.tuple);
-            ctx = kappa;
-        }
-        void operator()(const AST::Let& e) {
-            std::visit(*this, *e.body);
-            auto cont = result;
-            auto j = genvar();
-            helper.ctx = j;
-            std::visit(helper, *e.val);
-            auto body = helper.result;
-            result = let_cont(j, {e.var}, cont, body);
-        }
-        void operator()(const AST::Cond&) {}
+        Next operator()(const AST::Var& e, const Results<Converted>& done);
+        Next operator()(const AST::F64& e, const Results<Converted>& done);
+        Next operator()(const AST::Bool& e, const Results<Converted>& done);
+        Next operator()(const AST::Prim& e, const Results<Converted>& done);
+        Next operator()(const AST::Tuple& e, const Results<Converted>& done);
+        Next operator()(const AST::Proj& e, const Results<Converted>& done);
+        Next operator()(const AST::App& e, const Results<Converted>& done);
+        Next operator()(const AST::Lam& e, const Results<Converted>& done);
+        Next operator()(const AST::Let& e, const Results<Converted>& done);
+        Next operator()(const AST::Cond& e, const Results<Converted>& done);
     };
 
     term ast_to_cps(const AST::expr&);
     void cps_to_sexp(std::ostream&, const term&);
 
     struct Substitute {
-        std::unordered_map<std::string, std::string> mapping;
-        Substitute(const std::unordered_map<std::string, std::string>& m): mapping{m} {}
+        Symbols::Map<variable> mapping;
+        Substitute(const Symbols::Map<variable>& m): mapping{m} {}
 
-        term operator()(const LetV& e) {
+        Step<term> operator()(const LetV& e, const Results<term>& done) {
+            if (done.empty()) return descend(e.in);
             auto tmp = e;
             if (std::holds_alternative<Tuple>(*e.val)) {
-                auto& val = std::get<Tuple>(*e.val);
-                for (auto& field: val.fields) {
+                auto fields = std::get<Tuple>(*e.val).fields;
+                for (auto& field: fields) {
                     replace(field);
                 }
+                tmp.val = update(e.val, fields);
             }
-            tmp.in = std::visit(*this, *tmp.in);
-            return std::make_shared<Term>(tmp);
-        }
-        term operator()(const LetC& e) {
-            auto tmp = e;
-            tmp.in   = std::visit(*this, *tmp.in);
-            tmp.body = std::visit(*this, *tmp.body);
-            return std::make_shared<Term>(tmp);
+            tmp.in = done[0];
+            return update(e, tmp);
         }
-        term operator()(const LetT& e) {
+        Step<term> operator()(const LetC& e, const Results<term>& done) { return rewrite_children(e, done); }
+        Step<term> operator()(const LetT& e, const Results<term>& done) {
+            if (done.empty()) return descend(e.in);
             auto tmp = e;
             replace(tmp.tuple);
-            tmp.in = std::visit(*this, *tmp.in);
-            return std::make_shared<Term>(tmp);
+            tmp.in = done[0];
+            return update(e, tmp);
         }
-        term operator()(const LetF& e) {
+        Step<term> operator()(const LetF& e, const Results<term>& done) { return rewrite_children(e, done); }
+        Step<term> operator()(const AppC& e, const Results<term>&) {
             auto tmp = e;
-            tmp.in   = std::visit(*this, *tmp.in);
-            tmp.body = std::visit(*this, *tmp.body);
-            return std::make_shared<Term>(tmp);
+            replace(tmp.name);
+            for (auto& arg: tmp.args) replace(arg);
+            return update(e, tmp);
         }
-        term operator()(const AppC& e) {
+        Step<term> operator()(const If& e, const Results<term>& done) {
+            if (auto next = child(e, done.size())) return descend(next);
             auto tmp = e;
-            replace(tmp.name);
-            replace(tmp.arg);
-            return std::make_shared<Term>(tmp);
+            replace(tmp.cond);
+            tmp.then = done[0];
+            tmp.otherwise = done[1];
+            return update(e, tmp);
         }
-        term operator()(const AppF& e) {
+        Step<term> operator()(const AppF& e, const Results<term>&) {
             auto tmp = e;
             replace(tmp.name);
             replace(tmp.cont);
             for (auto& arg: tmp.args) replace(arg);
-            return std::make_shared<Term>(tmp);
+            return update(e, tmp);
         }
-        term operator()(const LetP& e) {
+        Step<term> operator()(const LetP& e, const Results<term>& done) {
+            if (done.empty()) return descend(e.in);
             auto tmp = e;
             for (auto& arg: tmp.args) replace(arg);
-            tmp.in = std::visit(*this, *tmp.in);
-            return std::make_shared<Term>(tmp);
+            tmp.in = done[0];
+            return update(e, tmp);
         }
-        term operator()(const Halt& e) {
+        Step<term> operator()(const Halt& e, const Results<term>&) {
             auto tmp = e;
             replace(tmp.name);
-            return std::make_shared<Term>(tmp);
+            return update(e, tmp);
         }
 
-        void replace(std::string& name) {
-            if (mapping.find(name) != mapping.end()) {
-                name = mapping[name];
+        void replace(variable& name) {
+            if (mapping.contains(name)) {
+                name = mapping.at(name);
             }
         }
     };
 
-    term substitute(const term& t, const std::unordered_map<variable, variable>& mapping);
+    term substitute(const term& t, const Symbols::Map<variable>& mapping);
 
-    struct BetaCont {
-        std::unordered_map<variable, std::pair<std::vector<variable>, term>> continuations;
+    // Copy of a term for one more call site of a function: binders get fresh
+    // names as the copy reaches them, and variables are renamed on the way,
+    // starting from mapping for the parameters. Renamings not applied to the
+    // term yet, if given, are followed first.
+    struct Copy {
+        Symbols::Map<variable> mapping;
+        const Symbols::Map<variable>* rename = nullptr;
+        Copy(const Symbols::Map<variable>& m, const Symbols::Map<variable>* r=nullptr): mapping{m}, rename{r} {}
 
-        term operator()(const LetV& e) {
-            auto tmp = e;
-            tmp.in = std::visit(*this, *tmp.in);
-            return std::make_shared<Term>(tmp);
+        static variable fresh(const variable& v);
+        void bind(const variable& v) { mapping[v] = fresh(v); }
+        void bind(const variables& vs) { for (const auto& v: vs) bind(v); }
+        variable use(variable v) const {
+            if (rename) while (rename->contains(v)) v = rename->at(v);
+            return mapping.contains(v) ? mapping.at(v) : v;
+        }
+        variables use(const variables& vs) const {
+            auto res = vs;
+            for (auto& v: res) v = use(v);
+            return res;
         }
-        term operator()(const LetC& e) {
-            auto tmp = e;
-            auto body = std::visit(*this, *e.body);
-            continuations[e.name] = {e.args, body};
-            auto in = std::visit(*this, *e.in);
-            tmp.body = body;
-            tmp.in = in;
-            return std::make_shared<Term>(tmp);
-        }
-        term operator()(const LetT& e) {
+
+        Step<term> operator()(const LetV& e, const Results<term>& done) {
+            if (done.empty()) {
+                bind(e.name);
+                return descend(e.in);
+            }
             auto tmp = e;
-            tmp.in = std::visit(*this, *tmp.in);
-            return std::make_shared<Term>(tmp);
-        }
-        term operator()(const LetF& e) {
+            tmp.name = use(e.name);
+            if (std::holds_alternative<Tuple>(*e.val)) tmp.val = update(e.val, use(std::get<Tuple>(*e.val).fields));
+            tmp.in = done[0];
+            return Memory::make_node<Term>(tmp);
+        }
+        Step<term> operator()(const LetT& e, const Results<term>& done) {
+            if (done.empty()) {
+                bind(e.name);
+                return descend(e.in);
+            }
             auto tmp = e;
-            tmp.in   = std::visit(*this, *tmp.in);
-            tmp.body = std::visit(*this, *tmp.body);
-            return std::make_shared<Term>(tmp);
-        }
-        term operator()(const AppC& e) {
-            if (continuations.find(e.name) == continuations.end()) {
-                return std::make_shared<Term>(e);
-            } else {
-                auto args =  continuations[e.name].first;
-                auto body = *continuations[e.name].second;
-                auto subst = std::unordered_map<variable, variable>{};
-                if (args.size() > 1) { throw std::runtime_error("Please fix continuations to have more than one argument"); }
-                subst[args[0]] = e.arg;
-                auto res = std::make_shared<Term>(body);
-                return substitute(res, subst);
-            }
-        }
-        term operator()(const AppF& e) {
+            tmp.name = use(e.name);
+            tmp.tuple = use(e.tuple);
+            tmp.in = done[0];
+            return Memory::make_node<Term>(tmp);
+        }
+        Step<term> operator()(const LetP& e, const Results<term>& done) {
+            if (done.empty()) {
+                bind(e.var);
+                return descend(e.in);
+            }
             auto tmp = e;
-            return std::make_shared<Term>(tmp);
-        }
-        term operator()(const LetP& e) {
+            tmp.var = use(e.var);
+            tmp.args = use(e.args);
+            tmp.in = done[0];
+            return Memory::make_node<Term>(tmp);
+        }
+        Step<term> operator()(const LetC& e, const Results<term>& done) {
+            if (done.empty()) {
+                bind(e.name);
+                bind(e.args);
+            }
+            if (auto next = child(e, done.size())) return descend(next);
             auto tmp = e;
-            tmp.in = std::visit(*this, *tmp.in);
-            return std::make_shared<Term>(tmp);
-        }
-        term operator()(const Halt& e) {
+            tmp.name = use(e.name);
+            tmp.args = use(e.args);
+            tmp.body = done[0];
+            tmp.in = done[1];
+            return Memory::make_node<Term>(tmp);
+        }
+        Step<term> operator()(const LetF& e, const Results<term>& done) {
+            if (done.empty()) {
+                bind(e.name);
+                bind(e.cont);
+                bind(e.args);
+            }
+            if (auto next = child(e, done.size())) return descend(next);
             auto tmp = e;
-            return std::make_shared<Term>(tmp);
-        }
+            tmp.name = use(e.name);
+            tmp.cont = use(e.cont);
+            tmp.args = use(e.args);
+            tmp.body = done[0];
+            tmp.in = done[1];
+            return Memory::make_node<Term>(tmp);
+        }
+        Step<term> operator()(const AppC& e, const Results<term>&) { return Memory::make_node<Term>(AppC{use(e.name), use(e.args)}); }
+        Step<term> operator()(const If& e, const Results<term>& done) {
+            if (auto next = child(e, done.size())) return descend(next);
+            return branch(use(e.cond), done[0], done[1]);
+        }
+        Step<term> operator()(const AppF& e, const Results<term>&) { return Memory::make_node<Term>(AppF{use(e.name), use(e.cont), use(e.args)}); }
+        Step<term> operator()(const Halt& e, const Results<term>&) { return halt(use(e.name)); }
     };
 
-    term beta_cont(const term& t);
+    term copy(const term& t, const Symbols::Map<variable>& mapping, const Symbols::Map<variable>* rename=nullptr);
 
+    // Analyses below are run by Traverse::walk, which visits every node
+    // before its sub-terms
     struct UsedSymbols {
-        std::unordered_set<variable> symbols;
+        Symbols::Set symbols;
 
         void operator()(const LetV& e) {
             if (std::holds_alternative<Tuple>(*e.val)) {
@@ -559,23 +645,20 @@ namespace TailCPS {
                     symbols.insert(field);
                 }
             }
-            std::visit(*this, *e.in);
-        }
-        void operator()(const LetC& e) {
-            std::visit(*this, *e.body);
-            std::visit(*this, *e.in);
         }
+        void operator()(const LetC&) {}
         void operator()(const LetT& e) {
             symbols.insert(e.tuple);
-            std::visit(*this, *e.in);
-        }
-        void operator()(const LetF& e) {
-            std::visit(*this, *e.in);
-            std::visit(*this, *e.body);
         }
+        void operator()(const LetF&) {}
         void operator()(const AppC& e) {
             symbols.insert(e.name);
-            symbols.insert(e.arg);
+            for (const auto& arg: e.args) {
+                symbols.insert(arg);
+            }
+        }
+        void operator()(const If& e) {
+            symbols.insert(e.cond);
         }
         void operator()(const AppF& e) {
             symbols.insert(e.name);
@@ -588,271 +671,1256 @@ namespace TailCPS {
             for (const auto& arg: e.args) {
                 symbols.insert(arg);
             }
-            std::visit(*this, *e.in);
         }
         void operator()(const Halt& e) {
             symbols.insert(e.name);
         }
     };
 
-    std::unordered_set<variable> used_symbols(const term& t);
+    Symbols::Set used_symbols(const term& t);
+
+    // Variables used in a term but bound outside of it. Names are unique, so
+    // binders and uses can be collected in one walk: every use is reached
+    // after its binder.
+    struct FreeVariables {
+        Symbols::Set bound;
+        std::vector<variable> free;
+
+        void bind(const variable& v) { bound.insert(v); }
+        void use(const variable& v) { if (!bound.contains(v)) free.push_back(v); }
+
+        void operator()(const LetV& e) {
+            if (std::holds_alternative<Tuple>(*e.val)) {
+                for (const auto& field: std::get<Tuple>(*e.val).fields) use(field);
+            }
+            bind(e.name);
+        }
+        void operator()(const LetC& e) {
+            bind(e.name);
+            for (const auto& arg: e.args) bind(arg);
+        }
+        void operator()(const LetT& e) {
+            use(e.tuple);
+            bind(e.name);
+        }
+        void operator()(const LetF& e) {
+            bind(e.name);
+            bind(e.cont);
+            for (const auto& arg: e.args) bind(arg);
+        }
+        void operator()(const AppC& e) {
+            use(e.name);
+            for (const auto& arg: e.args) use(arg);
+        }
+        void operator()(const If& e) { use(e.cond); }
+        void operator()(const AppF& e) {
+            use(e.name);
+            use(e.cont);
+            for (const auto& arg: e.args) use(arg);
+        }
+        void operator()(const LetP& e) {
+            for (const auto& arg: e.args) use(arg);
+            bind(e.var);
+        }
+        void operator()(const Halt& e) { use(e.name); }
+    };
+
+    // Free variables of the function (or continuation) with parameters args
+    // and body
+    std::vector<variable> free_variables(const variables& args, const term& body);
+
+    // Like UsedSymbols, but tally the number of use sites per variable,
+    // optionally looking through renamings not applied to the term yet
+    struct Census {
+        Symbols::Map<size_t> count;
+        const Symbols::Map<variable>* rename = nullptr;
+
+        void use(variable v) {
+            if (rename) while (rename->contains(v)) v = rename->at(v);
+            count[v]++;
+        }
+
+        void operator()(const LetV& e) {
+            if (std::holds_alternative<Tuple>(*e.val)) {
+                for (const auto& field: std::get<Tuple>(*e.val).fields) {
+                    use(field);
+                }
+            }
+        }
+        void operator()(const LetC&) {}
+        void operator()(const LetT& e) {
+            use(e.tuple);
+        }
+        void operator()(const LetF&) {}
+        void operator()(const AppC& e) {
+            use(e.name);
+            for (const auto& arg: e.args) use(arg);
+        }
+        void operator()(const If& e) {
+            use(e.cond);
+        }
+        void operator()(const AppF& e) {
+            use(e.name);
+            use(e.cont);
+            for (const auto& arg: e.args) use(arg);
+        }
+        void operator()(const LetP& e) {
+            for (const auto& arg: e.args) use(arg);
+        }
+        void operator()(const Halt& e) {
+            use(e.name);
+        }
+    };
+
+    Symbols::Map<size_t> census(const term& t, const Symbols::Map<variable>* rename=nullptr);
+
+    // Estimated size of a term in instructions, for inlining decisions
+    struct Size {
+        size_t total = 0;
+
+        static size_t cost(const variable& op) {
+            if ((op == "exp") || (op == "log") || (op == "expm1") || (op == "exprelr")) return 20;
+            if (op == "/") return 4;
+            return 1;
+        }
+
+        void operator()(const LetV& e) { if (!std::holds_alternative<Tuple>(*e.val)) total += 1; }
+        void operator()(const LetC&) {}
+        void operator()(const LetT&) { total += 1; }
+        void operator()(const LetF&) {}
+        // call, and moving the arguments in place
+        void operator()(const AppF& e) { total += 2 + e.args.size(); }
+        void operator()(const AppC&) {}
+        // compare and jump
+        void operator()(const If&) { total += 2; }
+        void operator()(const LetP& e) { total += cost(e.name); }
+        void operator()(const Halt&) {}
+    };
+
+    size_t size(const term& t);
+
+    // For passes tallying sizes bottom-up, see Inline: replace the sizes of
+    // the n sub-terms of e, the last ones finished, by the size of e
+    template<typename E>
+    void tally(std::vector<size_t>& sizes, const E& e, size_t n) {
+        auto own = Size{};
+        own(e);
+        auto total = own.total;
+        for (; n > 0; --n) {
+            total += sizes.back();
+            sizes.pop_back();
+        }
+        sizes.push_back(total);
+    }
+
+    // Remove the use sites in a deleted term from the census, optionally
+    // looking through renamings that have not been applied to it yet
+    struct Release {
+        Symbols::Map<size_t>& count;
+        const Symbols::Map<variable>* rename = nullptr;
+        Release(Symbols::Map<size_t>& c, const Symbols::Map<variable>* r=nullptr): count{c}, rename{r} {}
+
+        void release(variable v) {
+            if (rename) while (rename->contains(v)) v = rename->at(v);
+            if (count[v] > 0) count[v]--;
+        }
+
+        void operator()(const LetV& e) {
+            if (std::holds_alternative<Tuple>(*e.val)) {
+                for (const auto& field: std::get<Tuple>(*e.val).fields) release(field);
+            }
+        }
+        void operator()(const LetC&) {}
+        void operator()(const LetT& e) {
+            release(e.tuple);
+        }
+        void operator()(const LetF&) {}
+        void operator()(const AppC& e) {
+            release(e.name);
+            for (const auto& arg: e.args) release(arg);
+        }
+        void operator()(const If& e) {
+            release(e.cond);
+        }
+        void operator()(const AppF& e) {
+            release(e.name);
+            release(e.cont);
+            for (const auto& arg: e.args) release(arg);
+        }
+        void operator()(const LetP& e) {
+            for (const auto& arg: e.args) release(arg);
+        }
+        void operator()(const Halt& e) {
+            release(e.name);
+        }
+    };
 
+    // Delete bindings without use sites in a single pass. The scope of a
+    // binding is rewritten before the binding itself is considered, so all
+    // deletions that could release its uses have happened by then. Deleting
+    // a binding releases the uses in its value or body, which in turn may
+    // free bindings further out. Renamings not applied to the term yet, if
+    // given, are applied on the way; uses must be counted through them.
     struct DeadLet {
         size_t count = 0ul;
-        std::unordered_set<variable> live;
-        DeadLet(std::unordered_set<variable> l): live{l} {}
+        Symbols::Map<size_t> uses;
+        const Symbols::Map<variable>* rename = nullptr;
+        DeadLet(const Symbols::Map<size_t>& u, const Symbols::Map<variable>* r=nullptr): uses{u}, rename{r} {}
+
+        variable resolve(variable v) const {
+            if (rename) while (rename->contains(v)) v = rename->at(v);
+            return v;
+        }
+        void resolve(variables& vs) const { for (auto& v: vs) v = resolve(v); }
+
+        bool dead(const variable& v) { return uses[v] == 0; }
+        void release(const variable& v) { Release{uses, rename}.release(v); }
+        void release(const term& t) { Traverse::walk(Release{uses, rename}, t); }
 
-        term operator()(const LetV& e) {
+        Step<term> operator()(const LetV& e, const Results<term>& done) {
+            if (done.empty()) return descend(e.in);
+            if (dead(e.name)) {
+                count++;
+                if (std::holds_alternative<Tuple>(*e.val)) {
+                    for (const auto& field: std::get<Tuple>(*e.val).fields) release(field);
+                }
+                return done[0];
+            }
             auto tmp = e;
-            tmp.in = std::visit(*this, *e.in);
-            if (live.find(e.name) != live.end()) {
-                return std::make_shared<Term>(tmp);
-            } else {
+            if (std::holds_alternative<Tuple>(*e.val)) {
+                auto fields = std::get<Tuple>(*e.val).fields;
+                resolve(fields);
+                tmp.val = update(e.val, fields);
+            }
+            tmp.in = done[0];
+            return update(e, tmp);
+        }
+        Step<term> operator()(const LetC& e, const Results<term>& done) {
+            switch (done.size()) {
+            case 0:
+                return descend(e.in);
+            case 1:
+                if (!dead(e.name)) return descend(e.body);
                 count++;
-                return tmp.in;
+                release(e.body);
+                return done[0];
             }
-        }
-        term operator()(const LetC& e) {
             auto tmp = e;
-            tmp.body = std::visit(*this, *e.body);
-            tmp.in   = std::visit(*this, *e.in);
-            if (live.find(e.name) != live.end()) {
-                return std::make_shared<Term>(tmp);
-            } else {
+            tmp.in = done[0];
+            tmp.body = done[1];
+            return update(e, tmp);
+        }
+        Step<term> operator()(const LetT& e, const Results<term>& done) {
+            if (done.empty()) return descend(e.in);
+            if (dead(e.name)) {
                 count++;
-                return tmp.in;
+                release(e.tuple);
+                return done[0];
             }
+            auto tmp = e;
+            tmp.tuple = resolve(e.tuple);
+            tmp.in = done[0];
+            return update(e, tmp);
         }
-        term operator()(const LetT& e) {
+        Step<term> operator()(const LetP& e, const Results<term>& done) {
+            if (done.empty()) return descend(e.in);
+            if (dead(e.var)) {
+                count++;
+                for (const auto& arg: e.args) release(arg);
+                return done[0];
+            }
             auto tmp = e;
-            tmp.in = std::visit(*this, *e.in);
-            if (live.find(e.name) != live.end()) {
-                return std::make_shared<Term>(tmp);
-            } else {
+            resolve(tmp.args);
+            tmp.in = done[0];
+            return update(e, tmp);
+        }
+        Step<term> operator()(const LetF& e, const Results<term>& done) {
+            switch (done.size()) {
+            case 0:
+                return descend(e.in);
+            case 1:
+                if (!dead(e.name)) return descend(e.body);
                 count++;
-                return tmp.in;
+                release(e.body);
+                return done[0];
             }
+            auto tmp = e;
+            tmp.in = done[0];
+            tmp.body = done[1];
+            return update(e, tmp);
         }
-        term operator()(const LetP& e) {
+        Step<term> operator()(const AppC& e, const Results<term>&) {
             auto tmp = e;
-            tmp.in = std::visit(*this, *e.in);
-            if (live.find(e.var) != live.end()) {
-                return std::make_shared<Term>(tmp);
-            } else {
-                count++;
-                return tmp.in;
+            tmp.name = resolve(e.name);
+            resolve(tmp.args);
+            return update(e, tmp);
+        }
+        Step<term> operator()(const AppF& e, const Results<term>&) {
+            auto tmp = e;
+            tmp.name = resolve(e.name);
+            tmp.cont = resolve(e.cont);
+            resolve(tmp.args);
+            return update(e, tmp);
+        }
+        Step<term> operator()(const If& e, const Results<term>& done) {
+            if (auto next = child(e, done.size())) return descend(next);
+            auto tmp = e;
+            tmp.cond = resolve(e.cond);
+            tmp.then = done[0];
+            tmp.otherwise = done[1];
+            return update(e, tmp);
+        }
+        Step<term> operator()(const Halt& e, const Results<term>&) {
+            auto tmp = e;
+            tmp.name = resolve(e.name);
+            return update(e, tmp);
+        }
+    };
+
+    term dead_let(const term& t, const Symbols::Map<variable>* rename=nullptr);
+
+    struct InlineOptions {
+        bool functions = true;
+        bool continuations = true;
+        // inlined at every call site without counting against the budget
+        size_t small = 8;
+        // size that copies for more than one call site may add, relative to
+        // the size of the input
+        double growth = 0.5;
+    };
+
+    // Inline known functions and continuations at their call sites. With a
+    // single call site the original goes away, so these are always inlined,
+    // the body moving in place as is and its binding going; its parameters
+    // are renamed to the arguments later, by dead_let. Otherwise small functions are inlined
+    // everywhere, others while the growth budget lasts, each site getting a
+    // copy with fresh names. Bodies are rewritten before the scope of their
+    // binding, so callees are inlined into them first and copies are taken
+    // from the final body. Sizes of rewritten terms are tallied bottom-up as
+    // they are finished, so no term is measured twice.
+    struct Inline {
+        struct Callee {
+            variable cont; // empty for continuations
+            variables args;
+            term body;
+            size_t size;
+        };
+
+        InlineOptions options;
+        Symbols::Map<size_t> uses;
+        Symbols::Map<Callee> known;
+        // callees whose body moved to their single call site, and their
+        // parameters, to the arguments
+        Symbols::Set moved;
+        Symbols::Map<variable> rename;
+        // sizes of the finished sub-terms of the nodes being rewritten
+        std::vector<size_t> sizes;
+        size_t budget;
+        size_t count = 0ul;
+
+        Inline(const Symbols::Map<size_t>& u, size_t size, const InlineOptions& o):
+            options{o}, uses{u}, budget{static_cast<size_t>(o.growth*size)} {}
+
+        // Body of callee f applied to args, returning to cont, if inlined
+        term expand(const variable& f, const variable& cont, const variables& args) {
+            if (!known.contains(f)) return nullptr;
+            const auto& callee = known.at(f);
+            if (callee.args.size() != args.size()) return nullptr;
+            auto once = uses[f] == 1;
+            // continuations applied more than once join branches; copies
+            // would duplicate the code after the conditional instead
+            if (!once && callee.cont.empty()) return nullptr;
+            if (!once && (callee.size > options.small)) {
+                if (callee.size > budget) return nullptr;
+                budget -= callee.size;
+            }
+            count++;
+            sizes.push_back(callee.size);
+            if (once) {
+                moved.insert(f);
+                if (!callee.cont.empty()) rename[callee.cont] = cont;
+                for (auto ix = 0ul; ix < args.size(); ++ix) rename[callee.args[ix]] = args[ix];
+                return callee.body;
+            }
+            auto mapping = Symbols::Map<variable>{};
+            if (!callee.cont.empty()) mapping[callee.cont] = cont;
+            for (auto ix = 0ul; ix < args.size(); ++ix) mapping[callee.args[ix]] = args[ix];
+            return copy(callee.body, mapping, &rename);
+        }
+
+        // Result of e once its sub-terms are done
+        template<typename E>
+        Step<term> finish(const E& e, const Results<term>& done) {
+            tally(sizes, e, done.size());
+            return rebuild(e, done);
+        }
+
+        // Result of the binding of a moved callee, once its scope is done:
+        // just the scope, whose size replaces that of the body
+        Step<term> drop(const Results<term>& done) {
+            auto in = sizes.back();
+            sizes.pop_back();
+            sizes.back() = in;
+            return done[1];
+        }
+
+        template<typename E>
+        Step<term> rewrite(const E& e, const Results<term>& done) {
+            if (auto next = child(e, done.size())) return descend(next);
+            return finish(e, done);
+        }
+
+        template<typename E>
+        Step<term> operator()(const E& e, const Results<term>& done) { return rewrite(e, done); }
+        Step<term> operator()(const LetC& e, const Results<term>& done) {
+            if ((done.size() == 2) && moved.contains(e.name)) return drop(done);
+            if (!options.continuations || (done.size() != 1)) return rewrite(e, done);
+            known[e.name] = {variable{}, e.args, done[0], sizes.back()};
+            return descend(e.in);
+        }
+        Step<term> operator()(const LetF& e, const Results<term>& done) {
+            if ((done.size() == 2) && moved.contains(e.name)) return drop(done);
+            if (!options.functions || (done.size() != 1)) return rewrite(e, done);
+            known[e.name] = {e.cont, e.args, done[0], sizes.back()};
+            return descend(e.in);
+        }
+        Step<term> operator()(const AppC& e, const Results<term>& done) {
+            if (auto res = expand(e.name, variable{}, e.args)) return res;
+            return finish(e, done);
+        }
+        Step<term> operator()(const AppF& e, const Results<term>& done) {
+            if (auto res = expand(e.name, e.cont, e.args)) return res;
+            return finish(e, done);
+        }
+    };
+
+    // Inline, then drop what is left unused
+    term inline_calls(const term& t, const InlineOptions& options={});
+    // ... functions only, or continuations only
+    term beta_func(const term& t);
+    term beta_cont(const term& t);
+
+    // Continuation every call of a function returns to, for functions only
+    // ever called, always with the same continuation
+    struct Returns {
+        std::vector<variable> callees;
+        Symbols::Map<size_t> calls;
+        Symbols::Map<variable> cont;
+        Symbols::Set mixed;
+
+        template<typename E>
+        void operator()(const E&) {}
+        void operator()(const AppF& e) {
+            if (!calls.contains(e.name)) callees.push_back(e.name);
+            calls[e.name]++;
+            if (cont.contains(e.name) && (cont.at(e.name) != e.cont)) mixed.insert(e.name);
+            cont[e.name] = e.cont;
+        }
+    };
+
+    Symbols::Map<variable> returns(const term& t);
+
+    // Turn functions always returning to the same continuation k into
+    // continuations: calls become jumps, and returns jumps to k. The
+    // continuation is bound where k is in scope, at the definition of the
+    // function if possible, else at the start of the scope of k, which lies
+    // in the scope of the function.
+    struct Contify {
+        Symbols::Map<variable> target;
+        // continuations in scope
+        std::unordered_set<variable> scope;
+        // contified functions, with their bodies returning to k
+        Symbols::Map<term> bodies;
+        Symbols::Set contified;
+        Symbols::Set local;
+        // per continuation k: contified functions to bind at the start of its scope
+        Symbols::Map<std::vector<LetC>> pending;
+        size_t count = 0ul;
+
+        Contify(const Symbols::Map<variable>& t): target{t} {}
+
+        // t with the functions waiting for the scope of k bound around it
+        term enter(const variable& k, const term& t) {
+            if (!pending.contains(k)) return t;
+            auto res = t;
+            for (auto& c: pending[k]) {
+                c.in = res;
+                res = Memory::make_node<Term>(c);
             }
+            pending[k].clear();
+            return res;
         }
-        term operator()(const LetF& e) {
+
+        template<typename E>
+        Step<term> operator()(const E& e, const Results<term>& done) { return rewrite_children(e, done); }
+        Step<term> operator()(const LetC& e, const Results<term>& done) {
+            switch (done.size()) {
+            case 0:
+                return descend(e.body);
+            case 1:
+                scope.insert(e.name);
+                return descend(e.in);
+            }
+            scope.erase(e.name);
             auto tmp = e;
-            tmp.body = std::visit(*this, *e.body);
-            tmp.in   = std::visit(*this, *e.in);
-            if (live.find(e.name) != live.end()) {
-                return std::make_shared<Term>(tmp);
-            } else {
-                count++;
-                return tmp.in;
+            tmp.body = done[0];
+            tmp.in = enter(e.name, done[1]);
+            return update(e, tmp);
+        }
+        Step<term> operator()(const LetF& e, const Results<term>& done) {
+            switch (done.size()) {
+            case 0:
+                scope.insert(e.cont);
+                return descend(e.body);
+            case 1:
+                scope.erase(e.cont);
+                if (target.contains(e.name)) {
+                    const auto& k = target.at(e.name);
+                    auto mapping = Symbols::Map<variable>{};
+                    mapping[e.cont] = k;
+                    bodies[e.name] = substitute(done[0], mapping);
+                    contified.insert(e.name);
+                    count++;
+                    if (scope.count(k)) {
+                        local.insert(e.name);
+                    } else {
+                        auto c = LetC(e.name, e.args, bodies[e.name], nullptr);
+                        c.type = e.type;
+                        pending[k].push_back(c);
+                    }
+                }
+                return descend(e.in);
+            }
+            if (local.contains(e.name)) {
+                auto c = LetC(e.name, e.args, bodies[e.name], done[1]);
+                c.type = e.type;
+                return Memory::make_node<Term>(c);
+            }
+            if (contified.contains(e.name)) return done[1];
+            auto tmp = e;
+            tmp.body = enter(e.cont, done[0]);
+            tmp.in = done[1];
+            return update(e, tmp);
+        }
+        Step<term> operator()(const AppF& e, const Results<term>&) {
+            if (!contified.contains(e.name)) return keep;
+            return Memory::make_node<Term>(AppC{e.name, e.args});
+        }
+    };
+
+    term contify(const term& t);
+
+    // Arguments of continuations which are tuples bound by let-value at all
+    // applications, with the number of fields; zero for the others, and for
+    // continuations passed to functions, as these are applied elsewhere
+    struct TupleArgs {
+        Symbols::Map<variables> tuples;
+        Symbols::Map<std::vector<int>> split;
+
+        void whole(const variable& k) {
+            if (split.contains(k)) std::fill(split[k].begin(), split[k].end(), 0);
+        }
+
+        template<typename E>
+        void operator()(const E&) {}
+        void operator()(const LetV& e) {
+            if (std::holds_alternative<Tuple>(*e.val)) tuples[e.name] = std::get<Tuple>(*e.val).fields;
+        }
+        // before the body, which may apply it
+        void operator()(const LetC& e) { split[e.name] = std::vector<int>(e.args.size(), -1); }
+        void operator()(const AppC& e) {
+            if (!split.contains(e.name)) return;
+            auto& ns = split[e.name];
+            if (ns.size() != e.args.size()) return whole(e.name);
+            for (auto ix = 0ul; ix < ns.size(); ++ix) {
+                int n = tuples.contains(e.args[ix]) ? tuples.at(e.args[ix]).size() : 0;
+                ns[ix] = ((ns[ix] < 0) || (ns[ix] == n)) ? n : 0;
             }
         }
-        term operator()(const AppC& e) { return std::make_shared<Term>(e); }
-        term operator()(const AppF& e) { return std::make_shared<Term>(e); }
-        term operator()(const Halt& e) { return std::make_shared<Term>(e); }
+        void operator()(const AppF& e) { whole(e.cont); }
     };
 
-    term dead_let(const term& t);
+    // Scalar replacement of tuples passed to continuations, eg join points
+    // of conditionals or contified functions: shrinking forwards projections
+    // from tuples in scope, but not across arguments. Arguments found by
+    // TupleArgs are split into one per field, and the body rebinds the tuple
+    // to these, so shrinking forwards its projections and the tuple is only
+    // built where it is used whole. Nested tuples take another round.
+    struct Unbox {
+        const Symbols::Map<variables>& tuples;
+        const Symbols::Map<std::vector<int>>& split;
+        size_t count = 0ul;
+
+        Unbox(const Symbols::Map<variables>& t, const Symbols::Map<std::vector<int>>& s): tuples{t}, split{s} {}
 
-    struct BetaFunc {
-        std::unordered_map<variable, std::pair<std::vector<variable>, term>> functions;
+        static variable fresh(const variable& v);
 
-        term operator()(const LetV& e) {
+        bool splits(const variable& k) const {
+            if (!split.contains(k)) return false;
+            const auto& ns = split.at(k);
+            return std::any_of(ns.begin(), ns.end(), [](auto n) { return n > 0; });
+        }
+
+        template<typename E>
+        Step<term> operator()(const E& e, const Results<term>& done) { return rewrite_children(e, done); }
+        Step<term> operator()(const LetC& e, const Results<term>& done) {
+            if (auto next = child(e, done.size())) return descend(next);
+            if (!splits(e.name)) return rebuild(e, done);
+            count++;
+            const auto& ns = split.at(e.name);
+            auto fun = Types::resolve(e.type);
+            auto typed = fun && std::holds_alternative<Types::TyFunc>(*fun) && (std::get<Types::TyFunc>(*fun).args.size() == e.args.size());
+            auto tmp = with_children(e, done);
+            tmp.args.clear();
+            auto types = std::vector<Types::type>{};
+            for (auto ix = 0ul; ix < e.args.size(); ++ix) {
+                auto type = typed ? std::get<Types::TyFunc>(*fun).args[ix] : nullptr;
+                if (ns[ix] <= 0) {
+                    tmp.args.push_back(e.args[ix]);
+                    types.push_back(type);
+                    continue;
+                }
+                auto tuple = Types::resolve(type);
+                const auto& fields_t = (tuple && std::holds_alternative<Types::TyTuple>(*tuple)) ? std::get<Types::TyTuple>(*tuple).field_types : std::vector<Types::type>{};
+                auto fields = variables{};
+                for (auto jx = 0; jx < ns[ix]; ++jx) {
+                    fields.push_back(fresh(e.args[ix]));
+                    tmp.args.push_back(fields.back());
+                    types.push_back((size_t(ns[ix]) == fields_t.size()) ? fields_t[jx] : nullptr);
+                }
+                tmp.body = Memory::make_node<Term>(LetV{e.args[ix], Memory::make_node<Value>(Tuple{fields, type}), tmp.body});
+            }
+            auto known = std::all_of(types.begin(), types.end(), [](const auto& t) { return t != nullptr; });
+            tmp.type = known ? Types::func_t(types, std::get<Types::TyFunc>(*fun).result) : nullptr;
+            return Memory::make_node<Term>(tmp);
+        }
+        Step<term> operator()(const AppC& e, const Results<term>&) {
+            if (!splits(e.name)) return keep;
+            const auto& ns = split.at(e.name);
             auto tmp = e;
-            tmp.in = std::visit(*this, *tmp.in);
-            return std::make_shared<Term>(tmp);
+            tmp.args.clear();
+            for (auto ix = 0ul; ix < e.args.size(); ++ix) {
+                if (ns[ix] <= 0) {
+                    tmp.args.push_back(e.args[ix]);
+                } else {
+                    for (const auto& field: tuples.at(e.args[ix])) tmp.args.push_back(field);
+                }
+            }
+            return update(e, tmp);
         }
-        term operator()(const LetC& e) {
+    };
+
+    term unbox_tuples(const term& t);
+
+    // Global value numbering, scoped by dominance: a binding is visible in the
+    // term it scopes over, including nested function and continuation bodies.
+    // Later bindings of the same value are replaced by the earliest one.
+    // Covers primitives, with operands of commutative ones in canonical order,
+    // tuple projections, and literals.
+    struct PrimCSE {
+        struct Key {
+            enum class Kind { Prim, Proj, F64, Bool, Tuple } kind;
+            uint32_t op = 0;   // primitive, or field
+            uint64_t bits = 0; // literal
+            std::vector<uint32_t> args;
+
+            bool operator==(const Key& o) const { return (kind == o.kind) && (op == o.op) && (bits == o.bits) && (args == o.args); }
+        };
+
+        struct Hash {
+            size_t operator()(const Key& k) const {
+                auto res = std::hash<uint64_t>{}(k.bits) ^ (size_t(k.kind) << 32) ^ k.op;
+                for (auto arg: k.args) res = res*31 + arg;
+                return res;
+            }
+        };
+
+        std::unordered_map<Key, variable, Hash> seen;
+        // keys made visible by the enclosing bindings, innermost last
+        std::vector<Key> scope;
+        Symbols::Map<variable> replace;
+
+        // representatives are never replaced themselves
+        variable resolve(const variable& v) const { return replace.contains(v) ? replace.at(v) : v; }
+        void resolve(variables& vs) const { for (auto& v: vs) v = resolve(v); }
+
+        static bool commutative(const variable& op) { return (op == "+") || (op == "*") || (op == "fma") || (op == "fms") || (op == "fnma"); }
+
+        // Map var to an earlier binding of the same value, if there is one,
+        // else make it visible to the scope of var.
+        bool reuse(const Key& key, const variable& var) {
+            auto it = seen.find(key);
+            if (it == seen.end()) {
+                seen.emplace(key, var);
+                scope.push_back(key);
+                return false;
+            }
+            replace[var] = it->second;
+            return true;
+        }
+
+        // Leaving the scope of the innermost visible binding
+        void leave() {
+            seen.erase(scope.back());
+            scope.pop_back();
+        }
+
+        Step<term> operator()(const LetV& e, const Results<term>& done) {
+            if (done.empty()) {
+                auto key = Key{};
+                if (std::holds_alternative<F64>(*e.val)) {
+                    auto val = std::get<F64>(*e.val).value;
+                    key.kind = Key::Kind::F64;
+                    std::memcpy(&key.bits, &val, sizeof(val));
+                }
+                if (std::holds_alternative<Bool>(*e.val)) {
+                    key.kind = Key::Kind::Bool;
+                    key.bits = std::get<Bool>(*e.val).value;
+                }
+                if (std::holds_alternative<Tuple>(*e.val)) {
+                    key.kind = Key::Kind::Tuple;
+                    for (const auto& field: std::get<Tuple>(*e.val).fields) key.args.push_back(resolve(field).id);
+                }
+                reuse(key, e.name);
+                return descend(e.in);
+            }
+            if (replace.contains(e.name)) return done[0];
+            auto tmp = e;
+            if (std::holds_alternative<Tuple>(*e.val)) {
+                auto fields = std::get<Tuple>(*e.val).fields;
+                resolve(fields);
+                tmp.val = update(e.val, fields);
+            }
+            tmp.in = done[0];
+            leave();
+            return update(e, tmp);
+        }
+        Step<term> operator()(const LetC& e, const Results<term>& done) { return rewrite_children(e, done); }
+        Step<term> operator()(const LetT& e, const Results<term>& done) {
+            if (done.empty()) {
+                reuse(Key{Key::Kind::Proj, uint32_t(e.field), 0, {resolve(e.tuple).id}}, e.name);
+                return descend(e.in);
+            }
+            if (replace.contains(e.name)) return done[0];
+            auto tmp = e;
+            tmp.tuple = resolve(e.tuple);
+            tmp.in = done[0];
+            leave();
+            return update(e, tmp);
+        }
+        Step<term> operator()(const LetP& e, const Results<term>& done) {
+            if (done.empty()) {
+                auto key = Key{Key::Kind::Prim, e.name.id, 0, {}};
+                for (const auto& arg: e.args) key.args.push_back(resolve(arg).id);
+                if (commutative(e.name) && (key.args.size() >= 2)) {
+                    std::sort(key.args.begin(), key.args.begin() + 2);
+                }
+                reuse(key, e.var);
+                return descend(e.in);
+            }
+            if (replace.contains(e.var)) return done[0];
             auto tmp = e;
-            tmp.body = std::visit(*this, *e.body);
-            tmp.in   = std::visit(*this, *e.in);
-            return std::make_shared<Term>(tmp);
+            resolve(tmp.args);
+            tmp.in = done[0];
+            leave();
+            return update(e, tmp);
         }
-        term operator()(const LetT& e) {
+        Step<term> operator()(const LetF& e, const Results<term>& done) { return rewrite_children(e, done); }
+        Step<term> operator()(const AppC& e, const Results<term>&) {
             auto tmp = e;
-            tmp.in = std::visit(*this, *tmp.in);
-            return std::make_shared<Term>(tmp);
+            resolve(tmp.args);
+            return update(e, tmp);
         }
-        term operator()(const LetP& e) {
+        Step<term> operator()(const If& e, const Results<term>& done) {
+            if (auto next = child(e, done.size())) return descend(next);
             auto tmp = e;
-            tmp.in = std::visit(*this, *tmp.in);
-            return std::make_shared<Term>(tmp);
+            tmp.cond = resolve(e.cond);
+            tmp.then = done[0];
+            tmp.otherwise = done[1];
+            return update(e, tmp);
         }
-        term operator()(const LetF& e) {
+        Step<term> operator()(const AppF& e, const Results<term>&) {
             auto tmp = e;
-            tmp.body = std::visit(*this, *tmp.body);
-            functions[e.name] = {tmp.args, tmp.body};
-            tmp.in   = std::visit(*this, *tmp.in);
-            return std::make_shared<Term>(tmp);
+            tmp.name = resolve(e.name);
+            tmp.cont = resolve(e.cont);
+            resolve(tmp.args);
+            return update(e, tmp);
         }
-        term operator()(const AppC& e) {
+        Step<term> operator()(const Halt& e, const Results<term>&) {
             auto tmp = e;
-            return std::make_shared<Term>(tmp);
-        }
-        term operator()(const AppF& e) {
-            if (functions.find(e.name) == functions.end()) {
-                return std::make_shared<Term>(e);
-            } else {
-                auto args =  functions[e.name].first;
-                auto body = *functions[e.name].second;
-                auto subst = std::unordered_map<variable, variable>{};
-                for (auto ix = 0ul; ix < args.size(); ix++) {
-                    subst[args[ix]] = e.args[ix];
+            tmp.name = resolve(e.name);
+            return update(e, tmp);
+        }
+    };
+
+    term prim_cse(const term& t);
+
+    // Move functions without free variables out of the functions they are
+    // defined in, to the top of the program, where the backend emits them
+    // once. Functions using only lifted ones are closed, too: bodies are
+    // handled before the binding, so nested definitions go first.
+    struct LambdaLift {
+        // lifted functions, in order of definition; `in` is not to be followed
+        std::vector<LetF> lifted;
+        Symbols::Set global;
+        // number of function bodies around the current term
+        size_t depth = 0;
+
+        template<typename E>
+        Step<term> operator()(const E& e, const Results<term>& done) { return rewrite_children(e, done); }
+        Step<term> operator()(const LetF& e, const Results<term>& done) {
+            switch (done.size()) {
+            case 0:
+                depth++;
+                return descend(e.body);
+            case 1: {
+                depth--;
+                auto params = e.args;
+                params.push_back(e.cont);
+                auto free = free_variables(params, done[0]);
+                auto closed = std::all_of(free.begin(), free.end(), [&](const auto& v) { return global.contains(v); });
+                if ((depth > 0) && closed) {
+                    auto tmp = e;
+                    tmp.body = done[0];
+                    lifted.push_back(tmp);
+                    global.insert(e.name);
                 }
-                auto res = std::make_shared<Term>(body);
-                return substitute(res, subst);
+                return descend(e.in);
             }
-        }
-        term operator()(const Halt& e) {
-            auto tmp = e;
-            return std::make_shared<Term>(tmp);
+            }
+            if ((depth > 0) && global.contains(e.name)) return done[1];
+            return rebuild(e, done);
         }
     };
 
-    term beta_func(const term& t);
+    term lambda_lift(const term& t);
 
-    struct PrimCSE {
-        std::unordered_map<std::string, variable> seen;
-        std::unordered_map<variable, variable> replace;
+    // Turn branches with cheap arms into straight-line code: both arms are
+    // computed, then each value passed on is selected by the condition,
+    // which is all vector code can do anyway. Applies where both arms are
+    // bindings ending in jumps to the same continuation, at most `limit` in
+    // size together, counting the bodies of the functions they call. Calls
+    // are allowed to top-level functions, ie lifted ones, which are pure;
+    // their continuations are then bindings of the result. Values must have
+    // a known type, tuples are selected field by field. Inner branches go
+    // first; once the last branch jumping to a join continuation is gone, its
+    // body is spliced in after the jump's bindings, so nested conditionals
+    // flatten as well. Sizes are tallied bottom-up, as for Inline.
+    struct IfConvert {
+        size_t limit;
+        Symbols::Map<size_t> uses;
+        // argument types per continuation, where known
+        Symbols::Map<std::vector<Types::type>> signature;
+        Symbols::Map<variables> tuples;
+        // continuations which lost jumps to conversion
+        Symbols::Set joined;
+        // top-level functions in scope, and the sizes of their bodies
+        Symbols::Map<size_t> helpers;
+        // number of function bodies around the current term
+        size_t depth = 0;
+        std::vector<size_t> sizes;
+        size_t count = 0ul;
 
-        void operator()(const LetV& e) {
-            std::visit(*this, *e.in);
+        IfConvert(const Symbols::Map<size_t>& u, size_t l): limit{l}, uses{u} {}
+
+        static variable fresh(const variable& v);
+
+        void declare(const variable& k, const Types::type& t) {
+            if (!t || !std::holds_alternative<Types::TyFunc>(*Types::resolve(t))) return;
+            signature[k] = std::get<Types::TyFunc>(*Types::resolve(t)).args;
         }
-        void operator()(const LetC& e) {
-            std::visit(*this, *e.body);
-            std::visit(*this, *e.in);
+
+        // Whether k only takes the result of a call to a helper, applying it
+        bool returns(const LetC& k) const {
+            const auto& app = std::get_if<AppF>(k.in.get());
+            return app && (app->cont == k.name) && helpers.contains(app->name) && uses.contains(k.name) && (uses.at(k.name) == 1);
         }
-        void operator()(const LetT& e) {
-            std::visit(*this, *e.in);
+
+        // The jump ending the bindings at t, collecting these; nothing if
+        // anything else is in the way. A call to a helper binds the
+        // arguments of the continuation it returns to, which goes on; a tail
+        // call returns through a fresh one, jumping on with the result.
+        std::optional<AppC> jump(const term& t, std::vector<term>& bindings) {
+            for (auto it = t; it;) {
+                if (const auto& e = std::get_if<AppC>(it.get())) return *e;
+                if (const auto& e = std::get_if<AppF>(it.get()); e && helpers.contains(e->name)) {
+                    auto k = fresh(e->cont);
+                    auto x = fresh(e->cont);
+                    uses[k] = 1;
+                    bindings.push_back(let_cont(k, {x}, nullptr, app_func(e->name, k, e->args)));
+                    return AppC{e->cont, {x}};
+                }
+                if (const auto& e = std::get_if<LetC>(it.get()); e && returns(*e)) {
+                    bindings.push_back(it);
+                    it = e->body;
+                } else if (const auto& e = std::get_if<LetV>(it.get())) {
+                    bindings.push_back(it);
+                    it = e->in;
+                } else if (const auto& e = std::get_if<LetT>(it.get())) {
+                    bindings.push_back(it);
+                    it = e->in;
+                } else if (const auto& e = std::get_if<LetP>(it.get())) {
+                    bindings.push_back(it);
+                    it = e->in;
+                } else {
+                    return std::nullopt;
+                }
+            }
+            return std::nullopt;
         }
-        void operator()(const LetP& e) {
-            std::string key = e.name;
-            for (const auto& arg: e.args) { key += ":" + arg; }
-            if (seen.find(key) != seen.end()) {
-                replace[e.var] = seen[key];
-            } else {
-                seen[key] = e.var;
+
+        // t preceded by bindings, in order
+        static term wrap(const std::vector<term>& bindings, term t) {
+            for (auto it = bindings.rbegin(); it != bindings.rend(); ++it) {
+                auto tmp = **it;
+                std::visit([&](auto& e) {
+                    using E = std::decay_t<decltype(e)>;
+                    if constexpr (std::is_same_v<E, LetV> || std::is_same_v<E, LetT> || std::is_same_v<E, LetP>) e.in = t;
+                    if constexpr (std::is_same_v<E, LetC>) e.body = t;
+                }, tmp);
+                t = Memory::make_node<Term>(tmp);
             }
-            std::visit(*this, *e.in);
+            return t;
         }
-        void operator()(const LetF& e) {
-            std::visit(*this, *e.body);
-            std::visit(*this, *e.in);
+
+        // Variable holding a if cond holds, else b, appending the bindings
+        // computing it; empty if the type does not allow selecting
+        variable merge(const variable& cond, const variable& a, const variable& b, const Types::type& type, std::vector<term>& res) {
+            if (a == b) return a;
+            if (!type) return {};
+            auto ty = Types::resolve(type);
+            if (std::holds_alternative<Types::TyF64>(*ty) || std::holds_alternative<Types::TyBool>(*ty)) {
+                auto v = fresh(a);
+                // typed by infer_types, varying if the condition is
+                res.push_back(Memory::make_node<Term>(LetP{"select", v, {cond, a, b}, nullptr}));
+                return v;
+            }
+            if (!std::holds_alternative<Types::TyTuple>(*ty) || !tuples.contains(a) || !tuples.contains(b)) return {};
+            const auto& types = std::get<Types::TyTuple>(*ty).field_types;
+            auto lhs = tuples.at(a);
+            auto rhs = tuples.at(b);
+            if ((lhs.size() != types.size()) || (rhs.size() != types.size())) return {};
+            auto fields = variables{};
+            for (auto ix = 0ul; ix < types.size(); ++ix) {
+                auto field = merge(cond, lhs[ix], rhs[ix], types[ix], res);
+                if (field.empty()) return {};
+                fields.push_back(field);
+            }
+            auto v = fresh(a);
+            tuples[v] = fields;
+            res.push_back(Memory::make_node<Term>(LetV{v, Memory::make_node<Value>(Tuple{fields, type}), nullptr}));
+            return v;
+        }
+
+        template<typename E>
+        Step<term> rewrite(const E& e, const Results<term>& done) {
+            if (auto next = child(e, done.size())) return descend(next);
+            tally(sizes, e, done.size());
+            return rebuild(e, done);
+        }
+
+        template<typename E>
+        Step<term> operator()(const E& e, const Results<term>& done) { return rewrite(e, done); }
+        Step<term> operator()(const LetV& e, const Results<term>& done) {
+            if (done.empty() && std::holds_alternative<Tuple>(*e.val)) tuples[e.name] = std::get<Tuple>(*e.val).fields;
+            return rewrite(e, done);
+        }
+        Step<term> operator()(const LetF& e, const Results<term>& done) {
+            switch (done.size()) {
+            case 0:
+                if (e.type && std::holds_alternative<Types::TyFunc>(*Types::resolve(e.type))) {
+                    signature[e.cont] = {std::get<Types::TyFunc>(*Types::resolve(e.type)).result};
+                }
+                depth++;
+                break;
+            case 1:
+                depth--;
+                if (depth == 0) helpers[e.name] = sizes.back();
+                break;
+            }
+            return rewrite(e, done);
+        }
+        // a call costs the body of the callee, too
+        Step<term> operator()(const AppF& e, const Results<term>&) {
+            tally(sizes, e, 0);
+            if (helpers.contains(e.name)) sizes.back() += helpers.at(e.name);
+            return keep;
+        }
+        Step<term> operator()(const LetC& e, const Results<term>& done) {
+            if (done.empty()) declare(e.name, e.type);
+            if (auto next = child(e, done.size())) return descend(next);
+            tally(sizes, e, done.size());
+            if (!joined.contains(e.name) || (uses[e.name] != 1)) return rebuild(e, done);
+            auto bindings = std::vector<term>{};
+            auto last = jump(done[1], bindings);
+            if (!last || (last->name != e.name) || (last->args.size() != e.args.size())) return rebuild(e, done);
+            auto mapping = Symbols::Map<variable>{};
+            for (auto ix = 0ul; ix < e.args.size(); ++ix) mapping[e.args[ix]] = last->args[ix];
+            return wrap(bindings, substitute(done[0], mapping));
+        }
+        Step<term> operator()(const If& e, const Results<term>& done) {
+            if (auto next = child(e, done.size())) return descend(next);
+            auto arms = sizes[sizes.size() - 2] + sizes.back();
+            tally(sizes, e, done.size());
+            if (arms > limit) return rebuild(e, done);
+            auto res = std::vector<term>{};
+            auto then = jump(done[0], res);
+            auto otherwise = jump(done[1], res);
+            if (!then || !otherwise || (then->name != otherwise->name) || !signature.contains(then->name)) return rebuild(e, done);
+            const auto& types = signature.at(then->name);
+            if ((types.size() != then->args.size()) || (types.size() != otherwise->args.size())) return rebuild(e, done);
+            auto args = variables{};
+            for (auto ix = 0ul; ix < types.size(); ++ix) {
+                auto arg = merge(e.cond, then->args[ix], otherwise->args[ix], types[ix], res);
+                if (arg.empty()) return rebuild(e, done);
+                args.push_back(arg);
+            }
+            count++;
+            uses[then->name]--;
+            joined.insert(then->name);
+            return wrap(res, Memory::make_node<Term>(AppC{then->name, args}));
         }
-        void operator()(const AppC&) {}
-        void operator()(const AppF&) {}
-        void operator()(const Halt&) {}
     };
 
-    term prim_cse(const term& t);
+    term if_convert(const term& t, size_t limit);
 
-    struct GenCXX {
-        std::string ret = "";
-        int indent = 0;
-        std::vector<std::string> code;
-        void operator()(const LetV& e) {
-            auto value = std::visit(*this, *e.val);
-            std::string line = "const auto " + e.name + " = " + value + ";";
-            code.push_back(std::string(indent, ' ') + line);
-            std::visit(*this, *e.in);
+    // Type of the primitive op applied to arguments of the given types: Bool
+    // for comparisons, that of the arms for select, else F64; unique if all
+    // arguments are
+    Types::type prim_type(const variable& op, const std::vector<Types::type>& args);
+
+    // Find types for bindings lacking one, eg literals made by folding,
+    // projections, and values and continuations made by the passes, from
+    // their operands; arguments of continuations from their applications.
+    // Continuations are typed as functions returning the result of the
+    // enclosing function. As continuations are applied after their bodies,
+    // this is repeated until nothing new is found.
+    struct TypeInfer {
+        Symbols::Map<Types::type> types;
+        // arguments per continuation
+        Symbols::Map<variables> params;
+        // results of the enclosing functions
+        std::vector<Types::type> answers;
+        bool changed = false;
+
+        static const Types::TyFunc* function(const Types::type& t) {
+            auto ty = Types::resolve(t);
+            return (ty && std::holds_alternative<Types::TyFunc>(*ty)) ? &std::get<Types::TyFunc>(*ty) : nullptr;
         }
-        void operator()(const LetC& e) {
-            code.push_back(std::string(indent, ' ') + "// def continuation " + e.name);
-            std::visit(*this, *e.body);
-            std::visit(*this, *e.in);
+
+        Types::type type_of(const variable& v) const { return types.contains(v) ? types.at(v) : nullptr; }
+
+        // types of vs, empty unless all are known
+        std::vector<Types::type> types_of(const variables& vs) const {
+            auto res = std::vector<Types::type>{};
+            for (const auto& v: vs) {
+                if (!types.contains(v)) return {};
+                res.push_back(types.at(v));
+            }
+            return res;
         }
-        void operator()(const LetT& e) {
-            std::string line = "const auto " + e.name + " = std::get<" + std::to_string(e.field) + ">(" + e.tuple + ");";
-            code.push_back(std::string(indent, ' ') + line);
-            std::visit(*this, *e.in);
+
+        void learn(const variable& v, const Types::type& t) {
+            if (!t || types.contains(v)) return;
+            types[v] = t;
+            changed = true;
         }
-        void operator()(const LetP& e) {
-            std::string line = "const auto " + e.var + " = ";
-            if ((e.name == "+") || (e.name == "-") || (e.name == "*")) {
-                line += e.args[0] + " " + e.name + " " + e.args[1] + ";";
+
+        Types::type value_type(const Value& v) const {
+            if (const auto& t = std::get_if<Tuple>(&v)) {
+                if (t->type) return t->type;
+                auto fields = types_of(t->fields);
+                if (fields.size() != t->fields.size()) return nullptr;
+                return Types::tuple_t(fields);
             }
-            code.push_back(std::string(indent, ' ') + line);
-            std::visit(*this, *e.in);
+            return std::visit([](const auto& e) { return e.type; }, v);
         }
-        void operator()(const LetF& e) {
-            auto tmp = ret;
-            ret = e.cont;
-
-            auto res_t = "auto"s;
-            std::string line = e.name + "(";
-            if (e.type) {
-                auto fun_t = std::get<Types::TyFunc>(*e.type);
-                for (auto ix = 0ul; ix < fun_t.args.size(); ++ix) {
-                    line += std::visit(*this, *fun_t.args[ix]) + " " + e.args[ix] + ", ";
+
+        template<typename E>
+        Step<Unit> next(const E& e, const Results<Unit>& done) {
+            if (auto next = child(e, done.size())) return descend(next);
+            return Unit{};
+        }
+
+        Step<Unit> operator()(const LetV& e, const Results<Unit>& done) {
+            if (done.empty()) learn(e.name, e.type ? e.type : value_type(*e.val));
+            return next(e, done);
+        }
+        Step<Unit> operator()(const LetT& e, const Results<Unit>& done) {
+            if (done.empty()) {
+                auto tuple = Types::resolve(type_of(e.tuple));
+                if (e.type) {
+                    learn(e.name, e.type);
+                } else if (tuple && std::holds_alternative<Types::TyTuple>(*tuple)) {
+                    const auto& fields = std::get<Types::TyTuple>(*tuple).field_types;
+                    if ((e.field >= 0) && (size_t(e.field) < fields.size())) learn(e.name, fields[e.field]);
                 }
-                res_t = std::visit(*this, *fun_t.result);
-            } else {
-                for (auto ix = 0ul; ix < e.args.size(); ++ix) {
-                    line += "auto"s + " " + e.args[ix] + ", ";
+            }
+            return next(e, done);
+        }
+        Step<Unit> operator()(const LetP& e, const Results<Unit>& done) {
+            if (done.empty()) {
+                auto args = types_of(e.args);
+                if (e.type) {
+                    learn(e.var, e.type);
+                } else if (args.size() == e.args.size()) {
+                    learn(e.var, prim_type(e.name, args));
                 }
             }
-            if (line.back() == ' ') { line.erase(line.begin() + line.size() - 2, line.end()); }
-            line += ") {";
-            code.push_back(std::string(indent, ' ') + res_t + " " + line);
-            indent += 4;
-            std::visit(*this, *e.body);
-            indent -= 4;
-            code.push_back(std::string(indent, ' ') + "}");
-            ret = tmp;
-            std::visit(*this, *e.in);
+            return next(e, done);
         }
-        void operator()(const AppC& e) {
-            if (e.name == ret) {
-                code.push_back(std::string(indent, ' ') + "return " + e.arg + ";");
-                ret = "";
-            } else {
-                code.push_back(std::string(indent, ' ') + "// continuation " + e.name);
+        Step<Unit> operator()(const LetC& e, const Results<Unit>& done) {
+            if (done.empty()) {
+                params[e.name] = e.args;
+                if (const auto& fun = function(e.type); fun && (fun->args.size() == e.args.size())) {
+                    for (auto ix = 0ul; ix < e.args.size(); ++ix) learn(e.args[ix], fun->args[ix]);
+                }
+                auto args = types_of(e.args);
+                if (e.type) {
+                    learn(e.name, e.type);
+                } else if (args.size() == e.args.size()) {
+                    learn(e.name, Types::func_t(args, answers.empty() ? nullptr : answers.back()));
+                }
+            }
+            return next(e, done);
+        }
+        Step<Unit> operator()(const LetF& e, const Results<Unit>& done) {
+            const auto& fun = function(e.type);
+            switch (done.size()) {
+            case 0:
+                learn(e.name, e.type);
+                if (fun && (fun->args.size() == e.args.size())) {
+                    for (auto ix = 0ul; ix < e.args.size(); ++ix) learn(e.args[ix], fun->args[ix]);
+                    learn(e.cont, Types::func_t({fun->result}, fun->result));
+                }
+                answers.push_back(fun ? fun->result : nullptr);
+                return descend(e.body);
+            case 1:
+                answers.pop_back();
+                return descend(e.in);
             }
+            return Unit{};
         }
-        void operator()(const AppF& e) {
-            code.push_back(std::string(indent, ' ') + "// function " + e.name);
+        Step<Unit> operator()(const AppC& e, const Results<Unit>&) {
+            if (params.contains(e.name) && (params.at(e.name).size() == e.args.size())) {
+                const auto& ps = params.at(e.name);
+                for (auto ix = 0ul; ix < e.args.size(); ++ix) learn(ps[ix], type_of(e.args[ix]));
+            }
+            return Unit{};
         }
-        void operator()(const Halt& e) {
-            code.push_back(std::string(indent, ' ') + "// HALT " + e.name);
-        }
-        std::string operator()(const F64& v) { return std::to_string(v.value); }
-        std::string operator()(const Bool& v) { return std::to_string(v.value); }
-        std::string operator()(const Tuple& v) {
-            std::string res = "{";
-            for (const auto& field: v.fields) {
-                res += field + ", ";
-            }
-            if (res.back() == ' ') { res.erase(res.begin() + res.size() - 2, res.end()); }
-            res += "}";
-            auto tup = "auto"s;
-            if (v.type) { tup = std::visit(*this, *v.type); }
-            return tup + res;
-        }
-        std::string operator()(const Types::TyF64&) { return "double"; }
-        std::string operator()(const Types::TyBool&) { return "bool"; }
-        std::string operator()(const Types::TyTuple& t) {
-            std::string res = "std::tuple<";
-            for (const auto& type: t.field_types) {
-                res += std::visit(*this, *type);
-                res += ", ";
-            }
-            if (res.back() == ' ') { res.erase(res.begin() + res.size() - 2, res.end()); }
-            res += ">";
-            return res;
+        Step<Unit> operator()(const AppF& e, const Results<Unit>&) {
+            const auto& fun = function(type_of(e.name));
+            if (fun && params.contains(e.cont) && (params.at(e.cont).size() == 1)) learn(params.at(e.cont)[0], fun->result);
+            return Unit{};
+        }
+        Step<Unit> operator()(const If& e, const Results<Unit>& done) { return next(e, done); }
+        Step<Unit> operator()(const Halt&, const Results<Unit>&) { return Unit{}; }
+    };
+
+    // Write the types found by TypeInfer into the bindings lacking one
+    struct TypeAnnotate {
+        const Symbols::Map<Types::type>& types;
+
+        TypeAnnotate(const Symbols::Map<Types::type>& t): types{t} {}
+
+        template<typename E>
+        Step<term> typed(const E& e, const variable& v, const Results<term>& done) {
+            if (auto next = child(e, done.size())) return descend(next);
+            if (e.type || !types.contains(v)) return rebuild(e, done);
+            auto tmp = with_children(e, done);
+            tmp.type = types.at(v);
+            return Memory::make_node<Term>(tmp);
+        }
+
+        template<typename E>
+        Step<term> operator()(const E& e, const Results<term>& done) { return rewrite_children(e, done); }
+        Step<term> operator()(const LetV& e, const Results<term>& done) {
+            if (auto next = child(e, done.size())) return descend(next);
+            const auto& tuple = std::get_if<Tuple>(e.val.get());
+            auto untyped = tuple && !tuple->type;
+            if ((e.type && !untyped) || !types.contains(e.name)) return rebuild(e, done);
+            auto tmp = with_children(e, done);
+            tmp.type = types.at(e.name);
+            if (untyped) tmp.val = Memory::make_node<Value>(Tuple{tuple->fields, tmp.type});
+            return Memory::make_node<Term>(tmp);
+        }
+        Step<term> operator()(const LetT& e, const Results<term>& done) { return typed(e, e.name, done); }
+        Step<term> operator()(const LetP& e, const Results<term>& done) { return typed(e, e.var, done); }
+        Step<term> operator()(const LetC& e, const Results<term>& done) { return typed(e, e.name, done); }
+        Step<term> operator()(const LetF& e, const Results<term>& done) { return typed(e, e.name, done); }
+    };
+
+    term infer_types(const term& t);
+
+    // Check that every binding has a ground type, and that each variable is
+    // used as its type allows: operands of primitives, projections from
+    // tuples, and arguments of applications. Kinds are ignored, except that
+    // primitives on varying operands must not be unique, as the backend
+    // computes these once for all CVs. Throws Types::TypeError.
+    struct TypeCheck {
+        Symbols::Map<Types::type> types;
+
+        static bool ground(const Types::type& t);
+        // equal up to kinds
+        static bool compatible(const Types::type& lhs, const Types::type& rhs);
+
+        const Types::type& type_of(const variable& v) const {
+            if (!types.contains(v)) throw Types::TypeError("Unbound variable: "s + v);
+            return types.at(v);
+        }
+        const Types::TyFunc& function(const variable& v) const {
+            auto ty = Types::resolve(type_of(v));
+            if (!std::holds_alternative<Types::TyFunc>(*ty)) throw Types::TypeError("Not a function or continuation: "s + v + ": " + Types::show_type(ty));
+            return std::get<Types::TyFunc>(*ty);
         }
-        std::string operator()(const Types::TyFunc&) { throw std::runtime_error("Not implemented"); }
-        std::string operator()(const Types::TyVar& v) {
-            if (v.alias) { return std::visit(*this, *v.alias); }
-            return "auto";
+        void bind(const variable& v, const Types::type& t) {
+            if (!ground(t)) throw Types::TypeError("No ground type for "s + v + ": " + Types::show_type(t));
+            types[v] = t;
+        }
+        void expect(const variable& v, const Types::type& t, const variable& at) {
+            if (compatible(type_of(v), t)) return;
+            throw Types::TypeError("Type mismatch at "s + at + ": " + v + " is " + Types::show_type(type_of(v)) + ", expected " + Types::show_type(t));
+        }
+        void arguments(const variable& at, const variables& args, const std::vector<Types::type>& expected) {
+            if (args.size() != expected.size()) throw Types::TypeError("Wrong number of arguments: "s + at);
+            for (auto ix = 0ul; ix < args.size(); ++ix) expect(args[ix], expected[ix], at);
+        }
+
+        void operator()(const LetV& e);
+        void operator()(const LetT& e);
+        void operator()(const LetP& e);
+        void operator()(const LetC& e) {
+            const auto& fun = function_type(e.name, e.type, e.args.size());
+            for (auto ix = 0ul; ix < e.args.size(); ++ix) bind(e.args[ix], fun.args[ix]);
+            types[e.name] = e.type;
+        }
+        void operator()(const LetF& e) {
+            const auto& fun = function_type(e.name, e.type, e.args.size());
+            for (auto ix = 0ul; ix < e.args.size(); ++ix) bind(e.args[ix], fun.args[ix]);
+            bind(e.name, e.type);
+            types[e.cont] = Types::func_t({fun.result}, fun.result);
+        }
+        void operator()(const AppC& e) { arguments(e.name, e.args, function(e.name).args); }
+        void operator()(const AppF& e) {
+            const auto& fun = function(e.name);
+            arguments(e.name, e.args, fun.args);
+            const auto& k = function(e.cont);
+            if ((k.args.size() != 1) || !compatible(fun.result, k.args[0])) {
+                throw Types::TypeError("Continuation "s + e.cont + " does not take the result of " + e.name);
+            }
+        }
+        void operator()(const If& e) { expect(e.cond, Types::bool_t(), e.cond); }
+        void operator()(const Halt& e) { type_of(e.name); }
+
+        static const Types::TyFunc& function_type(const variable& v, const Types::type& t, size_t arity) {
+            auto ty = Types::resolve(t);
+            if (!ty || !std::holds_alternative<Types::TyFunc>(*ty)) throw Types::TypeError("No function type for "s + v + ": " + Types::show_type(t));
+            const auto& fun = std::get<Types::TyFunc>(*ty);
+            if (fun.args.size() != arity) throw Types::TypeError("Wrong number of arguments in the type of "s + v);
+            return fun;
         }
     };
 
-    void generate_cxx(std::ostream&, const term&);
+    // Types of all variables bound in t, see TypeCheck
+    Symbols::Map<Types::type> check_types(const term& t);
 }
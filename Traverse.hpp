@@ -0,0 +1,76 @@
+#pragma once
+
+#include <vector>
+#include <variant>
+#include <type_traits>
+
+// Traversals over AST::Expr and TailCPS::Term without recursion: the
+// path from the root to the current node is kept on an explicit stack, so
+// the native stack does not grow with the depth of the program.
+namespace Traverse {
+    // Result of passes that are only run for their effects
+    struct Unit {};
+
+    template<typename N>
+    struct Descend {
+        N node;
+    };
+
+    // Visit the sub-term n next; its result is handed back to the pass
+    template<typename N> Descend<N> descend(const N& n) { return {n}; }
+
+    // Result of a rewriting pass at a node it leaves as it is: the node
+    // itself, so unchanged subtrees are shared with the input
+    struct Keep {};
+    inline constexpr Keep keep{};
+
+    // What a pass does at a node: descend into a sub-term or finish with a result
+    template<typename N, typename R>
+    struct Step {
+        N next = nullptr;
+        R result{};
+        bool kept = false;
+        Step(const Descend<N>& d): next{d.node} {}
+        Step(const R& r): result{r} {}
+        Step(Keep): kept{true} {}
+    };
+
+    // Run pass over the tree at root. For each node e the pass is called as
+    // pass(e, done), where done holds the results of the sub-terms it has
+    // descended into so far; it is called again every time one of these
+    // finishes, so done.size() tells before, between, or after sub-terms.
+    template<typename R, typename N, typename Pass>
+    R run(Pass& pass, const N& root) {
+        struct Frame {
+            N node;
+            std::vector<R> done;
+        };
+        auto stack = std::vector<Frame>{{root, {}}};
+        for (;;) {
+            auto& top = stack.back();
+            auto step = std::visit([&](const auto& e) -> Step<N, R> { return pass(e, top.done); }, *top.node);
+            if (step.next) {
+                stack.push_back({step.next, {}});
+                continue;
+            }
+            if constexpr (std::is_same_v<R, N>) {
+                if (step.kept) step.result = top.node;
+            }
+            stack.pop_back();
+            if (stack.empty()) return step.result;
+            stack.back().done.push_back(step.result);
+        }
+    }
+
+    // Pre-order walk for analyses: visitor(e) is called for every node
+    // before its sub-terms, which are enumerated by child(e, ix)
+    template<typename N, typename Visitor>
+    void walk(Visitor&& visitor, const N& root) {
+        auto pre = [&](const auto& e, const std::vector<Unit>& done) -> Step<N, Unit> {
+            if (done.empty()) visitor(e);
+            if (auto next = child(e, done.size())) return descend(next);
+            return Unit{};
+        };
+        run<Unit>(pre, root);
+    }
+}
@@ -1,3 +1,5 @@
+#include <unordered_set>
+
 #include "Types.hpp"
 
 namespace Types {
@@ -23,11 +25,11 @@ namespace Types {
                 if (e.alias.get()) {
                     return std::visit(*this, *e.alias);
                 } else {
-                    return e.name;
+                    return "__ty_var_" + std::to_string(e.id);
                 }
             }
-            std::string operator()(const TyF64&)  { return "F64"; }
-            std::string operator()(const TyBool&) { return "Bool"; }
+            std::string operator()(const TyF64& e)  { return (e.kind == Kind::Unique) ? "unique F64" : "F64"; }
+            std::string operator()(const TyBool& e) { return (e.kind == Kind::Unique) ? "unique Bool" : "Bool"; }
         };
         if (!t) {
             return "UNKNOWN";
@@ -36,19 +38,143 @@ namespace Types {
         }
     }
 
+    type resolve(const type& t) {
+        auto res = t;
+        while (res && std::holds_alternative<TyVar>(*res) && std::get<TyVar>(*res).alias) {
+            res = std::get<TyVar>(*res).alias;
+        }
+        return res;
+    }
+
+    type find(const type& t) {
+        auto res = resolve(t);
+        for (auto cur = t; cur != res;) {
+            auto& var = std::get<TyVar>(*cur);
+            cur = var.alias;
+            var.alias = res;
+        }
+        return res;
+    }
+
+    void link(const type& v, const type& t) {
+        auto& var = std::get<TyVar>(*v);
+        if (!std::holds_alternative<TyVar>(*t)) {
+            var.alias = t;
+            return;
+        }
+        // union by rank, the shallower tree goes below the deeper
+        auto& other = std::get<TyVar>(*t);
+        if (var.rank > other.rank) {
+            other.alias = v;
+            return;
+        }
+        if (var.rank == other.rank) other.rank++;
+        var.alias = t;
+    }
+
+    Kind kind_of(const type& t) {
+        auto res = resolve(t);
+        if (!res) return Kind::Range;
+        if (std::holds_alternative<TyF64>(*res)) return std::get<TyF64>(*res).kind;
+        if (std::holds_alternative<TyBool>(*res)) return std::get<TyBool>(*res).kind;
+        return Kind::Range;
+    }
+
+    Kind join(Kind lhs, Kind rhs) {
+        return ((lhs == Kind::Unique) && (rhs == Kind::Unique)) ? Kind::Unique : Kind::Range;
+    }
 
     template<typename E, typename... Ts> type make_type(const Ts&... args) { return std::make_shared<Type>(E(args...)); }
-    type f64_t() { return make_type<TyF64>(); }
-    type var_t(const std::string& n)  { return make_type<TyVar>(n); }
-    type tuple_t(const std::vector<type> fields) { return make_type<TyTuple>(fields, fields.size()); }
-    type bool_t() { return make_type<TyBool>(); }
-    type func_t(const std::vector<type>& args, const type& res) { return make_type<TyFunc>(args, res); }
+
+    namespace {
+        // Structure of a ground type: alternative, kind or size, and children,
+        // which are hash-consed themselves
+        struct Key {
+            size_t index;
+            int tag;
+            std::vector<const Type*> children;
+            bool operator==(const Key& o) const { return (index == o.index) && (tag == o.tag) && (children == o.children); }
+        };
+
+        struct Hash {
+            size_t operator()(const Key& k) const {
+                auto res = (k.index << 16) ^ size_t(k.tag);
+                for (auto child: k.children) res = res*31 + std::hash<const Type*>{}(child);
+                return res;
+            }
+        };
+    }
+
+    struct Canonical {
+        std::unordered_map<Key, type, Hash> types;
+        std::unordered_set<const Type*> members;
+    };
+
+    namespace {
+        std::shared_ptr<Canonical>& current() {
+            static thread_local std::shared_ptr<Canonical> res = nullptr;
+            return res;
+        }
+
+        Canonical& canonical() {
+            static thread_local Canonical fallback;
+            if (const auto& table = current()) return *table;
+            return fallback;
+        }
+
+        bool is_canonical(const type& t) { return t && canonical().members.count(t.get()); }
+
+        template<typename E, typename... Ts> type make_canonical(const Key& key, const Ts&... args) {
+            auto& table = canonical();
+            auto it = table.types.find(key);
+            if (it != table.types.end()) return it->second;
+            auto res = make_type<E>(args...);
+            table.types.emplace(key, res);
+            table.members.insert(res.get());
+            return res;
+        }
+    }
+
+    Scope::Scope(): previous{current()} { current() = std::make_shared<Canonical>(); }
+    Scope::~Scope() { current() = previous; }
+
+    type f64_t(Kind k) { return make_canonical<TyF64>({Type(TyF64{}).index(), int(k), {}}, k); }
+    type var_t(size_t id)  { return make_type<TyVar>(id); }
+    type tuple_t(const std::vector<type> fields) {
+        auto key = Key{Type(TyTuple{}).index(), int(fields.size()), {}};
+        for (const auto& field: fields) {
+            if (!is_canonical(field)) return make_type<TyTuple>(fields, fields.size());
+            key.children.push_back(field.get());
+        }
+        return make_canonical<TyTuple>(key, fields, fields.size());
+    }
+    type bool_t(Kind k) { return make_canonical<TyBool>({Type(TyBool{}).index(), int(k), {}}, k); }
+    type func_t(const std::vector<type>& args, const type& res) {
+        auto key = Key{Type(TyFunc{}).index(), 0, {}};
+        for (const auto& arg: args) {
+            if (!is_canonical(arg)) return make_type<TyFunc>(args, res);
+            key.children.push_back(arg.get());
+        }
+        if (!is_canonical(res)) return make_type<TyFunc>(args, res);
+        key.children.push_back(res.get());
+        return make_canonical<TyFunc>(key, args, res);
+    }
+
+    namespace {
+        // Children are compared by their representatives: the same pointer
+        // for ground types from one table, else structurally
+        bool same(const type& lhs, const type& rhs) {
+            auto l = find(lhs);
+            auto r = find(rhs);
+            return (l == r) || (l && r && (*l == *r));
+        }
+    }
 
     bool operator==(const TyFunc& lhs, const TyFunc& rhs) {
-        if (lhs.result != rhs.result) { return false; }
+        if (!same(lhs.result, rhs.result)) { return false; }
         if (lhs.args.size() != rhs.args.size()) { return false; }
         for (auto ix = 0ul; ix < lhs.args.size(); ++ix) {
-            if (lhs.args[ix] != rhs.args[ix]) {
+            if (!same(lhs.args[ix], rhs.args[ix])) {
                 return false;
             }
         }
@@ -58,12 +184,12 @@ namespace Types {
     bool operator==(const TyTuple& lhs, const TyTuple& rhs) {
         if (lhs.field_types.size() != rhs.field_types.size()) { return false; }
         for (auto ix = 0ul; ix < rhs.field_types.size(); ++ix) {
-            if (lhs.field_types[ix] != rhs.field_types[ix]) { return false; }
+            if (!same(lhs.field_types[ix], rhs.field_types[ix])) { return false; }
         }
         return true;
     }
 
     bool operator==(const TyBool&, const TyBool&) { return true; }
     bool operator==(const TyF64&, const TyF64&) { return true; }
-    bool operator==(const TyVar& lhs, const TyVar& rhs) { return lhs.name == rhs.name; }
+    bool operator==(const TyVar& lhs, const TyVar& rhs) { return lhs.id == rhs.id; }
 }
@@ -21,6 +21,10 @@ namespace Types {
         }
     };
 
+    // Kinds of primitive types: unique values are the same for all CVs,
+    // range values may differ per CV
+    enum class Kind { Unique, Range };
+
     struct TyF64;
     struct TyBool;
     struct TyFunc;
@@ -48,7 +52,9 @@ namespace Types {
     };
 
     struct TyF64 {
+        Kind kind = Kind::Range;
         TyF64() = default;
+        TyF64(Kind k) noexcept: kind{k} {}
     };
 
     struct TyTuple {
@@ -60,14 +66,19 @@ namespace Types {
     };
 
     struct TyBool {
+        Kind kind = Kind::Range;
         TyBool() = default;
+        TyBool(Kind k) noexcept: kind{k} {}
     };
 
+    // Union-find node: a root unless aliased; rank bounds the depth of the
+    // tree below it
     struct TyVar {
-        std::string name;
+        size_t id = 0;
         type alias;
+        size_t rank = 0;
         TyVar() = default;
-        TyVar(const std::string& n) noexcept: name{n}, alias{nullptr} {}
+        TyVar(size_t i) noexcept: id{i}, alias{nullptr} {}
     };
 
     bool operator==(const TyFunc& lhs, const TyFunc& rhs);
@@ -77,10 +88,33 @@ namespace Types {
     bool operator==(const TyVar& lhs, const TyVar& rhs);
 
     std::string show_type(const type& t);
+    // follow type variable aliases to the underlying type
+    type resolve(const type& t);
+    // as resolve, but point all variables on the way directly to the result
+    type find(const type& t);
+    // make type variable v an alias of t, both must be roots
+    void link(const type& v, const type& t);
+    // kind of a primitive type, anything else is a range
+    Kind kind_of(const type& t);
+    Kind join(Kind lhs, Kind rhs);
+
+    // Ground types, ie without type variables, are hash-consed: structurally
+    // equal ones made with the same table are the same pointer. A Scope
+    // makes all types on this thread come from a fresh table, until it is
+    // left, as around each compilation; outside of any, each thread has a
+    // table of its own. Types may outlive their table.
+    struct Canonical;
+    struct Scope {
+        std::shared_ptr<Canonical> previous;
+        Scope();
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
 
-    type f64_t();
-    type var_t(const std::string& n);
+    type f64_t(Kind k=Kind::Range);
+    type var_t(size_t id);
     type tuple_t(const std::vector<type> fields);
-    type bool_t();
+    type bool_t(Kind k=Kind::Range);
     type func_t(const std::vector<type>& args, const type& res);
 }
@@ -58,6 +58,11 @@
                ,(de-sugar arg)
                ,(ds:pcm iop args))))))
 
+;; prim op applied to its arguments as is, like (exp x)
+(define ds:fun
+  (lambda (op args)
+    (list 'ast:prim op `(list ,@(ds:arg args)))))
+
 ;; argument list: de-sugar all terms
 (define ds:arg
   (lambda (ts)
@@ -66,6 +71,10 @@
         (cons (de-sugar (car ts))
               (ds:arg (cdr ts))))))
 
+(define ds:if                                       ;; conditional, both arms required
+  (lambda (p t f)
+    (list 'ast:cond (de-sugar p) (de-sugar t) (de-sugar f))))
+
 (define ds:app                                      ;; function application
   (lambda (ts)
     (list 'ast:app (de-sugar (car ts)) (ds:arg (cdr ts)))))
@@ -87,27 +96,46 @@
         ('let    (ds:let (cadr dsl) (caddr dsl)))        ;; a let-chain of type (let ((x0 v0) (x1 v1) ...) body)
         ('let*   (ds:let-star 0 (caadr dsl) (de-sugar (cadadr dsl)) (caddr dsl)))   ;; a destructuring let
         ('lambda (ds:lam (cadr dsl) (caddr dsl))) ;; anonymous function
+        ('if     (ds:if (cadr dsl) (caddr dsl) (cadddr dsl))) ;; conditional
         ('+      (ds:pcm "+" (cdr  dsl)))  ;; associative primop
         ('*      (ds:pcm "*" (cdr  dsl)))
         ('-      (ds:pnc "-" "+" '(ast:f64 0) (cadr dsl) (cddr dsl)))
         ('/      (ds:pnc "/" "*" '(ast:f64 1) (cadr dsl) (cddr dsl)))
+        ('<      (ds:fun "<"  (cdr dsl)))    ;; comparisons, yield Bool
+        ('>      (ds:fun ">"  (cdr dsl)))
+        ('<=     (ds:fun "<=" (cdr dsl)))
+        ('>=     (ds:fun ">=" (cdr dsl)))
+        ('exp     (ds:fun "exp" (cdr dsl)))      ;; math functions
+        ('log     (ds:fun "log" (cdr dsl)))
+        ('expm1   (ds:fun "expm1" (cdr dsl)))
+        ('exprelr (ds:fun "exprelr" (cdr dsl)))
         (else    (ds:app dsl))))                  ;; some function application
      ((number? dsl) (list 'ast:f64 (flonum dsl)))          ;; numeric literal
      ((symbol? dsl) (ds:var dsl))          ;; a symbol
      (else 'ERROR))))
 
+;; rebalance chains of + and *, for more instruction level parallelism;
+;; changes rounding, hence off by default
+(define reassociate #f)
+
 (define compile
   (lambda (src)
-    (cps:prim-simplify
-     (cps:prim-cse
-      (cps:beta-func
-       (cps:beta-cont
-        (cps:dead-let
-         (ast->cps
-          (ast:typecheck
-           (ast:alpha-convert
-            (eval
-             (de-sugar src))))))))))))
+    (let ((simplified (cps:shrink
+                       (cps:prim-cse
+                        (cps:shrink
+                         (cps:unbox-tuples
+                          (cps:contify
+                           (cps:inline
+                            (cps:shrink
+                             (ast->cps
+                              (ast:typecheck
+                               (ast:alpha-convert
+                                (eval
+                                 (de-sugar src))))))))))))))
+      (cps:prim-fma
+       (if reassociate
+           (cps:prim-reassociate simplified)
+           simplified)))))
 
 (define-syntax define-mechanism
   (syntax-rules ()
@@ -9,9 +9,12 @@
 #include "AST.hpp"
 #include "TailCPS.hpp"
 #include "Simplify.hpp"
+#include "GenCXX.hpp"
 extern "C" {
     struct ast { AST::expr data = nullptr; };
     struct cps { TailCPS::term data = nullptr; };
+    // Passes build their results in an arena of their own, see Memory::Scope,
+    // which is freed with the last node referring to it; likewise their types
 
     ast* ast_var(const char* name) {
         if (!name) return NULL;
@@ -31,7 +34,7 @@ extern "C" {
     ast* ast_lambda(const char** names, const ast* body) {
         if (!body || !body->data) return NULL;
         ast* res = new ast;
-        std::vector<std::string> ns;
+        std::vector<AST::symbol> ns;
         for (auto name = names; *name != NULL; ++name) ns.emplace_back(*name);
         res->data = AST::lambda(ns, body->data);
         return res;
@@ -66,6 +69,15 @@ extern "C" {
         return res;
     }
 
+    ast* ast_cond(const ast* p, const ast* t, const ast* f) {
+        if (!p || !p->data) return NULL;
+        if (!t || !t->data) return NULL;
+        if (!f || !f->data) return NULL;
+        ast* res = new ast;
+        res->data = AST::cond(p->data, t->data, f->data);
+        return res;
+    }
+
     ast* ast_f64(double v) {
         ast* res = new ast;
         res->data = AST::f64(v);
@@ -74,6 +86,8 @@ extern "C" {
 
     ast* ast_typecheck(const ast* in) {
         if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
         ast* out = new ast;
         out->data = AST::typecheck(in->data);
         return out;
@@ -81,6 +95,8 @@ extern "C" {
 
     ast* ast_alpha_convert(const ast* in) {
         if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
         ast* out = new ast;
         out->data = AST::alpha_convert(in->data);
         return out;
@@ -88,6 +104,8 @@ extern "C" {
 
     cps* ast_to_cps(const ast* in) {
         if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
         cps* out = new cps;
         out->data = TailCPS::ast_to_cps(in->data);
         return out;
@@ -123,6 +141,8 @@ extern "C" {
 
     cps* cps_beta_cont(const cps* in) {
         if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
         cps* out = new cps;
         out->data = TailCPS::beta_cont(in->data);
         return out;
@@ -130,13 +150,44 @@ extern "C" {
 
     cps* cps_beta_func(const cps* in) {
         if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
         cps* out = new cps;
         out->data = TailCPS::beta_func(in->data);
         return out;
     }
 
+    cps* cps_inline(const cps* in) {
+        if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
+        cps* out = new cps;
+        out->data = TailCPS::inline_calls(in->data);
+        return out;
+    }
+
+    cps* cps_contify(const cps* in) {
+        if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
+        cps* out = new cps;
+        out->data = TailCPS::contify(in->data);
+        return out;
+    }
+
+    cps* cps_unbox_tuples(const cps* in) {
+        if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
+        cps* out = new cps;
+        out->data = TailCPS::unbox_tuples(in->data);
+        return out;
+    }
+
     cps* cps_dead_let(const cps* in) {
         if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
         cps* out = new cps;
         out->data = TailCPS::dead_let(in->data);
         return out;
@@ -144,6 +195,8 @@ extern "C" {
 
     cps* cps_prim_cse(const cps* in) {
         if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
         cps* out = new cps;
         out->data = TailCPS::prim_cse(in->data);
         return out;
@@ -151,13 +204,76 @@ extern "C" {
 
     cps* cps_prim_simplify(const cps* in) {
         if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
         cps* out = new cps;
         out->data = TailCPS::prim_simplify(in->data);
         return out;
     }
 
+    cps* cps_shrink(const cps* in) {
+        if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
+        cps* out = new cps;
+        out->data = TailCPS::shrink(in->data);
+        return out;
+    }
+
+    cps* cps_prim_reassociate(const cps* in) {
+        if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
+        cps* out = new cps;
+        out->data = TailCPS::prim_reassociate(in->data);
+        return out;
+    }
+
+    cps* cps_prim_fma(const cps* in) {
+        if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
+        cps* out = new cps;
+        out->data = TailCPS::prim_fma(in->data);
+        return out;
+    }
+
+    cps* cps_infer_types(const cps* in) {
+        if (!in || !in->data) return NULL;
+        Memory::Scope arena;
+        Types::Scope types;
+        cps* out = new cps;
+        out->data = TailCPS::infer_types(in->data);
+        return out;
+    }
+
+    // whether every binding has a ground type used consistently
+    bool cps_check_types(const cps* in) {
+        if (!in || !in->data) return false;
+        Memory::Scope arena;
+        Types::Scope types;
+        try {
+            TailCPS::check_types(in->data);
+        } catch (const Types::TypeError& e) {
+            std::cerr << e.what() << '\n';
+            return false;
+        }
+        return true;
+    }
+
     void cps_gen_cxx(const cps* in) {
         if (!in || !in->data) return;
+        Memory::Scope arena;
+        Types::Scope types;
         TailCPS::generate_cxx(std::cout, in->data);
     }
+
+    void cps_gen_cxx_soa(const cps* in) {
+        if (!in || !in->data) return;
+        Memory::Scope arena;
+        Types::Scope types;
+        auto options = TailCPS::CXXOptions{};
+        options.layout = TailCPS::CXXOptions::Layout::SoA;
+        TailCPS::generate_cxx(std::cout, in->data, options);
+    }
 }
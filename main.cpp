@@ -2,11 +2,16 @@
 #include "Types.hpp"
 #include "TailCPS.hpp"
 #include "Simplify.hpp"
+#include "GenCXX.hpp"
 #include "interface.h"
 
 using namespace AST;
 
-void compile(const AST::expr& to_compile) {
+// reassociate: rebalance associative arithmetic, changes rounding
+// in_place: argument fields updated by the results, see CXXOptions
+void compile(const AST::expr& to_compile, bool reassociate=false, const std::map<size_t, std::pair<size_t, size_t>>& in_place={}) {
+    Memory::Scope arena;
+    Types::Scope types;
     std::cout << "\n**************************************************\n";
     std::cout << "*** Type check ***********************************\n";
     auto typed = AST::typecheck(to_compile);
@@ -17,29 +22,60 @@ void compile(const AST::expr& to_compile) {
     std::cout << "\n*** CPS conversion *******************************\n";
     auto tail_cps = TailCPS::ast_to_cps(ast);
     TailCPS::cps_to_sexp(std::cout, tail_cps);
-    std::cout << "\n*** Dead Code ************************************\n";
-    auto dead_code = dead_let(tail_cps);
-    TailCPS::cps_to_sexp(std::cout, dead_code);
-    std::cout << "\n*** Beta expand continuations ********************\n";
-    auto beta_cont = TailCPS::beta_cont(dead_code);
-    TailCPS::cps_to_sexp(std::cout, beta_cont);
-    std::cout << "\n*** Beta expand functions ************************\n";
-    auto beta_func = TailCPS::beta_func(beta_cont);
-    TailCPS::cps_to_sexp(std::cout, beta_func);
+    std::cout << "\n*** Shrinking reductions *************************\n";
+    auto shrunk = shrink(unbox_tuples(contify(inline_calls(shrink(tail_cps)))));
+    TailCPS::cps_to_sexp(std::cout, shrunk);
     std::cout << "\n*** PrimOp CSE ***********************************\n";
-    auto after_prim_cse = prim_cse(beta_func);
+    auto after_prim_cse = shrink(prim_cse(shrunk));
     TailCPS::cps_to_sexp(std::cout, after_prim_cse);
-    std::cout << "\n*** PrimOp Simplification *************************\n";
-    auto after_prim_simplify = prim_simplify(after_prim_cse);
-    TailCPS::cps_to_sexp(std::cout, after_prim_simplify);
+    auto after_reassociate = after_prim_cse;
+    if (reassociate) {
+        std::cout << "\n*** Reassociation ********************************\n";
+        after_reassociate = prim_reassociate(after_prim_cse);
+        TailCPS::cps_to_sexp(std::cout, after_reassociate);
+    }
+    std::cout << "\n*** FMA contraction ******************************\n";
+    auto after_prim_fma = prim_fma(after_reassociate);
+    TailCPS::cps_to_sexp(std::cout, after_prim_fma);
     std::cout << "\n*** Generate CXX *********************************\n";
-    generate_cxx(std::cout, after_prim_simplify);
+    generate_cxx(std::cout, after_prim_fma);
+    std::cout << "\n*** Generate CXX (SoA) ***************************\n";
+    auto soa = TailCPS::CXXOptions{};
+    soa.layout = TailCPS::CXXOptions::Layout::SoA;
+    generate_cxx(std::cout, after_prim_fma, soa);
+    std::cout << "\n*** Generate CXX (SoA, AVX2/AVX512 dispatch) *****\n";
+    soa.dispatch = {TailCPS::CXXOptions::ISA::AVX2, TailCPS::CXXOptions::ISA::AVX512};
+    generate_cxx(std::cout, after_prim_fma, soa);
+    std::cout << "\n*** Generate CXX (SoA, voltage tables) ***********\n";
+    soa.dispatch = {};
+    soa.tables.enabled = true;
+    std::ostringstream header;
+    generate_cxx(std::cout, header, after_prim_fma, soa);
+    std::cout << "\n*** Header (SoA, voltage tables) *****************\n";
+    std::cout << header.str();
+    std::cout << "\n*** Generate CXX (SoA, AVX2, node index, colored) *\n";
+    soa.tables.enabled = false;
+    soa.isa = TailCPS::CXXOptions::ISA::AVX2;
+    soa.node_index = true;
+    soa.colored = true;
+    header.str("");
+    generate_cxx(std::cout, header, after_prim_fma, soa);
+    std::cout << "\n*** Header (SoA, AVX2, node index, colored) ******\n";
+    std::cout << header.str();
+    if (!in_place.empty()) {
+        std::cout << "\n*** Generate CXX (SoA, results in place) *********\n";
+        auto update = TailCPS::CXXOptions{};
+        update.layout = TailCPS::CXXOptions::Layout::SoA;
+        update.in_place = in_place;
+        generate_cxx(std::cout, after_prim_fma, update);
+    }
     std::cout << "\n**************************************************\n";
 }
 
 
 
-int main() {
+int main(int argc, char** argv) {
+    auto reassociate = (argc > 1) && (std::string(argv[1]) == "--reassociate");
     auto Ih_current =
         lambda({"sim", "mech"},
                pi("sim_v", 0, "sim"_var,
@@ -52,8 +88,24 @@ int main() {
                                      ("sim_i"_var + (("mech_gbar"_var * "mech_m"_var) * ("sim_v"_var - "mech_ehcn"_var))),
                                      let("g_new",
                                          ("sim_g"_var + ("mech_gbar"_var * "mech_m"_var)),
-                                         tuple({"i_new"_var, "g_new"_var}))))))))));
-    compile(Ih_current);
+                                         tuple({"i_new"_var, "g_new"_var}))))))))),
+               // parameters are the same for all CVs
+               {tuple_t({f64_t(), f64_t(), f64_t()}), tuple_t({f64_t(), f64_t(Kind::Unique), f64_t(Kind::Unique)})});
+    // i and g of sim accumulate the current and conductance
+    compile(Ih_current, reassociate, {{0, {0, 1}}, {1, {0, 2}}});
+    auto Na_m_gate =
+        lambda({"sim", "mech"},
+               pi("sim_v", 0, "sim"_var,
+                  pi("sim_dt", 1, "sim"_var,
+                     pi("mech_m", 0, "mech"_var,
+                        let("alpha", exprelr((0.0_f64 - ("sim_v"_var + 40.0_f64)) / 10.0_f64),
+                            let("beta", 4.0_f64 * exp((0.0_f64 - ("sim_v"_var + 65.0_f64)) / 18.0_f64),
+                                let("tau", 1.0_f64 / ("alpha"_var + "beta"_var),
+                                    let("inf", "alpha"_var * "tau"_var,
+                                        let("m_new", "inf"_var + ("mech_m"_var - "inf"_var) * exp((0.0_f64 - "sim_dt"_var) / "tau"_var),
+                                            tuple({"m_new"_var}))))))))));
+    // m of mech is the gate's state
+    compile(Na_m_gate, reassociate, {{0, {1, 0}}});
     // compile(let("f", lambda({"x"}, "x"_var + "x"_var), apply("f"_var, {42.0_f64})));
     // compile(let("a", tuple({1.0_f64, 2.0_f64, 3.0_f64}), let("b", project(1, "a"_var), "b"_var)));
     // compile(let("a", 42.0_f64, "a"_var + "a"_var));
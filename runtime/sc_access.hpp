@@ -0,0 +1,21 @@
+#pragma once
+
+// Field access metadata for generated kernels
+//
+// For argument j of a SoA kernel, <kernel>_access_j lists per field whether the
+// kernel reads it, writes it, or both, arguments which are not tuples having a
+// single field. Fields are written when a result is stored into them in place,
+// see CXXOptions::in_place. The kernel only takes the fields it accesses, in
+// order of arguments and fields, followed by output arrays for the remaining
+// results. A simulator need not pack fields which are not accessed, nor copy
+// back fields which are only read.
+//
+// <kernel>_results lists per field of the result, <kernel>_results_size of
+// them, whether the kernel stores it into an output array of its own, adds it
+// to that array through the node index, see CXXOptions::node_index, or stores
+// it in place into the argument field marked as written above.
+
+namespace sc {
+    enum class access: unsigned char { none = 0, read = 1, write = 2, read_write = 3 };
+    enum class result: unsigned char { store = 0, accumulate = 1, in_place = 2 };
+}
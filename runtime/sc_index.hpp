@@ -0,0 +1,145 @@
+#pragma once
+
+// Node indices for generated kernels
+//
+// Kernels generated with node indices read some of their arguments and
+// accumulate their results through an index node[cv] instead of the CV itself.
+// Before the first call, the index is cut into runs of blocks of `width` CVs,
+// which are classified by the pattern of their indices
+//   contiguous   node[cv + 1] = node[cv] + 1, plain vector loads and stores
+//   constant     all indices equal, broadcast loads, adding lanes in order
+//   independent  all indices distinct, gathers and scatters
+//   conflicting  anything else, handled one CV at a time
+// The kernel then picks a specialised loop per run. Results are the same as
+// handling one CV at a time, in order, for all vector widths.
+//
+// For running a kernel on several threads, a schedule reorders the CVs into
+// groups in which no two CVs share a node. Group g holds the g-th CV of each
+// node, so the chunks of a group can run in parallel without atomics, while
+// every node still receives its contributions in the original order; results
+// do not depend on the number of threads.
+
+#include <cstddef>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+
+#define SC_INDEX_INLINE inline __attribute__((always_inline))
+
+namespace sc {
+    enum class index_kind { contiguous, constant, independent, conflicting };
+
+    struct index_run {
+        std::size_t begin, end;
+        index_kind kind;
+    };
+
+    inline index_kind classify(const int* node, std::size_t n) {
+        auto constant = true, contiguous = true;
+        for (std::size_t j = 1; j < n; ++j) {
+            constant = constant && (node[j] == node[0]);
+            contiguous = contiguous && (node[j] == node[j - 1] + 1);
+        }
+        if (contiguous) return index_kind::contiguous;
+        if (constant) return index_kind::constant;
+        std::unordered_set<int> seen(node, node + n);
+        if (seen.size() == n) return index_kind::independent;
+        return index_kind::conflicting;
+    }
+
+    // runs covering [lo, hi), starting at lo plus multiples of width; width
+    // must be a multiple of the kernel's vector width, see <kernel>_index_width
+    inline void index_runs(std::vector<index_run>& res, const int* node, std::size_t lo, std::size_t hi, std::size_t width) {
+        auto first = res.size();
+        for (std::size_t begin = lo; begin < hi; begin += width) {
+            auto end = (begin + width < hi) ? begin + width : hi;
+            auto kind = classify(node + begin, end - begin);
+            if ((res.size() > first) && (res.back().kind == kind)) {
+                res.back().end = end;
+            } else {
+                res.push_back({begin, end, kind});
+            }
+        }
+    }
+
+    inline std::vector<index_run> index_runs(const int* node, std::size_t n, std::size_t width) {
+        std::vector<index_run> res;
+        index_runs(res, node, 0, n, width);
+        return res;
+    }
+
+    struct schedule {
+        // CV j of the schedule is CV permutation[j] of the mechanism, node
+        // is the reordered index
+        std::vector<std::size_t> permutation;
+        std::vector<int> node;
+        // chunk c covers runs [chunks[c].begin, chunks[c].end)
+        struct chunk { std::size_t begin, end; };
+        std::vector<index_run> runs;
+        std::vector<chunk> chunks;
+        // group g covers chunks [groups[g], groups[g + 1])
+        std::vector<std::size_t> groups;
+
+        // reorder an array indexed by CV once, before using the schedule;
+        // kernels leave results per CV in this order too, arrays on nodes
+        // are not reordered
+        template<typename T> void permute(T* values) const {
+            std::vector<T> tmp(values, values + permutation.size());
+            for (std::size_t j = 0; j < permutation.size(); ++j) values[j] = tmp[permutation[j]];
+        }
+    };
+
+    // chunks of at most `chunk` CVs, rounded up to a multiple of width
+    inline schedule color(const int* node, std::size_t n, std::size_t width, std::size_t chunk = 1024) {
+        schedule res;
+        // group of each CV: how many CVs before it share its node
+        std::vector<std::size_t> group(n), count;
+        std::unordered_map<int, std::size_t> seen;
+        for (std::size_t cv = 0; cv < n; ++cv) {
+            group[cv] = seen[node[cv]]++;
+            if (group[cv] == count.size()) count.push_back(0);
+            count[group[cv]]++;
+        }
+        // stable counting sort by group
+        std::vector<std::size_t> offset(count.size() + 1, 0);
+        for (std::size_t g = 0; g < count.size(); ++g) offset[g + 1] = offset[g] + count[g];
+        res.permutation.resize(n);
+        res.node.resize(n);
+        auto next = offset;
+        for (std::size_t cv = 0; cv < n; ++cv) {
+            auto j = next[group[cv]]++;
+            res.permutation[j] = cv;
+            res.node[j] = node[cv];
+        }
+        chunk = ((chunk + width - 1)/width)*width;
+        res.groups.push_back(0);
+        for (std::size_t g = 0; g < count.size(); ++g) {
+            for (auto lo = offset[g]; lo < offset[g + 1]; lo += chunk) {
+                auto hi = (lo + chunk < offset[g + 1]) ? lo + chunk : offset[g + 1];
+                auto first = res.runs.size();
+                index_runs(res.runs, res.node.data(), lo, hi, width);
+                res.chunks.push_back({first, res.runs.size()});
+            }
+            res.groups.push_back(res.chunks.size());
+        }
+        return res;
+    }
+
+    // Lane-wise access for vector types without gather and scatter instructions
+    template<typename V> SC_INDEX_INLINE V gather(const double* p, const int* node) {
+        V res;
+        for (std::size_t j = 0; j < sizeof(V)/sizeof(double); ++j) res[j] = p[node[j]];
+        return res;
+    }
+
+    template<typename V> SC_INDEX_INLINE void scatter_add(double* p, const int* node, V v) {
+        for (std::size_t j = 0; j < sizeof(V)/sizeof(double); ++j) p[node[j]] += v[j];
+    }
+
+    // all lanes into one place, in order
+    template<typename V> SC_INDEX_INLINE void accumulate(double* p, V v) {
+        for (std::size_t j = 0; j < sizeof(V)/sizeof(double); ++j) *p += v[j];
+    }
+}
+
+#undef SC_INDEX_INLINE
@@ -0,0 +1,120 @@
+#pragma once
+
+// Lookup tables for generated kernels
+//
+// A table holds samples of a function f of one variable, usually the
+// membrane potential, on an equidistant grid covering [lo, hi]. Lookups
+// interpolate linearly or cubically (Catmull-Rom) and fall back to computing
+// f directly for arguments outside [lo, hi], or NaN. Like sc_math.hpp, lookups
+// accept doubles and vectors of doubles.
+
+#include <cstddef>
+#include <vector>
+#include <type_traits>
+
+#include "sc_math.hpp"
+
+#define SC_TABLE_INLINE inline __attribute__((always_inline))
+
+namespace sc {
+    enum interpolation { linear = 1, cubic = 3 };
+
+    struct table {
+        double lo = 0.0, hi = 0.0, step = 1.0, inv_step = 1.0;
+        // values[j] = f(lo + (j - 1)*step), one sample below lo and two
+        // above hi, so cubic interpolation never leaves the table
+        std::vector<double> values;
+
+        template<typename F>
+        void fill(F f, double lo_, double hi_, double step_) {
+            auto n = static_cast<std::size_t>((hi_ - lo_)/step_ + 0.5);
+            lo = lo_;
+            step = step_;
+            inv_step = 1.0/step_;
+            hi = lo_ + math::detail::mul(static_cast<double>(n), step_);
+            values.resize(n + 4);
+            for (std::size_t j = 0; j < values.size(); ++j) {
+                values[j] = f(lo + math::detail::mul(static_cast<double>(j) - 1.0, step));
+            }
+        }
+    };
+
+    namespace detail {
+        SC_TABLE_INLINE bool all(bool m) { return m; }
+        template<typename M> SC_TABLE_INLINE bool all(M m) {
+            for (std::size_t j = 0; j < sizeof(M)/sizeof(m[0]); ++j) {
+                if (!m[j]) return false;
+            }
+            return true;
+        }
+
+        template<typename V, typename I> SC_TABLE_INLINE V gather(const double* p, I i) {
+            if constexpr (std::is_same_v<V, double>) {
+                return p[i];
+            } else {
+                V res;
+                for (std::size_t j = 0; j < sizeof(V)/sizeof(double); ++j) res[j] = p[i[j]];
+                return res;
+            }
+        }
+
+        // v = lo + (k + f)*step, 0 <= f < 1, interpolate around k
+        template<int Interpolation, typename V>
+        SC_TABLE_INLINE V interpolate(const table& t, V v) {
+            using namespace math::detail;
+            V x = v - t.lo;
+            x = mul(x, t.inv_step);
+            V k = x + shift;
+            k = k - shift;
+            k = select(k > x, k - 1.0, k);
+            V f = x - k;
+            auto i = bits(k + shift) - bits(V{} + shift);
+            const double* p = t.values.data();
+            V p1 = gather<V>(p + 1, i);
+            V p2 = gather<V>(p + 2, i);
+            if constexpr (Interpolation == linear) {
+                V d = p2 - p1;
+                return p1 + mul(f, d);
+            } else {
+                V p0 = gather<V>(p, i);
+                V p3 = gather<V>(p + 3, i);
+                // p1 + f/2*(p2 - p0 + f*(2p0 - 5p1 + 4p2 - p3 + f*(3(p1 - p2) + p3 - p0)))
+                V c3 = p1 - p2;
+                c3 = mul(c3, 3.0);
+                c3 = c3 + p3;
+                c3 = c3 - p0;
+                V c2 = mul(p0, 2.0);
+                c2 = c2 - mul(p1, 5.0);
+                c2 = c2 + mul(p2, 4.0);
+                c2 = c2 - p3;
+                V c1 = p2 - p0;
+                V r = mul(f, c3);
+                r = r + c2;
+                r = mul(f, r);
+                r = r + c1;
+                r = mul(mul(f, 0.5), r);
+                return p1 + r;
+            }
+        }
+    }
+
+    // Lanes outside the table take their value from `fallback`, which is only
+    // called if there are any; the result of each lane is the same for all
+    // vector widths.
+    template<int Interpolation, typename V, typename F>
+    SC_TABLE_INLINE V lookup(const table& t, V v, F fallback) {
+        using namespace math::detail;
+        if constexpr (std::is_same_v<V, double>) {
+            if ((v >= t.lo) && (v <= t.hi)) return sc::detail::interpolate<Interpolation>(t, v);
+            return fallback();
+        } else {
+            auto inside = (v >= t.lo) & (v <= t.hi);
+            if (sc::detail::all(inside)) return sc::detail::interpolate<Interpolation>(t, v);
+            if (sc::detail::all(~inside)) return fallback();
+            V res = sc::detail::interpolate<Interpolation>(t, select(inside, v, V{} + t.lo));
+            return select(inside, res, fallback());
+        }
+    }
+}
+
+#undef SC_TABLE_INLINE
@@ -0,0 +1,71 @@
+// Checks that deeply nested programs compile and are freed without exhausting
+// the native stack: every pass, and the destruction of its nodes, must keep
+// the path to the current node on the heap, see Traverse and Memory::Arena.
+//
+//   deep_nesting
+//
+// Exits non-zero, or crashes, on failure.
+#include <sstream>
+
+#include "interface.h"
+
+using namespace AST;
+
+namespace {
+    // x*g + 1, nested depth times in the left operand
+    expr nested_arithmetic(size_t depth) {
+        auto res = "x"_var;
+        for (auto ix = 0ul; ix < depth; ++ix) res = res*"g"_var + 1.0_f64;
+        return lambda({"x", "g"}, res, {f64_t(), f64_t()});
+    }
+
+    // let v0 = x in let v1 = v0 + 1 in ... v<depth>
+    expr let_chain(size_t depth) {
+        auto name = [](size_t ix) { return "v" + std::to_string(ix); };
+        auto res = var(name(depth));
+        for (auto ix = depth; ix > 0; --ix) res = let(name(ix), var(name(ix - 1)) + 1.0_f64, res);
+        return lambda({"x"}, let(name(0), "x"_var, res), {f64_t()});
+    }
+
+    TailCPS::term optimise(const expr& e) {
+        auto cps = TailCPS::ast_to_cps(AST::alpha_convert(AST::typecheck(e)));
+        cps = shrink(prim_cse(shrink(unbox_tuples(contify(inline_calls(shrink(cps)))))));
+        return prim_fma(cps);
+    }
+
+    bool check(const std::string& what, bool ok) {
+        if (!ok) std::cerr << what << ": failed\n";
+        return ok;
+    }
+}
+
+int main() {
+    auto ok = true;
+    // the whole pipeline, and printing, inside an arena
+    for (auto [name, e]: {std::pair{"arithmetic", nested_arithmetic(5000)}, std::pair{"let chain", let_chain(5000)}}) {
+        Memory::Scope arena;
+        Types::Scope types;
+        std::ostringstream os;
+        TailCPS::cps_to_sexp(os, optimise(e));
+        ok &= check(name, !os.str().empty());
+    }
+    // nodes outside of any arena
+    {
+        auto e = let_chain(100000);
+        auto cps = TailCPS::ast_to_cps(AST::alpha_convert(AST::typecheck(e)));
+        ok &= check("let chain, no arena", cps != nullptr);
+    }
+    // the Scheme bindings, each pass in an arena of its own
+    {
+        auto e = new ast{nested_arithmetic(5000)};
+        auto typed = ast_typecheck(e);
+        auto renamed = ast_alpha_convert(typed);
+        auto converted = ast_to_cps(renamed);
+        auto shrunk = cps_shrink(converted);
+        auto inferred = cps_infer_types(shrunk);
+        ok &= check("interface", cps_check_types(inferred));
+        for (auto a: {e, typed, renamed}) ast_destroy(a);
+        for (auto c: {converted, shrunk, inferred}) cps_destroy(c);
+    }
+    return ok ? 0 : 1;
+}
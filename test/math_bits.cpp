@@ -0,0 +1,88 @@
+// Calls runtime/sc_math.hpp and runtime/sc_table.hpp directly, for doubles
+// and vectors of doubles, and writes all results to a file:
+//
+//   math_bits <output>
+//
+// Built once with contraction off and once with -ffp-contract=fast -mfma, see
+// test/same_bits.cmake: the headers must give the same bits either way, as the
+// functions are inlined into the caller and compiled with its flags. Exits
+// non-zero if the file cannot be written, or vector lanes differ from doubles.
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "sc_math.hpp"
+#include "sc_table.hpp"
+
+namespace {
+    typedef double f64x4 __attribute__((vector_size(32)));
+
+    const std::size_t n = 4096;
+
+    // a product the caller's flags cannot fuse with the add it feeds, which
+    // would change the arguments rather than the functions under test
+    __attribute__((noinline)) double product(double a, double b) { return a*b; }
+
+    // arguments in [lo, hi), one in 8 a special value
+    std::vector<double> arguments(double lo, double hi) {
+        const double special[] = {0.0, -0.0, 1e-310, __builtin_inf(), -__builtin_inf(), __builtin_nan(""), 1e-20, -1e-20};
+        std::vector<double> res(n);
+        std::uint64_t s = 0x9e3779b97f4a7c15ull;
+        for (std::size_t ix = 0; ix < n; ++ix) {
+            s ^= s << 13; s ^= s >> 7; s ^= s << 17;
+            double u = product((double)(s >> 11), 0x1.0p-53);
+            res[ix] = (ix % 8 == 7) ? special[(ix/8) % 8] : lo + product(hi - lo, u);
+        }
+        return res;
+    }
+
+    // f on every argument, as doubles and as vectors, plus y to give the
+    // caller an add to fuse into; false if lanes and doubles differ
+    template<typename F>
+    bool run(std::vector<double>& out, double lo, double hi, F f) {
+        auto x = arguments(lo, hi);
+        auto y = arguments(-1.0, 1.0);
+        auto ok = true;
+        for (std::size_t ix = 0; ix < n; ix += 4) {
+            f64x4 xv, yv;
+            std::memcpy(&xv, &x[ix], sizeof(xv));
+            std::memcpy(&yv, &y[ix], sizeof(yv));
+            f64x4 rv = f(xv) + yv;
+            for (std::size_t jx = 0; jx < 4; ++jx) {
+                double r = f(x[ix + jx]) + y[ix + jx];
+                ok &= std::memcmp(&r, &rv[jx], sizeof(r)) == 0;
+                out.push_back(r);
+            }
+        }
+        return ok;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::fprintf(stderr, "usage: math_bits <output>\n");
+        return 1;
+    }
+    auto rate = [](auto v) { return sc::math::exprelr((v + 40.0)/10.0) - sc::math::exp(v/18.0); };
+    sc::table t;
+    t.fill([&](double v) { return rate(v); }, -100.0, 50.0, 0.125);
+    std::vector<double> out;
+    auto ok = true;
+    ok &= run(out, -745.0, 710.0, [](auto x) { return sc::math::exp(x); });
+    ok &= run(out, -40.0, 710.0, [](auto x) { return sc::math::expm1(x); });
+    ok &= run(out, -0.1, 0.1, [](auto x) { return sc::math::expm1(x); });
+    ok &= run(out, 0.0, 1e300, [](auto x) { return sc::math::log(x); });
+    ok &= run(out, 0.5, 2.0, [](auto x) { return sc::math::log(x); });
+    ok &= run(out, -700.0, 700.0, [](auto x) { return sc::math::exprelr(x); });
+    ok &= run(out, -120.0, 60.0, [&](auto v) { return sc::lookup<sc::linear>(t, v, [&] { return rate(v); }); });
+    ok &= run(out, -120.0, 60.0, [&](auto v) { return sc::lookup<sc::cubic>(t, v, [&] { return rate(v); }); });
+    out.insert(out.end(), t.values.begin(), t.values.end());
+    if (!ok) std::printf("vector lanes differ from doubles\n");
+    std::FILE* f = std::fopen(argv[1], "wb");
+    if (!f || std::fwrite(out.data(), sizeof(double), out.size(), f) != out.size() || std::fclose(f) != 0) {
+        std::printf("cannot write %s\n", argv[1]);
+        return 1;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+# Runs two builds of a test program writing its results to the file named by
+# its argument, see test/simd_bits.cpp and test/math_bits.cpp, and fails unless
+# both pass and write the same bits.
+#
+#   cmake -DREFERENCE=<program> -DCANDIDATE=<program> -DOUTPUT=<prefix> -P same_bits.cmake
+foreach(run REFERENCE CANDIDATE)
+  execute_process(COMMAND ${${run}} ${OUTPUT}_${run}.bin RESULT_VARIABLE failed)
+  if(failed)
+    message(FATAL_ERROR "${${run}} failed")
+  endif()
+endforeach()
+execute_process(COMMAND ${CMAKE_COMMAND} -E compare_files ${OUTPUT}_REFERENCE.bin ${OUTPUT}_CANDIDATE.bin RESULT_VARIABLE differs)
+if(differs)
+  message(FATAL_ERROR "${CANDIDATE} computes different bits from ${REFERENCE}")
+endif()
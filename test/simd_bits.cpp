@@ -0,0 +1,545 @@
+// Generates a program checking that the vector variants of an example kernel
+// compute the same bits as its scalar variant.
+//
+//   simd_bits <example> <output.cpp> [linear|cubic|index <reference.cpp> | colored]
+//
+// The program holds the kernel with one variant per ISA, see
+// CXXOptions::dispatch, and a main running every variant the CPU supports on
+// the same inputs, over a range which is not a multiple of any vector width.
+// It prints each array differing from the scalar one and exits non-zero; given
+// a file name it also writes the scalar results there, to compare builds with
+// different flags, see test/same_bits.cmake.
+//
+// Given an interpolation, the kernel looks up the voltage's rate functions in
+// tables, see TableOptions, and the same kernel without tables goes to
+// <reference.cpp>. Every variant must then compute the same bits as the
+// reference for voltages outside the tables, NaN among them, and agree with it
+// to `__tolerance` inside. The voltages include whole vectors outside the
+// tables, and vectors where only some lanes are.
+//
+// Given `index`, the kernel reads its first argument and accumulates its
+// results through a node index, see CXXOptions::node_index, holding runs of
+// every kind and a ragged tail. Every variant must compute the same bits as
+// the kernel without index in <reference.cpp>, called on the inputs gathered
+// per CV, with each result then added to its node one CV at a time.
+//
+// Given `colored`, the kernel also comes as <kernel>_colored, see
+// CXXOptions::colored, which runs on a schedule of the same index, on 1 and on
+// more threads if OpenMP is enabled. The arrays on CVs must be permuted before,
+// and hold their results in permuted order after; then all arrays must hold the
+// same bits as after the sequential kernel on the original order.
+#include <fstream>
+#include <functional>
+
+#include "AST.hpp"
+#include "Types.hpp"
+#include "TailCPS.hpp"
+#include "Simplify.hpp"
+#include "GenCXX.hpp"
+
+using namespace AST;
+using ISA = TailCPS::CXXOptions::ISA;
+using Interpolation = TailCPS::TableOptions::Interpolation;
+
+namespace {
+    // the kernels of main.cpp, a conditional to check selects, and one
+    // calling a helper in an arm
+    std::map<std::string, std::pair<expr, std::map<size_t, std::pair<size_t, size_t>>>> examples() {
+        auto Ih_current =
+            lambda({"sim", "mech"},
+                   pi("sim_v", 0, "sim"_var,
+                      pi("sim_i", 1, "sim"_var,
+                         pi("sim_g", 2, "sim"_var,
+                            pi("mech_m", 0, "mech"_var,
+                               pi("mech_gbar", 1, "mech"_var,
+                                  pi("mech_ehcn", 2, "mech"_var,
+                                     let("i_new",
+                                         ("sim_i"_var + (("mech_gbar"_var * "mech_m"_var) * ("sim_v"_var - "mech_ehcn"_var))),
+                                         let("g_new",
+                                             ("sim_g"_var + ("mech_gbar"_var * "mech_m"_var)),
+                                             tuple({"i_new"_var, "g_new"_var}))))))))),
+                   {tuple_t({f64_t(), f64_t(), f64_t()}), tuple_t({f64_t(), f64_t(Kind::Unique), f64_t(Kind::Unique)})});
+        auto Na_m_gate =
+            lambda({"sim", "mech"},
+                   pi("sim_v", 0, "sim"_var,
+                      pi("sim_dt", 1, "sim"_var,
+                         pi("mech_m", 0, "mech"_var,
+                            let("alpha", exprelr((0.0_f64 - ("sim_v"_var + 40.0_f64)) / 10.0_f64),
+                                let("beta", 4.0_f64 * exp((0.0_f64 - ("sim_v"_var + 65.0_f64)) / 18.0_f64),
+                                    let("tau", 1.0_f64 / ("alpha"_var + "beta"_var),
+                                        let("inf", "alpha"_var * "tau"_var,
+                                            let("m_new", "inf"_var + ("mech_m"_var - "inf"_var) * exp((0.0_f64 - "sim_dt"_var) / "tau"_var),
+                                                tuple({"m_new"_var}))))))))));
+        auto rectifier =
+            lambda({"sim", "mech"},
+                   pi("sim_v", 0, "sim"_var,
+                      pi("mech_g", 0, "mech"_var,
+                         tuple({cond(gt("sim_v"_var, 0.0_f64),
+                                     "mech_g"_var * exp("sim_v"_var / 25.0_f64),
+                                     "mech_g"_var * log(1.0_f64 - "sim_v"_var))}))),
+                   {tuple_t({f64_t()}), tuple_t({f64_t(Kind::Unique)})});
+        // too large to inline, so it stays a helper
+        auto helper =
+            lambda({"sim", "mech"},
+                   pi("sim_v", 0, "sim"_var,
+                      pi("mech_w", 0, "mech"_var,
+                         let("rate",
+                             lambda({"x"},
+                                    exp("x"_var / 25.0_f64) / (1.0_f64 + exp((0.0_f64 - "x"_var) / 10.0_f64)) + log(1.0_f64 + "x"_var * "x"_var),
+                                    {f64_t()}),
+                             tuple({cond(gt("sim_v"_var, 0.0_f64),
+                                         apply("rate"_var, {"sim_v"_var}),
+                                         "mech_w"_var * "mech_w"_var),
+                                    apply("rate"_var, {"mech_w"_var})})))),
+                   {tuple_t({f64_t()}), tuple_t({f64_t()})});
+        // the same with a closure, which is not converted: the kernel falls
+        // back to its scalar loop
+        auto closure =
+            lambda({"sim", "mech"},
+                   pi("sim_v", 0, "sim"_var,
+                      pi("mech_w", 0, "mech"_var,
+                         let("rate",
+                             lambda({"x"},
+                                    exp("x"_var / "mech_w"_var) / (1.0_f64 + exp((0.0_f64 - "x"_var) / 10.0_f64)) + log(1.0_f64 + "x"_var * "x"_var),
+                                    {f64_t()}),
+                             tuple({cond(gt("sim_v"_var, 0.0_f64),
+                                         apply("rate"_var, {"sim_v"_var}),
+                                         "mech_w"_var * "mech_w"_var),
+                                    apply("rate"_var, {"mech_w"_var})})))),
+                   {tuple_t({f64_t()}), tuple_t({f64_t()})});
+        return {{"Ih", {Ih_current, {{0, {0, 1}}, {1, {0, 2}}}}},
+                {"helper", {helper, {}}},
+                {"closure", {closure, {}}},
+                {"Na", {Na_m_gate, {{0, {1, 0}}}}},
+                {"rectifier", {rectifier, {}}}};
+    }
+
+    TailCPS::term optimise(const expr& e) {
+        auto cps = TailCPS::ast_to_cps(AST::alpha_convert(AST::typecheck(e)));
+        cps = shrink(prim_cse(shrink(unbox_tuples(contify(inline_calls(shrink(cps)))))));
+        return prim_fma(cps);
+    }
+
+    // the kernel's parameters in order, see GenCXX::kernel: an array per
+    // field it accesses, unique fields it only reads by value, then the
+    // results not stored in place. With a node index, the arrays of the
+    // indexed argument and of the results live on nodes.
+    struct Parameter {
+        bool array;
+        std::string description;
+        bool node = false;
+        bool result = false;
+    };
+
+    std::vector<Parameter> parameters(const TailCPS::LetF& kernel, const TailCPS::CXXOptions& options) {
+        auto access = TailCPS::field_access(kernel, options);
+        const auto& fun_t = std::get<Types::TyFunc>(*Types::resolve(kernel.type));
+        std::vector<Parameter> res;
+        auto add = [&](const Types::type& ty, TailCPS::Access mode, const std::string& description, bool node) {
+            if (mode == TailCPS::Access::None) return;
+            if (!std::holds_alternative<Types::TyF64>(*Types::resolve(ty))) {
+                throw std::runtime_error("Only f64 fields can be compared: "s + description);
+            }
+            auto array = Types::kind_of(ty) != Types::Kind::Unique;
+            res.push_back({array, description, array && node});
+        };
+        for (auto ix = 0ul; ix < kernel.args.size(); ++ix) {
+            auto ty = Types::resolve(fun_t.args[ix]);
+            auto arg = "argument " + std::to_string(ix);
+            auto node = options.node_index && (ix == options.index_arg);
+            if (std::holds_alternative<Types::TyTuple>(*ty)) {
+                const auto& fields = std::get<Types::TyTuple>(*ty).field_types;
+                for (auto jx = 0ul; jx < fields.size(); ++jx) add(fields[jx], access[ix][jx], arg + " field " + std::to_string(jx), node);
+            } else {
+                add(ty, access[ix][0], arg, node);
+            }
+        }
+        auto results = TailCPS::result_fields(kernel, options);
+        for (auto jx = 0ul; jx < results.size(); ++jx) {
+            if (results[jx] == TailCPS::Result::InPlace) continue;
+            res.push_back({true, "result " + std::to_string(jx), results[jx] == TailCPS::Result::Accumulate, true});
+        }
+        return res;
+    }
+
+    // what the generated program checks besides the vector variants: table
+    // lookups, or node indices, against the kernel without them, or the
+    // colored kernel against the sequential one
+    enum class Mode { Bits, Tables, Index, Colored };
+
+    // the kernel without tables or index, and the declarations of its header
+    struct Reference {
+        TailCPS::LetF kernel;
+        std::string header;
+    };
+
+    // relative to 1 + |reference|, for the table step in mV below and the
+    // rate functions of the examples; errors are below 2e-5 and 1e-7
+    double tolerance(Interpolation interpolation) {
+        return (interpolation == Interpolation::Linear) ? 1e-4 : 1e-6;
+    }
+
+    std::string list(const std::vector<Parameter>& arrays, const std::function<std::string(const Parameter&)>& f) {
+        std::string res;
+        for (const auto& param: arrays) res += f(param) + ", ";
+        return res;
+    }
+
+    void driver(std::ostream& os, const TailCPS::LetF& kernel, const TailCPS::CXXOptions& options, Mode mode, const std::optional<Reference>& reference) {
+        auto params = parameters(kernel, options);
+        std::vector<Parameter> arrays;
+        std::copy_if(params.begin(), params.end(), std::back_inserter(arrays), [](const auto& p) { return p.array; });
+        auto n_arrays = arrays.size();
+        auto call = [&](const std::string& name, const std::string& range, const std::string& tables) {
+            auto res = name + "(" + range;
+            auto ax = 0;
+            auto ux = 0;
+            for (const auto& param: params) {
+                if (param.array) {
+                    res += ", a[" + std::to_string(ax++) + "]";
+                } else {
+                    std::ostringstream value;
+                    value << 0.25*++ux;
+                    res += ", " + value.str();
+                }
+            }
+            return res + tables + ")";
+        };
+        if (reference) os << "\n" << reference->header;
+        os << R"(
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace {
+    // not a multiple of any vector width, to run the remainder loops
+    const std::size_t __n = 1027;
+)";
+        if (mode == Mode::Tables) {
+            os << "    // in the middle of the voltages, which sweep [-120, 60)\n"
+               << "    const double __lo = -100.0, __hi = 40.0, __step = 0x1p-5;\n"
+               << "    const double __tolerance = " << tolerance(options.tables.interpolation) << ";\n"
+               << "    sc::table __tables[" << kernel.name << "_tables_size];\n";
+        }
+        auto indexed = (mode == Mode::Index) || (mode == Mode::Colored);
+        if (indexed) {
+            os << "    // the CVs share nodes in [0, __n)\n"
+               << "    int __node[__n];\n"
+               << "    std::vector<sc::index_run> __runs;\n"
+               << "    // arrays on nodes, and the results among them\n"
+               << "    const bool __on_nodes[] = {" << list(arrays, [](const auto& p) { return p.node ? "true" : "false"; }) << "};\n"
+               << "    const bool __results[] = {" << list(arrays, [](const auto& p) { return p.result ? "true" : "false"; }) << "};\n";
+        }
+        os << "    const char* __names[] = {" << list(arrays, [](const auto& p) { return "\"" + p.description + "\""; }) << R"(};
+
+    // the same inputs for every variant: the first array sweeps the voltage
+    // range, the others hold values in (0, 1]
+    void __fill(double** a) {
+        for (std::size_t ix = 0; ix < )" << n_arrays << R"(; ++ix) {
+            std::uint64_t s = 0x9e3779b97f4a7c15ull*(ix + 1);
+            for (std::size_t jx = 0; jx < __n; ++jx) {
+                s ^= s << 13; s ^= s >> 7; s ^= s << 17;
+                double u = (double)((s >> 11) + 1)*0x1.0p-53;
+                a[ix][jx] = (ix == 0) ? -120.0 + 180.0*u : u;
+            }
+        })";
+        if (mode == Mode::Tables) {
+            os << R"(
+        // whole vectors below the tables, NaN, infinities, and their bounds
+        for (std::size_t jx = 0; jx < 64; ++jx) a[0][jx] -= 200.0;
+        for (std::size_t jx = 64; jx < __n; jx += 61) a[0][jx] = __builtin_nan("");
+        a[0][100] = __builtin_inf();
+        a[0][101] = -__builtin_inf();
+        a[0][102] = __lo;
+        a[0][103] = __hi;)";
+        }
+        os << R"(
+    }
+
+    double* __alloc() {
+        return (double*) std::aligned_alloc()" << options.alignment << ", (__n*sizeof(double) + " << options.alignment - 1 << ")/" << options.alignment << "*" << options.alignment << R"();
+    }
+)";
+        if (indexed) {
+            os << R"(
+    // blocks of the index width, two at a time of each kind of run:
+    // contiguous, constant, independent, and conflicting nodes; the last
+    // block is ragged
+    int __index() {
+        const std::size_t w = )" << kernel.name << R"(_index_width;
+        for (std::size_t cv = 0; cv < __n; ++cv) {
+            std::size_t block = cv/w, j = cv % w, base = (block*37) % (__n - w);
+            switch ((block/2) % 4) {
+                case 0: __node[cv] = (int)(base + j); break;
+                case 1: __node[cv] = (int) base; break;
+                case 2: __node[cv] = (int)(base + w - 1 - j); break;
+                default: __node[cv] = (int)(base + j/2); break;
+            }
+        }
+        __runs = sc::index_runs(__node, __n, w);
+        int kinds = 0;
+        for (const auto& run: __runs) kinds |= 1 << (int) run.kind;
+        if (kinds == 15 && __n % w != 0) return 0;
+        std::printf("the index lacks a kind of run, or a ragged tail\n");
+        return 1;
+    }
+)";
+        }
+        if (mode == Mode::Index) {
+            os << R"(
+    // the kernel without index, then the results added to their nodes one
+    // CV at a time, in order
+    void __run_reference(double** nodes) {
+        double* a[)" << n_arrays << R"(];
+        for (std::size_t ix = 0; ix < )" << n_arrays << R"(; ++ix) {
+            a[ix] = __on_nodes[ix] ? __alloc() : nodes[ix];
+            if (!__on_nodes[ix] || __results[ix]) continue;
+            for (std::size_t cv = 0; cv < __n; ++cv) a[ix][cv] = nodes[ix][__node[cv]];
+        }
+        )" << call(reference->kernel.name, "0, __n", "") << R"(;
+        for (std::size_t cv = 0; cv < __n; ++cv) {
+            for (std::size_t ix = 0; ix < )" << n_arrays << R"(; ++ix) if (__results[ix]) nodes[ix][__node[cv]] += a[ix][cv];
+        }
+        for (std::size_t ix = 0; ix < )" << n_arrays << R"(; ++ix) if (__on_nodes[ix]) std::free(a[ix]);
+    }
+
+    // bit for bit
+    int __check_reference(const char* name, double**, double** a, double** exact) {
+        int failed = 0;
+        for (std::size_t ix = 0; ix < )" << n_arrays << R"(; ++ix) {
+            for (std::size_t jx = 0; jx < __n; ++jx) {
+                if (std::memcmp(&a[ix][jx], &exact[ix][jx], sizeof(double)) == 0) continue;
+                std::printf("%s: %s differs from the reference at %zu: %a, reference %a\n", name, __names[ix], jx, a[ix][jx], exact[ix][jx]);
+                failed = 1;
+                break;
+            }
+        }
+        return failed;
+    }
+)";
+        }
+        if (mode == Mode::Tables) {
+            os << R"(
+    void __run_reference(double** a) { )" << call(reference->kernel.name, "0, __n", "") << R"(; }
+
+    // bit for bit outside the tables, to the tolerance inside
+    int __check_reference(const char* name, double** in, double** a, double** exact) {
+        const double* v = in[0];
+        int failed = 0;
+        for (std::size_t ix = 0; ix < )" << n_arrays << R"(; ++ix) {
+            for (std::size_t jx = 0; jx < __n; ++jx) {
+                double x = a[ix][jx], y = exact[ix][jx];
+                bool inside = (v[jx] >= __lo) && (v[jx] <= __hi);
+                if (inside ? std::fabs(x - y) <= __tolerance*(1.0 + std::fabs(y)) : std::memcmp(&x, &y, sizeof(double)) == 0) continue;
+                std::printf("%s: %s differs from the reference at %zu, voltage %a: %a, reference %a\n", name, __names[ix], jx, v[jx], x, y);
+                failed = 1;
+                break;
+            }
+        }
+        return failed;
+    }
+)";
+        }
+        if (mode == Mode::Colored) {
+            os << R"(
+    // the colored kernel on 1 and on all threads, in chunks of 64 CVs
+    int __check_colored() {
+        const sc::schedule __schedule = sc::color(__node, __n, )" << kernel.name << R"(_index_width, 64);
+        double* seq[)" << n_arrays << "];\n        double* col[" << n_arrays << R"(];
+        for (std::size_t ix = 0; ix < )" << n_arrays << R"(; ++ix) {
+            seq[ix] = __alloc();
+            col[ix] = __alloc();
+        }
+        double** a = seq;
+        __fill(a);
+        )" << call(kernel.name, "__runs.data(), __runs.size(), __node", "") << R"(;
+        int threads[] = {1, 1};
+#ifdef _OPENMP
+        threads[1] = omp_get_num_procs() > 1 ? omp_get_num_procs() : 2;
+#endif
+        int failed = 0;
+        for (int t: threads) {
+#ifdef _OPENMP
+            omp_set_num_threads(t);
+#endif
+            a = col;
+            __fill(a);
+            for (std::size_t ix = 0; ix < )" << n_arrays << R"(; ++ix) if (!__on_nodes[ix]) __schedule.permute(a[ix]);
+            )" << call(kernel.name + "_colored", "__schedule", "") << R"(;
+            for (std::size_t ix = 0; ix < )" << n_arrays << R"(; ++ix) {
+                for (std::size_t jx = 0; jx < __n; ++jx) {
+                    const double* expected = __on_nodes[ix] ? &seq[ix][jx] : &seq[ix][__schedule.permutation[jx]];
+                    if (std::memcmp(expected, &col[ix][jx], sizeof(double)) == 0) continue;
+                    std::printf("colored, %d threads: %s differs at %zu: %a, sequential %a\n", t, __names[ix], jx, col[ix][jx], *expected);
+                    failed = 1;
+                    break;
+                }
+            }
+        }
+        for (std::size_t ix = 0; ix < )" << n_arrays << R"(; ++ix) {
+            std::free(seq[ix]);
+            std::free(col[ix]);
+        }
+        return failed;
+    }
+)";
+        }
+        auto range = indexed ? "__runs.data(), __runs.size(), __node" : "0, __n";
+        auto tables = (mode == Mode::Tables) ? ", __tables" : "";
+        for (auto isa: TailCPS::dispatch_order(options.dispatch)) {
+            auto name = TailCPS::isa_name(isa);
+            os << "\n    void __run_" << name << "(double** a) { " << call(kernel.name + "_" + name, range, tables) << "; }";
+        }
+        os << R"(
+}
+
+int main(int argc, char** argv) {
+    double* ref[)" << n_arrays << "];\n    double* out[" << n_arrays << R"(];
+    double* in[)" << n_arrays << "];\n    double* exact[" << n_arrays << R"(];
+    for (std::size_t ix = 0; ix < )" << n_arrays << R"(; ++ix) {
+        ref[ix] = __alloc();
+        out[ix] = __alloc();
+        in[ix] = __alloc();
+        exact[ix] = __alloc();
+    }
+    int failed = 0;
+)";
+        if (mode == Mode::Tables) os << "    " << kernel.name << "_tables_init(__tables, __lo, __hi, __step);\n";
+        if (indexed) os << "    failed |= __index();\n";
+        if (mode == Mode::Colored) os << "    failed |= __check_colored();\n";
+        os << R"(    __fill(ref);
+    __run_scalar(ref);
+    if (argc > 1) {
+        std::FILE* f = std::fopen(argv[1], "wb");
+        for (std::size_t ix = 0; f && ix < )" << n_arrays << R"(; ++ix) std::fwrite(ref[ix], sizeof(double), __n, f);
+        if (!f || std::fclose(f) != 0) {
+            std::printf("cannot write %s\n", argv[1]);
+            failed = 1;
+        }
+    }
+)";
+        if (reference) {
+            os << "    __fill(in);\n"
+               << "    __fill(exact);\n"
+               << "    __run_reference(exact);\n"
+               << "    failed |= __check_reference(\"scalar\", in, ref, exact);\n";
+        }
+        for (auto isa: TailCPS::dispatch_order(options.dispatch)) {
+            if (isa == ISA::Scalar) continue;
+            auto name = TailCPS::isa_name(isa);
+            auto check = TailCPS::isa_check(isa);
+            os << "    if (" << (check.empty() ? "true" : check) << ") {\n"
+               << "        __fill(out);\n"
+               << "        __run_" << name << "(out);\n"
+               << "        for (std::size_t ix = 0; ix < " << n_arrays << "; ++ix) {\n"
+               << "            for (std::size_t jx = 0; jx < __n; ++jx) {\n"
+               << "                if (std::memcmp(&ref[ix][jx], &out[ix][jx], sizeof(double)) == 0) continue;\n"
+               << "                std::printf(\"" << name << ": %s differs at %zu: %a, scalar %a\\n\", __names[ix], jx, out[ix][jx], ref[ix][jx]);\n"
+               << "                failed = 1;\n"
+               << "                break;\n"
+               << "            }\n"
+               << "        }\n";
+            if (reference) os << "        failed |= __check_reference(\"" << name << "\", in, out, exact);\n";
+            os << "    } else {\n"
+               << "        std::printf(\"" << name << ": not supported, skipped\\n\");\n"
+               << "    }\n";
+        }
+        os << R"(    for (std::size_t ix = 0; ix < )" << n_arrays << R"(; ++ix) {
+        std::free(ref[ix]);
+        std::free(out[ix]);
+        std::free(in[ix]);
+        std::free(exact[ix]);
+    }
+    return failed;
+}
+)";
+    }
+
+    // the SoA kernel with variants for all ISAs
+    TailCPS::CXXOptions soa(const std::map<size_t, std::pair<size_t, size_t>>& in_place) {
+        auto options = TailCPS::CXXOptions{};
+        options.layout = TailCPS::CXXOptions::Layout::SoA;
+        options.dispatch = {ISA::Vector, ISA::SSE2, ISA::AVX2, ISA::AVX512};
+        options.in_place = in_place;
+        return options;
+    }
+
+    // the types of the kernel's arguments decide its parameters; helpers
+    // come first, and are called
+    std::optional<TailCPS::LetF> entry(const TailCPS::term& kernel) {
+        auto lifted = TailCPS::infer_types(TailCPS::lambda_lift(kernel));
+        Symbols::Set called;
+        Traverse::walk([&](const auto& t) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(t)>, TailCPS::AppF>) called.insert(t.name);
+        }, lifted);
+        std::optional<TailCPS::LetF> found;
+        Traverse::walk([&](const auto& t) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(t)>, TailCPS::LetF>) if (!found && !called.contains(t.name)) found = t;
+        }, lifted);
+        return found;
+    }
+}
+
+int main(int argc, char** argv) {
+    auto all = examples();
+    std::map<std::string, Interpolation> interpolations = {{"linear", Interpolation::Linear}, {"cubic", Interpolation::Cubic}};
+    auto mode = Mode::Bits;
+    if ((argc == 5) && interpolations.count(argv[3])) mode = Mode::Tables;
+    if ((argc == 5) && (argv[3] == "index"s)) mode = Mode::Index;
+    if ((argc == 4) && (argv[3] == "colored"s)) mode = Mode::Colored;
+    if (((argc != 3) && (mode == Mode::Bits)) || !all.count(argv[1])) {
+        std::cerr << "usage: simd_bits <example> <output.cpp> [linear|cubic|index <reference.cpp> | colored], examples:";
+        for (const auto& [name, example]: all) std::cerr << " " << name;
+        std::cerr << '\n';
+        return 1;
+    }
+    Memory::Scope arena;
+    Types::Scope types;
+    auto [e, in_place] = all.at(argv[1]);
+    auto kernel = optimise(e);
+    auto options = soa(in_place);
+    if (mode == Mode::Tables) {
+        options.tables.enabled = true;
+        options.tables.interpolation = interpolations.at(argv[3]);
+    }
+    if ((mode == Mode::Index) || (mode == Mode::Colored)) {
+        // results on nodes accumulate, they cannot go into the indexed
+        // argument in place
+        for (auto it = in_place.begin(); it != in_place.end();) it = (it->second.first == options.index_arg) ? in_place.erase(it) : std::next(it);
+        options.in_place = in_place;
+        options.node_index = true;
+        options.colored = (mode == Mode::Colored);
+    }
+    auto found = entry(kernel);
+    if (!found) {
+        std::cerr << "No kernel in " << argv[1] << '\n';
+        return 1;
+    }
+    std::optional<Reference> reference;
+    if ((mode == Mode::Tables) || (mode == Mode::Index)) {
+        // a copy has names of its own
+        auto plain = TailCPS::copy(kernel, {});
+        std::ofstream ros(argv[4]);
+        std::ostringstream header;
+        generate_cxx(ros, header, plain, soa(in_place));
+        if (!ros) return 1;
+        reference = Reference{*entry(plain), header.str()};
+        // the generated file includes the reference's declarations
+        reference->header.erase(0, reference->header.find('\n') + 1);
+    }
+    std::ofstream os(argv[2]);
+    std::ostringstream header;
+    generate_cxx(os, header, kernel, options);
+    if ((mode == Mode::Tables) && (header.str().find(found->name + "_tables_init") == std::string::npos)) {
+        std::cerr << "No tables in " << argv[1] << '\n';
+        return 1;
+    }
+    driver(os, *found, options, mode, reference);
+    return os ? 0 : 1;
+}